@@ -0,0 +1,187 @@
+#include "batch.hpp"
+#include "io.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <fmt/color.h>
+#include <fmt/format.h>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace bfjit {
+
+    namespace {
+        // records a thread takes at once, so threads don't fight over the
+        // next one when records are tiny
+        constexpr size_t RECORDS_PER_CHUNK = 256;
+        // chunks that can be done but not written yet, per thread, so a slow
+        // record doesn't let the others buffer the whole output
+        constexpr size_t CHUNKS_AHEAD_PER_THREAD = 4;
+
+        void print_error(std::string_view message) {
+            fmt::print(stderr, fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
+            fmt::print(stderr, ": {}\n", message);
+        }
+
+        auto split_records(std::span<uint8_t const> input, RecordFormat format) -> std::optional<std::vector<std::span<uint8_t const>>> {
+            std::vector<std::span<uint8_t const>> records;
+            switch (format) {
+            case RecordFormat::Lines:
+                while (!input.empty()) {
+                    auto const end = std::find(input.begin(), input.end(), uint8_t('\n'));
+                    auto const size = size_t(end - input.begin());
+                    records.push_back(input.first(size));
+                    input = input.subspan(std::min(size + 1, input.size()));
+                }
+                break;
+            case RecordFormat::LengthPrefixed:
+                while (!input.empty()) {
+                    if (input.size() < 4) {
+                        print_error(fmt::format("record {} is cut off in its size", records.size()));
+                        return std::nullopt;
+                    }
+                    auto const size = size_t(input[0]) | size_t(input[1]) << 8 | size_t(input[2]) << 16 | size_t(input[3]) << 24;
+                    input = input.subspan(4);
+                    if (input.size() < size) {
+                        print_error(fmt::format("record {} is {} bytes but only {} are left", records.size(), size, input.size()));
+                        return std::nullopt;
+                    }
+                    records.push_back(input.first(size));
+                    input = input.subspan(size);
+                }
+                break;
+            }
+            return records;
+        }
+
+        // collects the output of a chunk of records until it's its turn
+        class ChunkOutput : public OutputSink {
+        public:
+            explicit ChunkOutput(RecordFormat format) :
+                m_format(format)
+            {}
+
+            void begin_record() {
+                m_record_start = m_data.size();
+                if (m_format == RecordFormat::LengthPrefixed)
+                    m_data.resize(m_data.size() + 4);
+            }
+            void end_record() {
+                if (m_format != RecordFormat::LengthPrefixed)
+                    return;
+                auto const size = uint32_t(m_data.size() - m_record_start - 4);
+                for (size_t i = 0; i < 4; i++)
+                    m_data[m_record_start + i] = uint8_t(size >> (8 * i));
+            }
+            void write(std::span<uint8_t const> data) override {
+                m_data.insert(m_data.end(), data.begin(), data.end());
+            }
+            [[nodiscard]]
+            auto data() const -> std::span<uint8_t const> { return m_data; }
+
+        private:
+            RecordFormat m_format;
+            std::vector<uint8_t> m_data;
+            size_t m_record_start = 0;
+        };
+
+        auto write_all(int fd, std::span<uint8_t const> data) -> bool {
+            while (!data.empty()) {
+                auto const written = ::write(fd, data.data(), data.size());
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written <= 0)
+                    return false;
+                data = data.subspan(size_t(written));
+            }
+            return true;
+        }
+    }
+
+    auto run_batch(CompiledProgram const& program, std::span<uint8_t const> input, RecordFormat format, size_t threads) -> bool {
+        auto const records = split_records(input, format);
+        if (!records)
+            return false;
+        auto const chunk_count = (records->size() + RECORDS_PER_CHUNK - 1) / RECORDS_PER_CHUNK;
+        threads = std::max<size_t>(1, std::min(threads, chunk_count));
+        auto const window = threads * CHUNKS_AHEAD_PER_THREAD;
+
+        // filled in by whichever thread ran the chunk, emptied once written
+        std::vector<std::optional<ChunkOutput>> chunks(chunk_count);
+        std::mutex mutex;
+        // signals both a chunk being done and one being written
+        std::condition_variable changed;
+        size_t next_chunk = 0;
+        size_t written = 0;
+        std::atomic<bool> failed = false;
+
+        auto worker = [&]() {
+            std::vector<uint8_t> tape(program.tape_size());
+            while (true) {
+                size_t chunk;
+                {
+                    std::unique_lock lock(mutex);
+                    changed.wait(lock, [&]() { return next_chunk == chunk_count || next_chunk < written + window; });
+                    if (next_chunk == chunk_count)
+                        return;
+                    chunk = next_chunk++;
+                }
+
+                ChunkOutput output(format);
+                auto const end = std::min(records->size(), (chunk + 1) * RECORDS_PER_CHUNK);
+                for (auto record = chunk * RECORDS_PER_CHUNK; record < end; record++) {
+                    // the whole tape, nothing tells how much of it the last
+                    // record used, see BATCH_TAPE_SIZE
+                    std::memset(tape.data(), 0, tape.size());
+                    output.begin_record();
+                    switch (program.run(tape, (*records)[record], output)) {
+                        case CompiledProgram::RunResult::OutOfBounds:
+                            print_error(fmt::format("record {} tried to access data outside of bounds", record));
+                            failed = true;
+                            break;
+                        case CompiledProgram::RunResult::InfiniteLoop:
+                            print_error(fmt::format("record {} got stuck in an infinite loop", record));
+                            failed = true;
+                            break;
+                        default: break;
+                    }
+                    output.end_record();
+                }
+
+                std::lock_guard lock(mutex);
+                chunks[chunk].emplace(std::move(output));
+                changed.notify_all();
+            }
+        };
+
+        std::vector<std::thread> pool;
+        for (size_t i = 0; i < threads; i++)
+            pool.emplace_back(worker);
+
+        // writes the chunks in order as they're done
+        while (written < chunk_count) {
+            ChunkOutput output(format);
+            {
+                std::unique_lock lock(mutex);
+                changed.wait(lock, [&]() { return chunks[written].has_value(); });
+                output = std::move(*chunks[written]);
+                chunks[written].reset();
+            }
+            if (!write_all(1, output.data()))
+                failed = true;
+            std::lock_guard lock(mutex);
+            written++;
+            changed.notify_all();
+        }
+
+        for (auto& thread : pool)
+            thread.join();
+        return !failed;
+    }
+
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "bfjit.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace bfjit {
+
+    // How a batch's input is split into records
+    enum class RecordFormat {
+        // every line is a record, without its newline. Outputs are written
+        // one after the other
+        Lines,
+        // every record is preceded by its size as a 32 bit little endian
+        // number, and so is every output
+        LengthPrefixed,
+    };
+
+    // Cells of a batch's tapes unless -t says otherwise. Every record starts
+    // on a cleared tape, so it's only as big as most programs need.
+    constexpr size_t BATCH_TAPE_SIZE = 32 * 1024;
+
+    // Runs `program` once for every record in `input`, on `threads` threads
+    // with a tape each, and writes the outputs to stdout in the order of the
+    // records. A record that accesses data outside of the tape is reported
+    // and the rest keep going. False if any record failed or the input
+    // couldn't be split.
+    [[nodiscard]]
+    auto run_batch(CompiledProgram const& program, std::span<uint8_t const> input, RecordFormat format, size_t threads) -> bool;
+
+}
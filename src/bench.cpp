@@ -0,0 +1,466 @@
+#include "cache.hpp"
+#include "interpreter.hpp"
+#include "jit.hpp"
+#include "optimizer.hpp"
+#include "packed.hpp"
+#include "options.hpp"
+#include "parser.hpp"
+#include "threaded.hpp"
+#include "tiered.hpp"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <filesystem>
+#include <fmt/color.h>
+#include <fmt/format.h>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Runs every example under every engine and reports how long each phase took.
+// The JSON has one result per line so it can be diffed, and compared against a
+// baseline written by a previous run with -b. Every engine must write the
+// same output as the interpreter, or the benchmark fails.
+
+namespace {
+
+    enum class Engine {
+        Interpreter,
+        Threaded,
+        Tiered,
+        Jit,
+        JitUnoptimized,
+    };
+    constexpr Engine ENGINES[] = { Engine::Interpreter, Engine::Threaded, Engine::Tiered, Engine::Jit, Engine::JitUnoptimized };
+
+    auto engine_name(Engine engine) -> std::string_view {
+        switch (engine) {
+        case Engine::Interpreter: return "interpreter";
+        case Engine::Threaded: return "threaded";
+        case Engine::Tiered: return "tiered";
+        case Engine::Jit: return "jit";
+        case Engine::JitUnoptimized: return "jit-unoptimized";
+        }
+        return "unknown";
+    }
+
+    // milliseconds spent on each phase of one run
+    struct Timings {
+        double parse = 0;
+        double optimize = 0;
+        // packing, decoding or compiling, whatever the engine does before running
+        double codegen = 0;
+        double execute = 0;
+    };
+
+    struct Result {
+        std::string program;
+        Engine engine;
+        // dispatches of the interpreter, a superinstruction is one, 0 if not counted
+        uint64_t ops = 0;
+        Timings median;
+    };
+
+    constexpr double MIN_COMPARABLE_MS = 1.0;
+
+    using Clock = std::chrono::steady_clock;
+    auto elapsed_ms(Clock::time_point since) -> double {
+        return std::chrono::duration<double, std::milli>(Clock::now() - since).count();
+    }
+
+    // Captures the programs' output in a temporary file (and gives them an
+    // empty input) while alive
+    class Silence {
+    public:
+        Silence() :
+            m_stdin(dup(0)),
+            m_stdout(dup(1)),
+            m_capture(std::tmpfile())
+        {
+            if (m_capture == nullptr) {
+                fmt::print(stderr, fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
+                fmt::print(stderr, ": could not create a file for the output\n");
+                std::exit(1);
+            }
+            std::fflush(stdout);
+            auto const null = open("/dev/null", O_RDWR);
+            dup2(null, 0);
+            dup2(fileno(m_capture), 1);
+            close(null);
+        }
+        ~Silence() {
+            std::fflush(stdout);
+            dup2(m_stdin, 0);
+            dup2(m_stdout, 1);
+            close(m_stdin);
+            close(m_stdout);
+            std::fclose(m_capture);
+        }
+        Silence(Silence const&) = delete;
+        Silence& operator = (Silence const&) = delete;
+
+        // of everything written so far
+        auto output_hash() -> uint64_t {
+            std::fflush(stdout);
+            bfjit::Hasher hasher;
+            char chunk[64 * 1024];
+            off_t offset = 0;
+            for (ssize_t got; (got = pread(fileno(m_capture), chunk, sizeof(chunk), offset)) > 0; offset += got)
+                hasher.add(chunk, size_t(got));
+            hasher.add(offset);
+            return hasher.value;
+        }
+
+    private:
+        int m_stdin;
+        int m_stdout;
+        std::FILE* m_capture;
+    };
+
+    auto load_program(std::filesystem::path const& path) -> std::string {
+        auto handle = std::ifstream( path, std::ios::binary );
+        return std::string(std::istreambuf_iterator<char>(handle), std::istreambuf_iterator<char>());
+    }
+
+    auto op_name(bfjit::BFOp::Type type) -> std::string_view {
+        using Type = bfjit::BFOp::Type;
+        switch (type) {
+        case Type::Mod: return "Mod";
+        case Type::ModPtr: return "ModPtr";
+        case Type::In: return "In";
+        case Type::Out: return "Out";
+        case Type::LoopBeg: return "LoopBeg";
+        case Type::LoopEnd: return "LoopEnd";
+        case Type::SetValue: return "SetValue";
+        case Type::MulAdd: return "MulAdd";
+        case Type::Scan: return "Scan";
+        case Type::Halt: return "Halt";
+        }
+        return "unknown";
+    }
+
+    using OpPair = std::pair<bfjit::BFOp::Type, bfjit::BFOp::Type>;
+
+    // Adds how many times each op ran right after another one in the
+    // interpreter to `pairs`, to find superinstruction candidates. Fused pairs
+    // count as the two ops they are made of.
+    void count_pairs(std::string_view program, bfjit::CLIOpts const& cli_opts, std::map<OpPair, uint64_t>& pairs) {
+        using Type = bfjit::BFOp::Type;
+        auto const bytecode = bfjit::optimize(bfjit::parse_program(program), cli_opts.cell_width, cli_opts.tape_size);
+        Silence silence;
+        auto interpreter = bfjit::Interpreter( bytecode, cli_opts );
+        std::optional<Type> previous;
+        auto ran = [&](Type op) {
+            if (previous)
+                pairs[{ *previous, op }]++;
+            previous = op;
+        };
+        while (!interpreter.finished()) {
+            auto const pos = interpreter.m_ip;
+            auto const word = interpreter.m_bytecode[pos];
+            if (!interpreter.run_one_step())
+                break;
+            ran(Type(word.unfused_type()));
+            // a LoopEnd that jumps back doesn't run the op after it
+            if (word.type() != word.unfused_type() && (word.type() != bfjit::PackedOp::LOOPEND_MULADD || interpreter.m_ip == pos + 2))
+                ran(Type(interpreter.m_bytecode[pos + 1].type()));
+        }
+        interpreter.m_output.flush();
+    }
+
+    // `output_hash` gets what Silence::output_hash() says of the run
+    auto run_once(std::string_view program, Engine engine, bfjit::CLIOpts const& cli_opts, uint64_t* ops, uint64_t& output_hash) -> Timings {
+        Timings timings;
+        auto start = Clock::now();
+        auto bytecode = bfjit::parse_program(program);
+        timings.parse = elapsed_ms(start);
+
+        if (engine != Engine::JitUnoptimized) {
+            start = Clock::now();
+            bytecode = bfjit::optimize(bytecode, cli_opts.cell_width, cli_opts.tape_size);
+            timings.optimize = elapsed_ms(start);
+        }
+
+        Silence silence;
+        switch (engine) {
+        case Engine::Interpreter: {
+            start = Clock::now();
+            auto interpreter = bfjit::Interpreter( bytecode, cli_opts );
+            timings.codegen = elapsed_ms(start);
+            start = Clock::now();
+            uint64_t count = 0;
+            while (interpreter.run_one_step())
+                count++;
+            interpreter.m_output.flush();
+            timings.execute = elapsed_ms(start);
+            if (ops)
+                *ops = count;
+            break;
+        }
+        case Engine::Threaded: {
+            start = Clock::now();
+            auto interpreter = bfjit::ThreadedInterpreter( bytecode, cli_opts );
+            timings.codegen = elapsed_ms(start);
+            start = Clock::now();
+            interpreter.run_until_end();
+            timings.execute = elapsed_ms(start);
+            break;
+        }
+        case Engine::Tiered: {
+            // loops are compiled while running, so that's all execution time
+            start = Clock::now();
+            auto tiered = bfjit::Tiered( bytecode, cli_opts );
+            tiered.run_until_end();
+            timings.execute = elapsed_ms(start);
+            break;
+        }
+        case Engine::Jit:
+        case Engine::JitUnoptimized: {
+            start = Clock::now();
+            auto jit = bfjit::JIT( bytecode, cli_opts );
+            jit.do_codegen();
+            timings.codegen = elapsed_ms(start);
+            start = Clock::now();
+            jit.run_until_end();
+            timings.execute = elapsed_ms(start);
+            break;
+        }
+        }
+        output_hash = silence.output_hash();
+        return timings;
+    }
+
+    auto median(std::vector<double> values) -> double {
+        std::sort(values.begin(), values.end());
+        return values[values.size() / 2];
+    }
+
+    auto to_json(Result const& result) -> std::string {
+        return fmt::format(R"({{"program": "{}", "engine": "{}", "ops": {}, "parse_ms": {:.3f}, "optimize_ms": {:.3f}, "codegen_ms": {:.3f}, "execute_ms": {:.3f}}})",
+            result.program, engine_name(result.engine), result.ops,
+            result.median.parse, result.median.optimize, result.median.codegen, result.median.execute);
+    }
+
+    // value of "key" in a line written by to_json
+    auto json_field(std::string_view line, std::string_view key) -> std::optional<std::string_view> {
+        auto const pattern = fmt::format("\"{}\": ", key);
+        auto pos = line.find(pattern);
+        if (pos == std::string_view::npos)
+            return std::nullopt;
+        line = line.substr(pos + pattern.size());
+        if (line.starts_with("\"")) {
+            line = line.substr(1);
+            return line.substr(0, line.find('"'));
+        }
+        return line.substr(0, line.find_first_of(",}"));
+    }
+
+    // execute_ms of every program/engine pair in a baseline
+    auto load_baseline(std::filesystem::path const& path) -> std::map<std::string, double> {
+        std::map<std::string, double> baseline;
+        auto handle = std::ifstream( path );
+        for (std::string line; std::getline(handle, line);) {
+            auto const program = json_field(line, "program");
+            auto const engine = json_field(line, "engine");
+            auto const execute = json_field(line, "execute_ms");
+            if (!program || !engine || !execute)
+                continue;
+            baseline[fmt::format("{}/{}", *program, *engine)] = std::stod(std::string(*execute));
+        }
+        return baseline;
+    }
+
+    void print_usage(char const* argv) {
+        fmt::print(stderr, R"(Usage:
+{} [-n TRIALS] [-o OUTPUT] [-b BASELINE] [-r PERCENT] [-e ENGINE] [-g] EXAMPLE...
+Runs every example (or every .bf file in a directory) under each engine.
+OPTIONS:
+    -n TRIALS   runs per example and engine, the median is reported (default 5)
+    -o OUTPUT   write the JSON results to OUTPUT instead of stdout
+    -b BASELINE compare against a previous output and fail on regressions.
+                Any engine writing something else than the interpreter fails
+                with or without it
+    -r PERCENT  how much slower than the baseline is a regression (default 10)
+    -e ENGINE   only run ENGINE, can be repeated: interpreter, threaded,
+                tiered, jit or jit-unoptimized
+    -g          don't time anything, print the op pairs the interpreter ran
+                the most over all examples instead
+)", argv);
+    }
+
+    void print_error(std::string_view message) {
+        fmt::print(stderr, fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
+        fmt::print(stderr, ": {}\n", message);
+    }
+
+}
+
+int main(int const argc, char const *argv[]) {
+    size_t trials = 5;
+    double threshold = 10;
+    char const* output_path = nullptr;
+    char const* baseline_path = nullptr;
+    std::vector<Engine> engines;
+    std::vector<std::filesystem::path> programs;
+    bool op_pairs = false;
+
+    for (int i = 1; i < argc; i++) {
+        auto arg = std::string_view{ argv[i] };
+        auto const value = i + 1 < argc ? std::string_view{ argv[i + 1] } : std::string_view{};
+        if (arg == "-h") {
+            print_usage(argv[0]);
+            return 0;
+        } else if (arg == "-n") {
+            auto const [_, err] = std::from_chars(value.data(), value.data() + value.size(), trials);
+            if (err != std::errc() || trials == 0) {
+                print_error("-n expects a positive number");
+                return 1;
+            }
+            i++;
+        } else if (arg == "-r") {
+            auto const [_, err] = std::from_chars(value.data(), value.data() + value.size(), threshold);
+            if (err != std::errc() || threshold < 0) {
+                print_error("-r expects a percentage");
+                return 1;
+            }
+            i++;
+        } else if (arg == "-o" || arg == "-b") {
+            if (value.empty()) {
+                print_error(fmt::format("{} expects a file", arg));
+                return 1;
+            }
+            (arg == "-o" ? output_path : baseline_path) = argv[++i];
+        } else if (arg == "-e") {
+            auto const found = std::find_if(std::begin(ENGINES), std::end(ENGINES), [&](Engine engine) { return engine_name(engine) == value; });
+            if (found == std::end(ENGINES)) {
+                print_error(fmt::format("unknown engine: {}", value));
+                return 1;
+            }
+            engines.push_back(*found);
+            i++;
+        } else if (arg == "-g") {
+            op_pairs = true;
+        } else if (arg.starts_with("-")) {
+            print_error(fmt::format("unknown flag: {}", arg));
+            print_usage(argv[0]);
+            return 1;
+        } else if (std::filesystem::is_directory(arg)) {
+            for (auto const& entry : std::filesystem::directory_iterator(arg))
+                if (entry.path().extension() == ".bf")
+                    programs.push_back(entry.path());
+        } else {
+            programs.push_back(arg);
+        }
+    }
+    if (programs.empty()) {
+        print_error("no examples to run");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (engines.empty())
+        engines.assign(std::begin(ENGINES), std::end(ENGINES));
+    std::sort(programs.begin(), programs.end());
+
+    bfjit::CLIOpts cli_opts;
+    cli_opts.eof_behavior = bfjit::EofBehavior::Zero;
+
+    std::map<OpPair, uint64_t> pairs;
+    std::vector<Result> results;
+    int mismatches = 0;
+    for (auto const& path : programs) {
+        auto const program = load_program(path);
+        auto const name = path.stem().string();
+        // needs input the benchmark can't give it
+        auto const bytecode = bfjit::parse_program(program);
+        if (std::any_of(bytecode.begin(), bytecode.end(), [](auto const& op) { return op.m_type == bfjit::BFOp::Type::In; })) {
+            fmt::print(stderr, "skipping {}, it reads input\n", name);
+            continue;
+        }
+        if (op_pairs) {
+            count_pairs(program, cli_opts, pairs);
+            continue;
+        }
+
+        // ops executed don't depend on the engine, count them once, and
+        // what the interpreter writes is what every engine must write
+        uint64_t ops = 0;
+        uint64_t expected_output = 0;
+        run_once(program, Engine::Interpreter, cli_opts, &ops, expected_output);
+        for (auto const engine : engines) {
+            std::vector<double> parse, optimize, codegen, execute;
+            bool wrong_output = false;
+            for (size_t trial = 0; trial < trials; trial++) {
+                uint64_t output = 0;
+                auto const timings = run_once(program, engine, cli_opts, nullptr, output);
+                wrong_output = wrong_output || output != expected_output;
+                parse.push_back(timings.parse);
+                optimize.push_back(timings.optimize);
+                codegen.push_back(timings.codegen);
+                execute.push_back(timings.execute);
+            }
+            auto& result = results.emplace_back(Result{
+                .program = name,
+                .engine = engine,
+                .ops = engine == Engine::JitUnoptimized ? 0 : ops,
+                .median = { median(parse), median(optimize), median(codegen), median(execute) },
+            });
+            fmt::print(stderr, "{:>16} {:>16} {:10.3f} ms\n", name, engine_name(engine), result.median.execute);
+            if (wrong_output) {
+                print_error(fmt::format("{} on {} wrote something else than the interpreter", name, engine_name(engine)));
+                mismatches++;
+            }
+        }
+    }
+
+    if (op_pairs) {
+        constexpr size_t SHOWN = 16;
+        uint64_t total = 0;
+        std::vector<std::pair<OpPair, uint64_t>> order(pairs.begin(), pairs.end());
+        for (auto const& [_, count] : order)
+            total += count;
+        auto const shown = std::min(SHOWN, order.size());
+        std::partial_sort(order.begin(), order.begin() + shown, order.end(), [](auto const& a, auto const& b) { return a.second > b.second; });
+        for (size_t i = 0; i < shown; i++) {
+            auto const& [pair, count] = order[i];
+            fmt::print(stderr, "{:>7.2f}% {:>14} {}, {}\n", 100.0 * double(count) / double(total), count, op_name(pair.first), op_name(pair.second));
+        }
+        return 0;
+    }
+
+    std::string json = fmt::format("{{\n\"trials\": {},\n\"results\": [\n", trials);
+    for (size_t i = 0; i < results.size(); i++)
+        json += fmt::format("{}{}\n", to_json(results[i]), i + 1 < results.size() ? "," : "");
+    json += "]\n}\n";
+    if (output_path) {
+        auto handle = std::ofstream( output_path );
+        handle << json;
+    } else {
+        fmt::print("{}", json);
+    }
+
+    if (!baseline_path)
+        return mismatches == 0 ? 0 : 1;
+    auto const baseline = load_baseline(baseline_path);
+    int regressions = 0;
+    for (auto const& result : results) {
+        auto const found = baseline.find(fmt::format("{}/{}", result.program, engine_name(result.engine)));
+        // too short to tell a regression from noise
+        if (found == baseline.end() || found->second < MIN_COMPARABLE_MS)
+            continue;
+        auto const change = (result.median.execute / found->second - 1) * 100;
+        if (change > threshold) {
+            print_error(fmt::format("{} on {} regressed {:.1f}% ({:.3f} ms -> {:.3f} ms)",
+                result.program, engine_name(result.engine), change, found->second, result.median.execute));
+            regressions++;
+        }
+    }
+    return regressions == 0 && mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,66 @@
+#include "bfjit.hpp"
+#include "jit.hpp"
+#include "optimizer.hpp"
+#include "parser.hpp"
+#include <utility>
+#include <vector>
+
+namespace bfjit {
+
+    struct CompiledProgram::Impl {
+        // the JIT keeps a reference to both, so they go first
+        CLIOpts options;
+        std::vector<BFOp> bytecode;
+        // only the code, run() brings the tape and the buffers
+        JIT jit;
+
+        Impl(std::vector<BFOp> code, CLIOpts const& cli_opts) :
+            options(cli_opts),
+            bytecode(std::move(code)),
+            jit(bytecode, options, JIT::CodeOnly{})
+        {
+            jit.do_codegen();
+        }
+    };
+
+    CompiledProgram::CompiledProgram(std::unique_ptr<Impl> impl) :
+        m_impl(std::move(impl))
+    {}
+    CompiledProgram::~CompiledProgram() = default;
+
+    auto CompiledProgram::compile(std::string_view source, CLIOpts options) -> std::unique_ptr<CompiledProgram> {
+        if (!valid_cell_width(options.cell_width))
+            return nullptr;
+        auto bytecode = try_parse_program(source);
+        if (!bytecode)
+            return nullptr;
+        PassManager::default_pipeline(options.cell_width, options.tape_size).run(*bytecode);
+        return compile(std::move(*bytecode), options);
+    }
+    auto CompiledProgram::compile(std::vector<BFOp> bytecode, CLIOpts options) -> std::unique_ptr<CompiledProgram> {
+        if (!valid_cell_width(options.cell_width))
+            return nullptr;
+        options.checked_tape = true;
+        options.debug_info = false;
+        options.profile_loops = false;
+        options.fuel = false;
+        return std::unique_ptr<CompiledProgram>(new CompiledProgram(std::make_unique<Impl>(std::move(bytecode), options)));
+    }
+
+    auto CompiledProgram::tape_size() const -> size_t {
+        // the JIT rounded it up to the page size
+        return m_impl->jit.m_tape_size;
+    }
+
+    auto CompiledProgram::run(std::span<uint8_t> tape, std::span<uint8_t const> input, OutputSink& output) const -> RunResult {
+        // the bounds checks were compiled for a tape of tape_size() bytes
+        if (tape.size() < tape_size())
+            return RunResult::TapeTooSmall;
+        switch (m_impl->jit.run_on(tape, input, output)) {
+            case JIT::RunOnResult::OutOfBounds: return RunResult::OutOfBounds;
+            case JIT::RunOnResult::InfiniteLoop: return RunResult::InfiniteLoop;
+            default: return RunResult::Finished;
+        }
+    }
+
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "io.hpp"
+#include "options.hpp"
+#include "parser.hpp"
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace bfjit {
+
+    // A program parsed, optimized and compiled once, for whoever embeds
+    // bfjit instead of running the executable. Every run gets its tape,
+    // input and output from the caller, so running allocates nothing and a
+    // single program can serve any number of threads at the same time.
+    class CompiledProgram {
+    public:
+        enum class RunResult {
+            Finished,
+            // the program moved outside of the tape and was stopped
+            OutOfBounds,
+            // the program got stuck in a loop it would never leave
+            InfiniteLoop,
+            // the tape given to run() is smaller than tape_size()
+            TapeTooSmall,
+        };
+
+        // nullptr if `options.cell_width` isn't 1, 2, 4 or 8 or the loops of
+        // `source` don't match, never aborts on a bad program. The tape is
+        // always bounds checked, whatever `options` says, since it doesn't
+        // have guard pages around it.
+        [[nodiscard]]
+        static auto compile(std::string_view source, CLIOpts options = {}) -> std::unique_ptr<CompiledProgram>;
+        // Like compile(), for bytecode that was already parsed and is
+        // compiled as it is, without optimizing it
+        [[nodiscard]]
+        static auto compile(std::vector<BFOp> bytecode, CLIOpts options = {}) -> std::unique_ptr<CompiledProgram>;
+
+        ~CompiledProgram();
+        CompiledProgram(CompiledProgram const&) = delete;
+        CompiledProgram(CompiledProgram &&) = delete;
+        CompiledProgram& operator = (CompiledProgram const&) = delete;
+        CompiledProgram& operator = (CompiledProgram &&) = delete;
+
+        // bytes run() needs at least, cells are `options.cell_width` bytes
+        // and in the byte order of the machine
+        [[nodiscard]]
+        auto tape_size() const -> size_t;
+        // Runs the program from the start on `tape`, which is used as it is,
+        // so it's up to the caller to zero it between runs. Output is
+        // written to `output` in chunks as it's produced.
+        [[nodiscard]]
+        auto run(std::span<uint8_t> tape, std::span<uint8_t const> input, OutputSink& output) const -> RunResult;
+
+    private:
+        // the bytecode and the JIT, out of this header so the API doesn't
+        // change along with them
+        struct Impl;
+
+        explicit CompiledProgram(std::unique_ptr<Impl> impl);
+
+        std::unique_ptr<Impl> m_impl;
+    };
+
+}
@@ -0,0 +1,187 @@
+#include "cache.hpp"
+#include "options.hpp"
+#include <cstring>
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+namespace bfjit {
+
+    namespace {
+        // bumped whenever the layout of a cache file changes
+        constexpr char MAGIC[8] = { 'b', 'f', 'j', 'i', 't', 'c', 0, 2 };
+        constexpr uint64_t CODE_ALIGNMENT = 64;
+
+        // followed by mapping_count offsets, the source_size bytes of the
+        // source and the code at code_offset
+        struct CacheHeader {
+            char magic[8];
+            uint64_t key;
+            uint64_t guard_size;
+            uint64_t mapping_count;
+            uint64_t source_size;
+            uint64_t code_offset;
+            uint64_t code_size;
+        };
+
+        // changes whenever bfjit is rebuilt, so code from another version (or
+        // with another InnerData layout) is never loaded
+        void hash_executable(Hasher& hasher) {
+            struct stat info;
+            if (stat("/proc/self/exe", &info) != 0) {
+                // nothing to tell builds apart, never share entries between runs
+                hasher.add(getpid());
+                return;
+            }
+            hasher.add(info.st_dev);
+            hasher.add(info.st_ino);
+            hasher.add(info.st_size);
+            std::error_code error;
+            hasher.add(std::filesystem::last_write_time("/proc/self/exe", error).time_since_epoch().count());
+        }
+        void hash_cpu(Hasher& hasher) {
+#if defined(__x86_64__) || defined(__i386__)
+            unsigned int regs[4] = {};
+            __get_cpuid(0, &regs[0], &regs[1], &regs[2], &regs[3]);
+            hasher.add(regs);
+            __get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3]);
+            // the APIC id in ebx differs between cores of the same CPU
+            regs[1] &= 0xffff;
+            hasher.add(regs);
+            __get_cpuid_count(7, 0, &regs[0], &regs[1], &regs[2], &regs[3]);
+            hasher.add(regs);
+#endif
+        }
+
+        auto entry_path(std::filesystem::path const& directory, uint64_t key) -> std::filesystem::path {
+            return directory / fmt::format("{:016x}.bfc", key);
+        }
+        auto align_up(uint64_t value, uint64_t alignment) -> uint64_t {
+            return (value + alignment - 1) / alignment * alignment;
+        }
+        auto header_of(void const* mapping) -> CacheHeader const& {
+            return *static_cast<CacheHeader const*>(mapping);
+        }
+    }
+
+    CachedCode::CachedCode(void* mapping, size_t mapping_size) :
+        m_mapping(mapping),
+        m_mapping_size(mapping_size)
+    {
+    }
+    CachedCode::~CachedCode() {
+        munmap(m_mapping, m_mapping_size);
+    }
+    auto CachedCode::code() const -> uint8_t const* {
+        return static_cast<uint8_t const*>(m_mapping) + header_of(m_mapping).code_offset;
+    }
+    auto CachedCode::mapping() const -> std::span<uint64_t const> {
+        auto const* first = reinterpret_cast<uint64_t const*>(static_cast<uint8_t const*>(m_mapping) + sizeof(CacheHeader));
+        return { first, header_of(m_mapping).mapping_count };
+    }
+    auto CachedCode::guard_size() const -> uint64_t {
+        return header_of(m_mapping).guard_size;
+    }
+
+    auto cache_key(std::string_view source, CLIOpts const& cli_opts, bool optimized) -> uint64_t {
+        Hasher hasher;
+        hasher.add(MAGIC);
+        hash_executable(hasher);
+        hash_cpu(hasher);
+        hasher.add(optimized);
+        hasher.add(cli_opts.debug_info);
+        hasher.add(cli_opts.profile_loops);
+        hasher.add(cli_opts.checked_tape);
+        hasher.add(cli_opts.tape_size);
+        hasher.add(cli_opts.cell_width);
+        hasher.add(cli_opts.line_buffered);
+        hasher.add(cli_opts.fuel);
+        hasher.add(cli_opts.eof_behavior);
+        hasher.add(source.size());
+        hasher.add(source.data(), source.size());
+        return hasher.value;
+    }
+
+    auto load_cached_code(std::filesystem::path const& directory, uint64_t key, std::string_view source) -> std::unique_ptr<CachedCode> {
+        auto const fd = open(entry_path(directory, key).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return nullptr;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(CacheHeader)) {
+            close(fd);
+            return nullptr;
+        }
+        auto const size = size_t(info.st_size);
+        // fails on filesystems mounted noexec, which just means no cache
+        auto* const mapping = mmap(nullptr, size, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+            return nullptr;
+        auto cached = std::make_unique<CachedCode>(mapping, size);
+
+        auto const& header = header_of(mapping);
+        bool const valid = std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0
+            && header.key == key
+            && header.source_size == source.size()
+            && header.mapping_count <= (size - sizeof(CacheHeader)) / sizeof(uint64_t)
+            && header.source_size <= size - sizeof(CacheHeader) - header.mapping_count * sizeof(uint64_t)
+            && header.code_offset >= sizeof(CacheHeader) + header.mapping_count * sizeof(uint64_t) + header.source_size
+            && header.code_offset <= size
+            && header.code_size == size - header.code_offset;
+        if (!valid)
+            return nullptr;
+        // FNV-1a collides easily enough, another program's code must never run
+        auto const* const stored_source = static_cast<char const*>(mapping) + sizeof(CacheHeader) + header.mapping_count * sizeof(uint64_t);
+        if (std::memcmp(stored_source, source.data(), source.size()) != 0)
+            return nullptr;
+        return cached;
+    }
+
+    void store_cached_code(std::filesystem::path const& directory, uint64_t key, std::string_view source, std::span<uint8_t const> code, std::span<size_t const> mapping, uint64_t guard_size) {
+        if (code.empty())
+            return;
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+        if (error)
+            return;
+
+        CacheHeader header;
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.key = key;
+        header.guard_size = guard_size;
+        header.mapping_count = mapping.size();
+        header.source_size = source.size();
+        header.code_offset = align_up(sizeof(CacheHeader) + mapping.size() * sizeof(uint64_t) + source.size(), CODE_ALIGNMENT);
+        header.code_size = code.size();
+        std::vector<uint64_t> offsets(mapping.begin(), mapping.end());
+        std::vector<char> padding(header.code_offset - sizeof(CacheHeader) - offsets.size() * sizeof(uint64_t) - source.size(), 0);
+
+        auto const path = entry_path(directory, key);
+        auto temporary = path;
+        temporary += fmt::format(".{}.tmp", getpid());
+        auto handle = std::ofstream( temporary, std::ios::binary | std::ios::trunc );
+        handle.write(reinterpret_cast<char const*>(&header), sizeof(header));
+        handle.write(reinterpret_cast<char const*>(offsets.data()), std::streamsize(offsets.size() * sizeof(uint64_t)));
+        handle.write(source.data(), std::streamsize(source.size()));
+        handle.write(padding.data(), std::streamsize(padding.size()));
+        handle.write(reinterpret_cast<char const*>(code.data()), std::streamsize(code.size()));
+        handle.close();
+        if (!handle) {
+            std::filesystem::remove(temporary, error);
+            return;
+        }
+        std::filesystem::rename(temporary, path, error);
+        if (error)
+            std::filesystem::remove(temporary, error);
+    }
+
+}
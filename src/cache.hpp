@@ -0,0 +1,70 @@
+#pragma once
+
+#include "options.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <string_view>
+
+namespace bfjit {
+
+    // FNV-1a, stable across builds unlike std::hash
+    struct Hasher {
+        uint64_t value = 0xcbf29ce484222325;
+
+        void add(void const* data, size_t size) {
+            auto const* bytes = static_cast<uint8_t const*>(data);
+            for (size_t i = 0; i < size; i++) {
+                value ^= bytes[i];
+                value *= 0x100000001b3;
+            }
+        }
+        template<typename T>
+        void add(T const& value) {
+            add(&value, sizeof(value));
+        }
+    };
+
+    // Machine code a previous run compiled, mapped executable straight from
+    // its cache file
+    class CachedCode {
+    public:
+        CachedCode(void* mapping, size_t mapping_size);
+        ~CachedCode();
+        CachedCode(CachedCode const&) = delete;
+        CachedCode(CachedCode &&) = delete;
+        CachedCode& operator = (CachedCode const&) = delete;
+        CachedCode& operator = (CachedCode &&) = delete;
+
+        [[nodiscard]]
+        auto code() const -> uint8_t const*;
+        // offset in code() of every bytecode operation, like
+        // JIT::mapping_bytecode_to_code
+        [[nodiscard]]
+        auto mapping() const -> std::span<uint64_t const>;
+        // of the tape the code was compiled for, 0 if it bounds checks
+        [[nodiscard]]
+        auto guard_size() const -> uint64_t;
+
+    private:
+        void* m_mapping;
+        size_t m_mapping_size;
+    };
+
+    // Identifies the code a program compiles to: its source, whether it was
+    // optimized, the options that change codegen, this very bfjit executable
+    // and the CPU it runs on. Anything else is a different cache entry.
+    [[nodiscard]]
+    auto cache_key(std::string_view source, CLIOpts const& cli_opts, bool optimized) -> uint64_t;
+    // nullptr when there's no usable entry for `key` in `directory`. Entries
+    // keep their source, one for another source with the same key isn't
+    [[nodiscard]]
+    auto load_cached_code(std::filesystem::path const& directory, uint64_t key, std::string_view source) -> std::unique_ptr<CachedCode>;
+    // Best effort, a cache that can't be written is just not used. Entries
+    // are written to a temporary file and renamed, so concurrent runs never
+    // see half of one.
+    void store_cached_code(std::filesystem::path const& directory, uint64_t key, std::string_view source, std::span<uint8_t const> code, std::span<size_t const> mapping, uint64_t guard_size);
+
+}
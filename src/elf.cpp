@@ -0,0 +1,68 @@
+#include "elf.hpp"
+#include <cstring>
+#include <elf.h>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+namespace bfjit {
+
+    namespace {
+        constexpr uint64_t ELF_LOAD_ADDRESS = 0x400000;
+        // the code segment and a non executable stack
+        constexpr size_t PROGRAM_HEADERS = 2;
+        constexpr size_t HEADERS_SIZE = sizeof(Elf64_Ehdr) + PROGRAM_HEADERS * sizeof(Elf64_Phdr);
+    }
+
+    auto elf_code_address() -> uint64_t {
+        return ELF_LOAD_ADDRESS + HEADERS_SIZE;
+    }
+
+    auto write_elf_executable(char const* path, std::span<uint8_t const> code, uint16_t machine) -> bool {
+        Elf64_Ehdr header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.e_ident, ELFMAG, SELFMAG);
+        header.e_ident[EI_CLASS] = ELFCLASS64;
+        header.e_ident[EI_DATA] = ELFDATA2LSB;
+        header.e_ident[EI_VERSION] = EV_CURRENT;
+        header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+        header.e_type = ET_EXEC;
+        header.e_machine = machine;
+        header.e_version = EV_CURRENT;
+        header.e_entry = elf_code_address();
+        header.e_phoff = sizeof(Elf64_Ehdr);
+        header.e_ehsize = sizeof(Elf64_Ehdr);
+        header.e_phentsize = sizeof(Elf64_Phdr);
+        header.e_phnum = PROGRAM_HEADERS;
+
+        // the headers are mapped too, it keeps the file offset and address in step
+        Elf64_Phdr segments[PROGRAM_HEADERS];
+        std::memset(segments, 0, sizeof(segments));
+        segments[0].p_type = PT_LOAD;
+        segments[0].p_flags = PF_R | PF_X;
+        segments[0].p_offset = 0;
+        segments[0].p_vaddr = ELF_LOAD_ADDRESS;
+        segments[0].p_paddr = ELF_LOAD_ADDRESS;
+        segments[0].p_filesz = HEADERS_SIZE + code.size();
+        segments[0].p_memsz = HEADERS_SIZE + code.size();
+        segments[0].p_align = 0x1000;
+        segments[1].p_type = PT_GNU_STACK;
+        segments[1].p_flags = PF_R | PF_W;
+        segments[1].p_align = 16;
+
+        auto handle = std::ofstream( path, std::ios::binary | std::ios::trunc );
+        handle.write(reinterpret_cast<char const*>(&header), sizeof(header));
+        handle.write(reinterpret_cast<char const*>(segments), sizeof(segments));
+        handle.write(reinterpret_cast<char const*>(code.data()), std::streamsize(code.size()));
+        handle.close();
+        if (!handle)
+            return false;
+
+        std::error_code error;
+        std::filesystem::permissions(path,
+            std::filesystem::perms::owner_exec | std::filesystem::perms::group_exec | std::filesystem::perms::others_exec,
+            std::filesystem::perm_options::add, error);
+        return !error;
+    }
+
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+
+namespace bfjit {
+
+    // Where write_elf_executable() loads the code, it has to be relocated to
+    // this address before being written
+    [[nodiscard]]
+    auto elf_code_address() -> uint64_t;
+
+    // Writes a static executable made of `code` alone, mapped read+execute at
+    // elf_code_address() and entered at its start. `machine` is an EM_*
+    // constant from <elf.h>. False if the file couldn't be written.
+    [[nodiscard]]
+    auto write_elf_executable(char const* path, std::span<uint8_t const> code, uint16_t machine) -> bool;
+
+}
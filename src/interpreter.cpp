@@ -1,6 +1,8 @@
-
 #include "interpreter.hpp"
+#include "packed.hpp"
 #include "parser.hpp"
+#include "scan.hpp"
+#include "snapshot.hpp"
 #include <cstdlib>
 #include <cstdint>
 #include <fmt/format.h>
@@ -8,70 +10,284 @@
 
 namespace bfjit {
 
-    Interpreter::Interpreter(std::span<BFOp const> bytecode) :
+    namespace {
+        // in uint64_t, as 16 bit cells would otherwise multiply as int and overflow
+        template<typename Cell>
+        auto times(Cell value, int64_t factor) -> Cell {
+            return Cell(uint64_t(value) * uint64_t(factor));
+        }
+    }
+
+    template<typename Cell>
+    BasicInterpreter<Cell>::BasicInterpreter(std::span<BFOp const> bytecode, bfjit::CLIOpts const& cli_opts) :
+        // every access is checked anyway, no need for guard pages
+        m_own_buffer(std::in_place, cli_opts.tape_size * sizeof(Cell), 0),
+        m_own_output(std::in_place, 1, cli_opts.line_buffered),
+        m_own_input(std::in_place, 0, cli_opts.eof_behavior, &*m_own_output),
+        m_buffer(*m_own_buffer),
+        m_ptr(0),
         m_ip(0),
+        m_bytecode(pack(bytecode, sizeof(Cell))),
+        m_output(*m_own_output),
+        m_input(*m_own_input)
+    {
+        if (cli_opts.profile_loops)
+            setup_profile(bytecode);
+    }
+    template<typename Cell>
+    BasicInterpreter<Cell>::BasicInterpreter(std::span<BFOp const> bytecode, bfjit::CLIOpts const& cli_opts,
+                                             Tape& tape, OutputBuffer& output, InputBuffer& input) :
+        m_buffer(tape),
         m_ptr(0),
-        m_bytecode(bytecode)
+        m_ip(0),
+        m_bytecode(pack(bytecode, sizeof(Cell))),
+        m_output(output),
+        m_input(input)
     {
-        m_buffer.resize(4096);
+        if (cli_opts.profile_loops)
+            setup_profile(bytecode);
+    }
+    template<typename Cell>
+    void BasicInterpreter<Cell>::setup_profile(std::span<BFOp const> bytecode) {
+        m_profile = std::make_unique<LoopProfile>(bytecode);
+        m_loop_numbers.resize(m_bytecode.size());
+        std::vector<uint32_t> open;
+        uint32_t loops = 0;
+        for (size_t pos = 0; pos < m_bytecode.size();) {
+            auto const at = pos;
+            auto const op = unpack(m_bytecode, pos);
+            if (op.m_type == BFOp::Type::LoopBeg) {
+                open.push_back(loops++);
+                m_loop_numbers[at] = open.back();
+            } else if (op.m_type == BFOp::Type::LoopEnd) {
+                m_loop_numbers[at] = open.back();
+                open.pop_back();
+            }
+        }
     }
 
-    auto Interpreter::finished() const -> bool {
+    template<typename Cell>
+    auto BasicInterpreter<Cell>::finished() const -> bool {
         return m_ip == m_bytecode.size();
     }
-    auto Interpreter::run_one_step() -> bool {
+    template<typename Cell>
+    auto BasicInterpreter<Cell>::run_one_step() -> bool {
         if (finished())
             return false;
 
-        auto c_inst = m_bytecode[m_ip++];
+        auto* const tape = cells();
+        // the common operations straight from the packed word, the rest are decoded first
+        auto const word = m_bytecode[m_ip];
+        auto set_value = [&](PackedOp op) {
+            cell(op.high()) = Cell(int8_t(op.byte(1)));
+        };
+        auto mod_ptr = [&](PackedOp op) {
+            move_ptr(op.operand());
+        };
+        auto mul_add = [&](PackedOp op) {
+            if (auto const value = cell(int8_t(op.byte(2))); value != 0) {
+                cell(int8_t(op.byte(2)) + int8_t(op.byte(3))) += times(value, int8_t(op.byte(1)));
+            }
+        };
+        switch (word.type()) {
+            case uint8_t(BFOp::Type::Mod):
+                m_ip++;
+                cell(word.high()) += Cell(int8_t(word.byte(1)));
+                return !m_out_of_bounds;
+            case uint8_t(BFOp::Type::SetValue):
+                m_ip++;
+                set_value(word);
+                return !m_out_of_bounds;
+            case uint8_t(BFOp::Type::ModPtr):
+                m_ip++;
+                mod_ptr(word);
+                return !m_out_of_bounds;
+            case uint8_t(BFOp::Type::MulAdd):
+                m_ip++;
+                mul_add(word);
+                return !m_out_of_bounds;
+            case uint8_t(BFOp::Type::LoopBeg):
+                if (m_profile) [[unlikely]]
+                    count_loop(m_ip, true);
+                m_ip += tape[m_ptr] == 0 ? word.operand() : 1;
+                return true;
+            case uint8_t(BFOp::Type::LoopEnd):
+                if (m_profile) [[unlikely]]
+                    count_loop(m_ip, false);
+                m_ip += tape[m_ptr] != 0 ? word.operand() : 1;
+                return true;
+            // the second word of these is narrow and right after the first
+            case PackedOp::MULADD_SETVALUE:
+                mul_add(word);
+                set_value(m_bytecode[m_ip + 1]);
+                m_ip += 2;
+                return !m_out_of_bounds;
+            case PackedOp::SETVALUE_MODPTR:
+                set_value(word);
+                mod_ptr(m_bytecode[m_ip + 1]);
+                m_ip += 2;
+                return !m_out_of_bounds;
+            case PackedOp::MODPTR_LOOPEND:
+                mod_ptr(word);
+                m_ip++;
+                if (m_out_of_bounds) [[unlikely]]
+                    return false;
+                if (m_profile) [[unlikely]]
+                    count_loop(m_ip, false);
+                m_ip += tape[m_ptr] != 0 ? m_bytecode[m_ip].operand() : 1;
+                return true;
+            case PackedOp::LOOPEND_MULADD:
+                if (m_profile) [[unlikely]]
+                    count_loop(m_ip, false);
+                if (tape[m_ptr] != 0) {
+                    m_ip += word.operand();
+                    return true;
+                }
+                mul_add(m_bytecode[m_ip + 1]);
+                m_ip += 2;
+                return !m_out_of_bounds;
+            default:
+                break;
+        }
+
+        auto const at = m_ip;
+        auto const c_inst = unpack(m_bytecode, m_ip);
         switch (c_inst.m_type) {
             case BFOp::Type::Mod:
-                m_buffer[m_ptr] += c_inst.inc_arg;
+                cell(c_inst.m_offset) += Cell(c_inst.inc_arg);
                 break;
             case BFOp::Type::ModPtr:
+                move_ptr(c_inst.inc_ptr_arg);
+                break;
+            case BFOp::Type::In:
                 {
-                    auto const new_ptr = int64_t(m_ptr) + c_inst.inc_ptr_arg;
-                    if (new_ptr < 0 || new_ptr >= m_buffer.size()) {
-                        std::abort();
+                    auto& c = cell(c_inst.m_offset);
+                    c = m_input.next_or(c);
+                    // to run again once resumed
+                    if (m_input.m_interrupted) [[unlikely]] {
+                        m_ip = at;
+                        return false;
                     }
-                    m_ptr = new_ptr;
                 }
                 break;
-            case BFOp::Type::In:
-                std::abort();
             case BFOp::Type::Out:
-                fmt::print("{}", char(m_buffer[m_ptr]));
+                m_output.put(uint8_t(cell(c_inst.m_offset)));
                 break;
             case BFOp::Type::LoopBeg:
-                if (m_buffer[m_ptr] == 0) {
-                    m_ip = c_inst.loop_arg+1;
+                if (m_profile) [[unlikely]]
+                    count_loop(at, true);
+                if (tape[m_ptr] == 0) {
+                    m_ip = c_inst.loop_arg;
                 }
                 break;
             case BFOp::Type::LoopEnd:
-                if (m_buffer[m_ptr] != 0) {
-                    m_ip = c_inst.loop_arg+1;
+                if (m_profile) [[unlikely]]
+                    count_loop(at, false);
+                if (tape[m_ptr] != 0) {
+                    m_ip = c_inst.loop_arg;
                 }
                 break;
             case BFOp::Type::SetValue:
-                m_buffer[m_ptr] = c_inst.set_arg;
+                cell(c_inst.m_offset) = Cell(c_inst.set_arg);
                 break;
-            case BFOp::Type::Halt:
-                switch (c_inst.halt_reason) {
-                    case BFOp::HaltReason::InfiniteLoop:
-                        if (m_buffer[m_ip] == 0)
-                            return true;
-                        fmt::print("halted, reason: infinte loop reached\n");
-                        break;
-                    default:
-                        fmt::print("halted, reason: unknown\n");
+            case BFOp::Type::MulAdd:
+                // the original loop never runs on a zero cell, so it never touches the target either
+                if (auto const value = cell(c_inst.m_offset); value != 0) {
+                    cell(int64_t(c_inst.m_offset) + c_inst.mul_arg.offset) += times(value, c_inst.mul_arg.factor);
+                }
+                break;
+            case BFOp::Type::Scan:
+                {
+                    auto const new_ptr = scan_zero_cells<Cell>(m_buffer.data(), size(), m_ptr, c_inst.scan_arg);
+                    if (new_ptr == SCAN_NOT_FOUND) {
+                        m_out_of_bounds = true;
+                        return false;
+                    }
+                    m_ptr = new_ptr;
                 }
+                break;
+            case BFOp::Type::Halt:
+                if (tape[m_ptr] == 0)
+                    return true;
+                m_halted = true;
                 return false;
             default: std::abort();
         }
 
+        return !m_out_of_bounds;
+    }
+    template<typename Cell>
+    auto BasicInterpreter<Cell>::cell(int64_t offset) -> Cell& {
+        auto const idx = int64_t(m_ptr) + offset;
+        if (idx < 0 || idx >= int64_t(size())) [[unlikely]] {
+            m_out_of_bounds = true;
+            return m_scratch;
+        }
+        return cells()[idx];
+    }
+    template<typename Cell>
+    auto BasicInterpreter<Cell>::move_ptr(int64_t amount) -> bool {
+        auto const new_ptr = int64_t(m_ptr) + amount;
+        if (new_ptr < 0 || new_ptr >= int64_t(size())) [[unlikely]] {
+            m_out_of_bounds = true;
+            return false;
+        }
+        m_ptr = new_ptr;
         return true;
     }
-    void Interpreter::run_until_end() {
+    template<typename Cell>
+    void BasicInterpreter<Cell>::report_stop() {
+        m_output.flush();
+        // the same as a guard page fault of the JIT, see tape.cpp
+        if (m_out_of_bounds)
+            fmt::print(stderr, "trying to access data outside of bouds\n");
+        if (m_halted)
+            fmt::print("halted, reason: infinte loop reached\n");
+    }
+    template<typename Cell>
+    void BasicInterpreter<Cell>::count_loop(size_t pos, bool entering) {
+        auto& counters = m_profile->counters()[m_loop_numbers[pos]];
+        if (entering)
+            counters.entries++;
+        if (cells()[m_ptr] != 0)
+            counters.iterations++;
+    }
+    template<typename Cell>
+    void BasicInterpreter<Cell>::run_until_end() {
         while (this->run_one_step());
+        report_stop();
+    }
+
+    template<typename Cell>
+    auto BasicInterpreter<Cell>::run_until_end_or_stop() -> bool {
+        m_input.m_interruptible = true;
+        while (true) {
+            if (stop_requested() && !finished()) [[unlikely]] {
+                // the LoopEnd of a fused ModPtr+LoopEnd is never at m_ip on
+                // its own, so run the ModPtr half alone and stop on the
+                // LoopEnd word right after it
+                if (auto const word = m_bytecode[m_ip]; word.type() == PackedOp::MODPTR_LOOPEND) {
+                    if (!move_ptr(word.operand())) {
+                        report_stop();
+                        return true;
+                    }
+                    m_ip++;
+                }
+                auto const type = BFOp::Type(m_bytecode[m_ip].unfused_type());
+                if (type == BFOp::Type::LoopBeg || type == BFOp::Type::LoopEnd) {
+                    m_output.flush();
+                    return false;
+                }
+            }
+            if (!this->run_one_step()) {
+                report_stop();
+                return !m_input.m_interrupted;
+            }
+        }
     }
+
+    template struct BasicInterpreter<uint8_t>;
+    template struct BasicInterpreter<uint16_t>;
+    template struct BasicInterpreter<uint32_t>;
+    template struct BasicInterpreter<uint64_t>;
 }
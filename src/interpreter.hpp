@@ -1,32 +1,98 @@
 #pragma once
 
+#include "options.hpp"
+#include "io.hpp"
+#include "packed.hpp"
 #include "parser.hpp"
+#include "profile.hpp"
+#include "tape.hpp"
 #include <cstdint>
+#include <memory>
+#include <optional>
 #include <vector>
 #include <span>
 
 namespace bfjit {
 
-    struct Interpreter {
-        std::vector<uint8_t> m_buffer;
+    // Cell is the type of a tape cell, one of uint8_t, uint16_t, uint32_t or
+    // uint64_t (instantiated in interpreter.cpp)
+    template<typename Cell>
+    struct BasicInterpreter {
+        // the tape and buffers the interpreter made for itself, empty when
+        // it runs on lent ones
+        std::optional<Tape> m_own_buffer;
+        std::optional<OutputBuffer> m_own_output;
+        std::optional<InputBuffer> m_own_input;
+        Tape& m_buffer;
         size_t m_ptr;
         size_t m_ip;
-        std::span<BFOp const> m_bytecode;
+        std::vector<PackedOp> m_bytecode;
+        OutputBuffer& m_output;
+        InputBuffer& m_input;
+        // only with profile_loops, along with the loop number of every LoopBeg
+        // and LoopEnd word of m_bytecode
+        std::unique_ptr<LoopProfile> m_profile;
+        std::vector<uint32_t> m_loop_numbers;
+        // why run_one_step() stopped before the end: an access outside of the
+        // tape, or a Halt it would spin on forever
+        bool m_out_of_bounds = false;
+        bool m_halted = false;
+        // what cell() hands out for cells outside of the tape
+        Cell m_scratch = 0;
 
-        Interpreter(std::span<BFOp const> bytecode);
-        ~Interpreter() = default;
-        Interpreter(Interpreter const&) = default;
-        Interpreter(Interpreter &&) = default;
-        Interpreter& operator = (Interpreter const&) = default;
-        Interpreter& operator = (Interpreter &&) = default;
+        BasicInterpreter(std::span<BFOp const> bytecode, bfjit::CLIOpts const& cli_opts);
+        // runs on `tape` and the buffers of someone else, a JIT for example
+        BasicInterpreter(std::span<BFOp const> bytecode, bfjit::CLIOpts const& cli_opts,
+                         Tape& tape, OutputBuffer& output, InputBuffer& input);
+        ~BasicInterpreter() = default;
+        BasicInterpreter(BasicInterpreter const&) = delete;
+        BasicInterpreter(BasicInterpreter &&) = delete;
+        BasicInterpreter& operator = (BasicInterpreter const&) = delete;
+        BasicInterpreter& operator = (BasicInterpreter &&) = delete;
 
+        // runs the program and report_stop()s
         void run_until_end();
+        // Like run_until_end(), but once stop_requested() it stops right
+        // before the next LoopBeg or LoopEnd instead, or before the In it's
+        // waiting for input at, and returns false, so the program can be
+        // snapshotted there
+        [[nodiscard]]
+        auto run_until_end_or_stop() -> bool;
+        // index in the bytecode it was built from of the operation at m_ip
+        [[nodiscard]]
+        auto op_index() const -> size_t { return bfjit::op_index(m_bytecode, m_ip); }
+        // runs the operation at `index` of that bytecode next
+        void jump_to_op(size_t index) { m_ip = op_position(m_bytecode, index); }
 
+        // false once the program ended, waits for input that was
+        // interrupted, or failed (m_out_of_bounds or m_halted)
         [[nodiscard]]
         auto run_one_step() -> bool;
         [[nodiscard]]
         auto finished() const -> bool;
+        // cell at m_ptr + offset, sets m_out_of_bounds and returns m_scratch
+        // if it's outside of the buffer
+        [[nodiscard]]
+        auto cell(int64_t offset) -> Cell&;
+        // moves m_ptr by `amount`, sets m_out_of_bounds instead if it would
+        // leave the buffer
+        auto move_ptr(int64_t amount) -> bool;
+        // flushes the output and says why the program failed, if it did: out
+        // of bounds accesses on stderr like a guard page fault of the JIT,
+        // halts on stdout
+        void report_stop();
+        // for the LoopBeg (entering) or LoopEnd word at `pos`, before it runs
+        void count_loop(size_t pos, bool entering);
+        // numbers the loops for m_profile
+        void setup_profile(std::span<BFOp const> bytecode);
+        // cells in m_buffer
+        [[nodiscard]]
+        auto size() const -> size_t { return m_buffer.size() / sizeof(Cell); }
+        [[nodiscard]]
+        auto cells() -> Cell* { return reinterpret_cast<Cell*>(m_buffer.data()); }
     };
 
+    using Interpreter = BasicInterpreter<uint8_t>;
+
 }
 
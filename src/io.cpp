@@ -0,0 +1,224 @@
+#include "io.hpp"
+#include "snapshot.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <fmt/format.h>
+#include <fmt/color.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define write _write
+#define read _read
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace bfjit {
+    namespace {
+        // fixed table of atomics so flush_all_outputs doesn't need locks
+        std::array<std::atomic<OutputBuffer*>, 64> live_outputs;
+
+        void write_all(int fd, uint8_t const* data, size_t size) {
+            while (size > 0) {
+                auto const written = write(fd, data, size);
+                if (written < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return;
+                }
+                data += written;
+                size -= size_t(written);
+            }
+        }
+    }
+
+    OutputBuffer::OutputBuffer(int fd, bool line_buffered, size_t capacity) :
+        m_data(static_cast<uint8_t*>(std::malloc(capacity))),
+        m_size(0),
+        m_capacity(capacity),
+        m_fd(fd),
+        m_line_buffered(line_buffered),
+        m_sink(nullptr),
+        m_owns_data(true),
+        m_flushed(0)
+    {
+        if (m_data == nullptr) {
+            fmt::print(fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
+            fmt::print(": could not allocate the output buffer\n");
+            std::abort();
+        }
+        for (auto& slot : live_outputs) {
+            OutputBuffer* expected = nullptr;
+            if (slot.compare_exchange_strong(expected, this))
+                return;
+        }
+        // its output would be lost on a fault
+        fmt::print(fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
+        fmt::print(": too many output buffers alive\n");
+        std::abort();
+    }
+    // not registered with flush_all_outputs, a sink may not be safe to call
+    // from a signal handler
+    OutputBuffer::OutputBuffer(OutputSink& sink, std::span<uint8_t> storage, bool line_buffered) :
+        m_data(storage.data()),
+        m_size(0),
+        m_capacity(storage.size()),
+        m_fd(-1),
+        m_line_buffered(line_buffered),
+        m_sink(&sink),
+        m_owns_data(false),
+        m_flushed(0)
+    {
+    }
+    OutputBuffer::~OutputBuffer() {
+        flush();
+        if (!m_owns_data)
+            return;
+        for (auto& slot : live_outputs) {
+            OutputBuffer* expected = this;
+            if (slot.compare_exchange_strong(expected, nullptr))
+                break;
+        }
+        std::free(m_data);
+    }
+    void OutputBuffer::flush() {
+        if (m_size == 0)
+            return;
+        if (m_sink != nullptr)
+            m_sink->write({ m_data, m_size });
+        else
+            write_all(m_fd, m_data, m_size);
+        m_flushed += m_size;
+        m_size = 0;
+    }
+
+    InputBuffer::InputBuffer(int fd, EofBehavior eof_behavior, OutputBuffer* tied, size_t capacity) :
+        m_data(nullptr),
+        m_pos(0),
+        m_size(0),
+        m_storage(nullptr),
+        m_capacity(capacity),
+        m_mapping(nullptr),
+        m_mapping_size(0),
+        m_fd(fd),
+        m_eof(false),
+        m_eof_behavior(eof_behavior),
+        m_tied(tied),
+        m_consumed(0)
+    {
+#ifndef _WIN32
+        // regular files are mapped whole, no copies and no refills at all
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            auto const start = lseek(fd, 0, SEEK_CUR);
+            auto const mapping = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (start >= 0 && start <= st.st_size && mapping != MAP_FAILED) {
+                madvise(mapping, size_t(st.st_size), MADV_SEQUENTIAL);
+                m_mapping = mapping;
+                m_mapping_size = size_t(st.st_size);
+                // what was already read by someone else isn't input
+                m_data = static_cast<uint8_t const*>(mapping) + start;
+                m_size = m_mapping_size - size_t(start);
+                m_eof = true;
+                return;
+            }
+            if (mapping != MAP_FAILED)
+                munmap(mapping, size_t(st.st_size));
+        }
+#endif
+        m_storage = static_cast<uint8_t*>(std::malloc(capacity));
+        if (m_storage == nullptr) {
+            fmt::print(fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
+            fmt::print(": could not allocate the input buffer\n");
+            std::abort();
+        }
+        m_data = m_storage;
+    }
+    InputBuffer::InputBuffer(std::span<uint8_t const> data, EofBehavior eof_behavior) :
+        m_data(data.data()),
+        m_pos(0),
+        m_size(data.size()),
+        m_storage(nullptr),
+        m_capacity(0),
+        m_mapping(nullptr),
+        m_mapping_size(0),
+        m_fd(-1),
+        m_eof(true),
+        m_eof_behavior(eof_behavior),
+        m_tied(nullptr),
+        m_consumed(0)
+    {
+    }
+    InputBuffer::~InputBuffer() {
+#ifndef _WIN32
+        if (m_mapping != nullptr)
+            munmap(m_mapping, m_mapping_size);
+#endif
+        std::free(m_storage);
+    }
+    auto InputBuffer::on_eof(uint64_t current) const -> uint64_t {
+        switch (m_eof_behavior) {
+        case EofBehavior::Zero:
+            return 0;
+        case EofBehavior::MinusOne:
+            return UINT64_MAX;
+        case EofBehavior::Unchanged:
+        default:
+            return current;
+        }
+    }
+    auto InputBuffer::refill() -> bool {
+        if (m_eof)
+            return false;
+        if (m_tied != nullptr)
+            m_tied->flush();
+        m_consumed += m_size;
+        m_pos = m_size = 0;
+        m_interrupted = false;
+        while (true) {
+            auto const got = read(m_fd, m_storage, m_capacity);
+            if (got < 0 && errno == EINTR) {
+                if (m_interruptible && stop_requested()) {
+                    m_interrupted = true;
+                    return false;
+                }
+                continue;
+            }
+            if (got <= 0) {
+                m_eof = true;
+                m_pos = m_size = 0;
+                return false;
+            }
+            m_pos = 0;
+            m_size = size_t(got);
+            return true;
+        }
+    }
+
+    void InputBuffer::skip(uint64_t count) {
+        while (count > 0) {
+            if (m_pos == m_size && !refill())
+                return;
+            auto const step = std::min<uint64_t>(count, m_size - m_pos);
+            m_pos += size_t(step);
+            count -= step;
+        }
+    }
+
+    void flush_all_outputs() {
+        // not flush(), which may call a sink and updates the counters, only
+        // write(2) what's buffered
+        for (auto const& slot : live_outputs) {
+            if (auto out = slot.load(); out != nullptr) {
+                auto const data = out->m_data;
+                auto const size = out->m_size;
+                write_all(out->m_fd, data, size);
+            }
+        }
+    }
+}
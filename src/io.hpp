@@ -0,0 +1,118 @@
+#pragma once
+
+#include "options.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace bfjit {
+
+    // Receives the output of a program that doesn't write to a file descriptor
+    class OutputSink {
+    public:
+        virtual ~OutputSink() = default;
+        virtual void write(std::span<uint8_t const> data) = 0;
+    };
+
+    // Output of a running program. The JITs append to m_data directly and only
+    // call flush() when the buffer is full (or on a newline when
+    // m_line_buffered), so the layout is part of the generated code's ABI.
+    struct OutputBuffer {
+        static constexpr size_t DEFAULT_CAPACITY = 64 * 1024;
+
+        uint8_t* m_data;
+        size_t m_size;
+        size_t m_capacity;
+        int m_fd;
+        bool m_line_buffered;
+        // written to instead of m_fd when set
+        OutputSink* m_sink;
+        // m_data was allocated here rather than lent by the caller
+        bool m_owns_data;
+        // bytes flush() handed over so far
+        uint64_t m_flushed;
+
+        explicit OutputBuffer(int fd = 1, bool line_buffered = false, size_t capacity = DEFAULT_CAPACITY);
+        // buffers in `storage` and hands full buffers to `sink`, allocates nothing
+        OutputBuffer(OutputSink& sink, std::span<uint8_t> storage, bool line_buffered = false);
+        ~OutputBuffer();
+        OutputBuffer(OutputBuffer const&) = delete;
+        OutputBuffer(OutputBuffer &&) = delete;
+        OutputBuffer& operator = (OutputBuffer const&) = delete;
+        OutputBuffer& operator = (OutputBuffer &&) = delete;
+
+        void put(uint8_t ch) {
+            m_data[m_size++] = ch;
+            if (m_size == m_capacity || (m_line_buffered && ch == '\n'))
+                flush();
+        }
+        // writes everything buffered with as few write(2) calls as possible
+        void flush();
+        // bytes the program wrote so far, flushed or not
+        [[nodiscard]]
+        auto written() const -> uint64_t { return m_flushed + m_size; }
+    };
+
+    // Input of a running program. When the file descriptor is a regular file
+    // the whole file is mapped and m_data points straight into it, otherwise
+    // it's read in big chunks. The JITs read m_data[m_pos] while m_pos < m_size
+    // and only call next_or() to refill, so the layout is part of the
+    // generated code's ABI.
+    struct InputBuffer {
+        static constexpr size_t DEFAULT_CAPACITY = 64 * 1024;
+
+        uint8_t const* m_data;
+        size_t m_pos;
+        size_t m_size;
+        uint8_t* m_storage;
+        size_t m_capacity;
+        void* m_mapping;
+        size_t m_mapping_size;
+        int m_fd;
+        bool m_eof;
+        EofBehavior m_eof_behavior;
+        // flushed before blocking on a read, so prompts show up
+        OutputBuffer* m_tied;
+        // bytes that were before m_data[0]
+        uint64_t m_consumed;
+        // refill() gives up instead of waiting on when a stop_requested()
+        // signal interrupts its read, and sets m_interrupted. Only for
+        // callers that can stop right before the In, which then didn't run
+        bool m_interruptible = false;
+        bool m_interrupted = false;
+
+        explicit InputBuffer(int fd = 0, EofBehavior eof_behavior = EofBehavior::Unchanged, OutputBuffer* tied = nullptr, size_t capacity = DEFAULT_CAPACITY);
+        // reads `data` and nothing else, allocates nothing
+        InputBuffer(std::span<uint8_t const> data, EofBehavior eof_behavior);
+        ~InputBuffer();
+        InputBuffer(InputBuffer const&) = delete;
+        InputBuffer(InputBuffer &&) = delete;
+        InputBuffer& operator = (InputBuffer const&) = delete;
+        InputBuffer& operator = (InputBuffer &&) = delete;
+
+        // next input byte, or what the EOF behavior says to store in a cell
+        // holding `current` once there's no more input
+        template<typename Cell>
+        auto next_or(Cell current) -> Cell {
+            if (m_pos == m_size && !refill())
+                return m_interrupted ? current : Cell(on_eof(current));
+            return m_data[m_pos++];
+        }
+        // -1 comes back as all ones, to be truncated to the cell
+        [[nodiscard]]
+        auto on_eof(uint64_t current) const -> uint64_t;
+        // false once the input is exhausted, or when interrupted
+        auto refill() -> bool;
+        // bytes the program read so far, EOFs don't count
+        [[nodiscard]]
+        auto position() const -> uint64_t { return m_consumed + m_pos; }
+        // drops the next `count` bytes as if the program had read them, or
+        // whatever is left if there are fewer
+        void skip(uint64_t count);
+    };
+
+    // Flushes every live OutputBuffer, only uses write(2) so it's safe to call
+    // from a signal handler right before dying
+    void flush_all_outputs();
+
+}
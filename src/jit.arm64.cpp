@@ -1,12 +1,20 @@
 #include "jit.hpp"
 #include "asmjit/a64.h"
 #include "asmjit/core/operand.h"
+#include "io.hpp"
+#include "optimizer.hpp"
 #include "options.hpp"
 #include "parser.hpp"
+#include "scan.hpp"
+#include "snapshot.hpp"
 
+#include <cstddef>
 #include <cstdlib>
+#include <fmt/color.h>
 #include <fmt/format.h>
 
+#include <array>
+#include <bit>
 #include <memory>
 #include <stack>
 
@@ -15,8 +23,16 @@ constexpr auto DATA_BASE = a64::x7;
 constexpr auto DATA_INDEX = a64::x6;
 constexpr auto CACHE_VALUE = a64::x5;
 constexpr auto CACHE_VALUE_W = a64::w5;
-constexpr auto DEBUG_INFO = a64::x4;
+// JIT::InnerData, callee saved so it survives calls into the runtime
+constexpr auto CONTEXT = a64::x19;
+// the counters are at the start of JIT::InnerData
+constexpr auto DEBUG_INFO = CONTEXT;
 constexpr auto TEMP_REG = a64::x3;
+constexpr auto TEMP_ADDR = a64::x9;
+constexpr auto TEMP_VALUE_W = a64::w10;
+constexpr auto TEMP_FACTOR_W = a64::w11;
+constexpr auto TEMP_SOURCE_W = a64::w12;
+constexpr auto TEMP_LIMIT = a64::x13;
 
 struct EHandler : public asmjit::ErrorHandler {
   void handleError(asmjit::Error err, char const *msg,
@@ -26,19 +42,29 @@ struct EHandler : public asmjit::ErrorHandler {
   }
 };
 
-void print_char(uint32_t r) {
-  r = r & 0xff;
-  fmt::print("{}", char(r));
-}
+void flush_output(bfjit::OutputBuffer *out) { out->flush(); }
 
-void outsize_of_bounds() {
-  fmt::print("trying to access data outside of bouds\n");
-}
+// `current` is the cell zero extended, the result has to be truncated to a
+// cell
+uint64_t read_input(bfjit::InputBuffer *in, uint64_t current);
+
+void outsize_of_bounds(bfjit::JIT::InnerData *data);
+void infinite_loop(bfjit::JIT::InnerData *data);
 
 void do_codegen(asmjit::a64::Assembler &a, std::span<bfjit::BFOp const> code,
                 asmjit::Label &exit, asmjit::Label &outside_bounds,
-                uint32_t data_size, std::vector<size_t> &jump_offsets,
-                bfjit::CLIOpts const &opts);
+                uint64_t data_size, bool checked,
+                std::vector<size_t> &jump_offsets, bfjit::CLIOpts const &opts);
+void load_cell(asmjit::a64::Assembler &a, asmjit::a64::Gp const &dst,
+               asmjit::a64::Mem const &mem, size_t cell_width);
+void store_cell(asmjit::a64::Assembler &a, asmjit::a64::Gp const &src,
+                asmjit::a64::Mem const &mem, size_t cell_width);
+
+// the cell at DATA_INDEX, which counts cells
+auto current_cell(size_t cell_width) -> asmjit::a64::Mem {
+  return a64::Mem(DATA_BASE, DATA_INDEX,
+                  a64::lsl(uint32_t(std::countr_zero(cell_width))));
+}
 
 namespace bfjit {
 
@@ -49,13 +75,60 @@ struct JIT::InnerData {
   uint64_t exec_loop_beg = 0;
   uint64_t exec_loop_end = 0;
   uint64_t exec_set_value = 0;
+  uint64_t exec_mul_add = 0;
+  uint64_t exec_scan = 0;
+  OutputBuffer output;
+  InputBuffer input;
+
+  bool out_of_bounds = false;
+  // reached a Halt on a non zero cell
+  bool halted = false;
+  // LoopProfile::counters(), when profiling
+  LoopCounters *loop_counters = nullptr;
+  // loop iterations left with CLIOpts::fuel, and where the code stopped once
+  // there were none: the LoopEnd it didn't run and the data index
+  uint64_t fuel = UINT64_MAX;
+  uint64_t stopped_at = NOT_STOPPED;
+  uint64_t stopped_ptr = 0;
+
+  explicit InnerData(CLIOpts const &cli_opts)
+      : output(1, cli_opts.line_buffered),
+        input(0, cli_opts.eof_behavior, &output) {}
+  InnerData(CLIOpts const &cli_opts, std::span<uint8_t const> input_data,
+            OutputSink &sink, std::span<uint8_t> output_storage)
+      : output(sink, output_storage, cli_opts.line_buffered),
+        input(input_data, cli_opts.eof_behavior) {}
 };
 
 JIT::JIT(std::span<BFOp const> bytecode, bfjit::CLIOpts const &cli_opts)
-    : m_ip(0), m_ptr(0), m_bytecode(bytecode), m_cli_opts(cli_opts),
-      m_inner_data(std::make_unique<InnerData>()) {
-  m_buffer.resize(4096);
+    // guard pages must be wider than anything the code can reach unchecked
+    : m_buffer(cli_opts.tape_size * cli_opts.cell_width,
+               cli_opts.checked_tape
+                   ? 0
+                   : (max_cell_reach(bytecode) + 1) * cli_opts.cell_width),
+      m_tape_size(m_buffer.size()), m_ptr(0), m_ip(0), m_bytecode(bytecode),
+      m_cli_opts(cli_opts),
+      m_inner_data(std::make_unique<InnerData>(cli_opts)) {
+  if (cli_opts.profile_loops) {
+    m_profile = std::make_unique<LoopProfile>(bytecode);
+    m_inner_data->loop_counters = m_profile->counters().data();
+  }
 }
+JIT::JIT(std::unique_ptr<CachedCode> cached, bfjit::CLIOpts const &cli_opts)
+    : m_buffer(cli_opts.tape_size * cli_opts.cell_width,
+               cached->guard_size()),
+      m_tape_size(m_buffer.size()), m_ptr(0), m_ip(0),
+      mapping_bytecode_to_code(cached->mapping().begin(),
+                               cached->mapping().end()),
+      main_function(reinterpret_cast<MFuncType>(
+          const_cast<uint8_t *>(cached->code()))),
+      m_cli_opts(cli_opts),
+      m_inner_data(std::make_unique<InnerData>(cli_opts)),
+      m_cached_code(std::move(cached)) {}
+JIT::JIT(std::span<BFOp const> bytecode, bfjit::CLIOpts const &cli_opts,
+         CodeOnly)
+    : m_tape_size(Tape::rounded_size(cli_opts.tape_size * cli_opts.cell_width)),
+      m_ptr(0), m_ip(0), m_bytecode(bytecode), m_cli_opts(cli_opts) {}
 JIT::~JIT() = default;
 
 void JIT::do_codegen() {
@@ -74,29 +147,41 @@ void JIT::do_codegen() {
 
   a.mov(DATA_BASE, a64::x0);
   a.mov(DATA_INDEX, a64::x1);
-  a.mov(CACHE_VALUE, asmjit::Imm(0));
+  load_cell(a, CACHE_VALUE, current_cell(m_cli_opts.cell_width),
+            m_cli_opts.cell_width);
 
-  if (m_cli_opts.debug_info)
-    a.mov(DEBUG_INFO, a64::x3);
-
-  a.sub(a64::sp, a64::sp, asmjit::Imm(16));
+  a.sub(a64::sp, a64::sp, asmjit::Imm(32));
   a.str(a64::x29, a64::Mem(a64::sp, 0));
   a.str(a64::x30, a64::Mem(a64::sp, 8));
+  a.str(CONTEXT, a64::Mem(a64::sp, 16));
   a.mov(a64::x29, a64::sp);
+  a.mov(CONTEXT, a64::x3);
 
-  // a.br(a64::x2);
+  // where run_for() carries on from, the first operation otherwise
+  a.br(a64::x2);
 
   ::do_codegen(a, m_bytecode, exit_label, outside_of_bounds,
-               (uint32_t)this->m_buffer.size(), this->mapping_bytecode_to_code,
+               this->m_tape_size / m_cli_opts.cell_width,
+               !this->m_buffer.guarded(), this->mapping_bytecode_to_code,
                m_cli_opts);
 
+  auto epilogue = a.newLabel();
+  a.b(exit_label);
   a.bind(outside_of_bounds);
+  a.mov(a64::x0, CONTEXT);
+  a.bl(asmjit::Imm(outsize_of_bounds));
+  a.b(epilogue);
 
+  // the caller's tape is left as the program did, run_on() hands it back
   a.bind(exit_label);
+  store_cell(a, CACHE_VALUE, current_cell(m_cli_opts.cell_width),
+             m_cli_opts.cell_width);
+  a.bind(epilogue);
   a.mov(a64::sp, a64::x29);
+  a.ldr(CONTEXT, a64::Mem(a64::sp, 16));
   a.ldr(a64::x29, a64::Mem(a64::sp, 0));
   a.ldr(a64::x30, a64::Mem(a64::sp, 8));
-  a.add(a64::sp, a64::sp, asmjit::Imm(16));
+  a.add(a64::sp, a64::sp, asmjit::Imm(32));
   a.ret(a64::x30);
 
   MFuncType func;
@@ -108,43 +193,319 @@ void JIT::do_codegen() {
   this->main_function = func;
 }
 
+auto JIT::compile_loop(size_t begin) -> MLoopType {
+  auto const loop = std::span(m_bytecode).subspan(
+      begin, m_bytecode[begin].loop_arg - begin + 1);
+  // Halt stops the whole program, the loop has no way to say so
+  for (auto const &op : loop)
+    if (op.m_type == BFOp::Type::Halt)
+      return nullptr;
+
+  EHandler ehandler;
+
+  asmjit::CodeHolder code_holder;
+  code_holder.init(runtime.environment());
+  code_holder.setErrorHandler(&ehandler);
+
+  asmjit::a64::Assembler a(&code_holder);
+
+  auto exit_label = a.newLabel();
+  auto outside_of_bounds = a.newLabel();
+  std::vector<size_t> jump_offsets;
+  // the caller has nowhere to carry on from if it stopped in the middle
+  auto opts = m_cli_opts;
+  opts.fuel = false;
+
+  a.mov(DATA_BASE, a64::x0);
+  a.mov(DATA_INDEX, a64::x1);
+  load_cell(a, CACHE_VALUE, current_cell(m_cli_opts.cell_width),
+            m_cli_opts.cell_width);
+
+  a.sub(a64::sp, a64::sp, asmjit::Imm(32));
+  a.str(a64::x29, a64::Mem(a64::sp, 0));
+  a.str(a64::x30, a64::Mem(a64::sp, 8));
+  a.str(CONTEXT, a64::Mem(a64::sp, 16));
+  a.mov(a64::x29, a64::sp);
+  a.mov(CONTEXT, a64::x2);
+
+  ::do_codegen(a, loop, exit_label, outside_of_bounds,
+               this->m_tape_size / m_cli_opts.cell_width,
+               !this->m_buffer.guarded(), jump_offsets, opts);
+
+  // hand the state back to the caller
+  store_cell(a, CACHE_VALUE, current_cell(m_cli_opts.cell_width),
+             m_cli_opts.cell_width);
+  a.mov(a64::x0, DATA_INDEX);
+  a.b(exit_label);
+  a.bind(outside_of_bounds);
+  a.mov(a64::x0, CONTEXT);
+  a.bl(asmjit::Imm(outsize_of_bounds));
+  a.mov(a64::x0, asmjit::Imm(LOOP_FAILED));
+
+  a.bind(exit_label);
+  a.mov(a64::sp, a64::x29);
+  a.ldr(CONTEXT, a64::Mem(a64::sp, 16));
+  a.ldr(a64::x29, a64::Mem(a64::sp, 0));
+  a.ldr(a64::x30, a64::Mem(a64::sp, 8));
+  a.add(a64::sp, a64::sp, asmjit::Imm(32));
+  a.ret(a64::x30);
+
+  MLoopType func;
+  auto const err = runtime.add(&func, &code_holder);
+  if (err) {
+    fmt::print("error creating the function, err: {}", err);
+    return nullptr;
+  }
+  return func;
+}
+
+auto JIT::write_executable(std::span<BFOp const>, bfjit::CLIOpts const &,
+                           char const *) -> bool {
+  // this backend only runs on macOS, which would need a Mach-O writer
+  fmt::print(fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
+  fmt::print(": compiling to an executable is only supported on x86-64\n");
+  return false;
+}
+
+auto JIT::run_on(std::span<uint8_t> tape, std::span<uint8_t const> input,
+                 OutputSink &output) const -> RunOnResult {
+  std::array<uint8_t, RUN_ON_OUTPUT_CAPACITY> storage;
+  InnerData context(m_cli_opts, input, output, storage);
+  if (!mapping_bytecode_to_code.empty())
+    this->main_function(uint64_t(tape.data()), 0,
+                        uint64_t(this->main_function) +
+                            mapping_bytecode_to_code[0],
+                        &context);
+  context.output.flush();
+  if (context.out_of_bounds)
+    return RunOnResult::OutOfBounds;
+  return context.halted ? RunOnResult::InfiniteLoop : RunOnResult::Finished;
+}
+
+auto JIT::machine_code() const -> std::span<uint8_t const> {
+  // the runtime is called by absolute address, the code only works in the
+  // process that generated it
+  return {};
+}
+
+auto JIT::out_of_bounds() const -> bool {
+  return m_inner_data->out_of_bounds;
+}
+
+auto JIT::output() -> OutputBuffer & { return m_inner_data->output; }
+
+auto JIT::input() -> InputBuffer & { return m_inner_data->input; }
+
 void JIT::run_until_end() {
-  if (this->main_function) {
-    // skip if already completed
-    if (m_ip >= mapping_bytecode_to_code.size())
-      return;
-
-    auto data = uint64_t(this->m_buffer.data());
-    auto const offset = mapping_bytecode_to_code[m_ip];
-    auto const addr = uint64_t(this->main_function) + offset;
-    this->main_function(data, this->m_ptr, addr, m_inner_data.get());
-    if (m_cli_opts.debug_info) {
-      fmt::print("Debug info:\n");
-      fmt::print("\tMod:    {}\n", m_inner_data->exec_mod);
-      fmt::print("\tModPtr: {}\n", m_inner_data->exec_mod_ptr);
-      fmt::print("\tOut:    {}\n", m_inner_data->exec_out);
-      fmt::print("\tLoopB:  {}\n", m_inner_data->exec_loop_beg);
-      fmt::print("\tLoopE:  {}\n", m_inner_data->exec_loop_end);
-      fmt::print("\tSetVal: {}\n", m_inner_data->exec_set_value);
-    }
-  } else {
+  while (!run_for(UINT64_MAX))
+    ;
+  if (m_cli_opts.debug_info) {
+    fmt::print("Debug info:\n");
+    fmt::print("\tMod:    {}\n", m_inner_data->exec_mod);
+    fmt::print("\tModPtr: {}\n", m_inner_data->exec_mod_ptr);
+    fmt::print("\tOut:    {}\n", m_inner_data->exec_out);
+    fmt::print("\tLoopB:  {}\n", m_inner_data->exec_loop_beg);
+    fmt::print("\tLoopE:  {}\n", m_inner_data->exec_loop_end);
+    fmt::print("\tSetVal: {}\n", m_inner_data->exec_set_value);
+    fmt::print("\tMulAdd: {}\n", m_inner_data->exec_mul_add);
+    fmt::print("\tScan:   {}\n", m_inner_data->exec_scan);
+  }
+}
+
+auto JIT::run_for(uint64_t fuel) -> bool {
+  if (!this->main_function) {
     fmt::print("you need to call do_codegen first\n");
+    return true;
+  }
+  // skip if already completed
+  if (m_ip >= mapping_bytecode_to_code.size())
+    return true;
+
+  auto data = uint64_t(this->m_buffer.data());
+  auto const offset = mapping_bytecode_to_code[m_ip];
+  auto const addr = uint64_t(this->main_function) + offset;
+  m_inner_data->fuel = fuel;
+  m_inner_data->stopped_at = NOT_STOPPED;
+  this->main_function(data, this->m_ptr, addr, m_inner_data.get());
+  if (m_inner_data->stopped_at != NOT_STOPPED) {
+    m_ip = m_inner_data->stopped_at;
+    m_ptr = m_inner_data->stopped_ptr;
+    return false;
   }
+  m_ip = mapping_bytecode_to_code.size();
+  m_inner_data->output.flush();
+  return true;
 }
 } // namespace bfjit
 
+// dst = DATA_INDEX + offset
+void emit_cell_index(asmjit::a64::Assembler &a, asmjit::a64::Gp const &dst,
+                     int64_t offset) {
+  if (offset >= -4095 && offset < 0) {
+    a.sub(dst, DATA_INDEX, asmjit::Imm(-offset));
+  } else if (offset >= 0 && offset <= 4095) {
+    a.add(dst, DATA_INDEX, asmjit::Imm(offset));
+  } else {
+    a.mov(dst, asmjit::Imm(offset));
+    a.add(dst, DATA_INDEX, dst);
+  }
+}
+
+// the part of `reg` a cell `cell_width` bytes wide is kept in, zero extended
+auto cell_sized(asmjit::a64::Gp const &reg, size_t cell_width)
+    -> asmjit::a64::Gp {
+  return cell_width == 8 ? reg.x() : reg.w();
+}
+
+// dst = the cell at mem, zero extended
+void load_cell(asmjit::a64::Assembler &a, asmjit::a64::Gp const &dst,
+               asmjit::a64::Mem const &mem, size_t cell_width) {
+  switch (cell_width) {
+  case 2:
+    a.ldrh(dst.w(), mem);
+    break;
+  case 4:
+    a.ldr(dst.w(), mem);
+    break;
+  case 8:
+    a.ldr(dst.x(), mem);
+    break;
+  default:
+    a.ldrb(dst.w(), mem);
+    break;
+  }
+}
+
+void store_cell(asmjit::a64::Assembler &a, asmjit::a64::Gp const &src,
+                asmjit::a64::Mem const &mem, size_t cell_width) {
+  switch (cell_width) {
+  case 2:
+    a.strh(src.w(), mem);
+    break;
+  case 4:
+    a.str(src.w(), mem);
+    break;
+  case 8:
+    a.str(src.x(), mem);
+    break;
+  default:
+    a.strb(src.w(), mem);
+    break;
+  }
+}
+
+// drops what arithmetic carried out of a cell narrower than a w register
+void wrap_cell(asmjit::a64::Assembler &a, asmjit::a64::Gp const &reg,
+               size_t cell_width) {
+  if (cell_width < 4)
+    a.and_(reg.w(), reg.w(), asmjit::Imm(bfjit::cell_mask(cell_width)));
+}
+
 void do_codegen(asmjit::a64::Assembler &a, std::span<bfjit::BFOp const> code,
                 asmjit::Label &exit, asmjit::Label &outside_bounds,
-                uint32_t data_size, std::vector<size_t> &jump_offsets,
-                bfjit::CLIOpts const &opts) {
+                uint64_t data_size, bool checked,
+                std::vector<size_t> &jump_offsets, bfjit::CLIOpts const &opts) {
+  using InnerData = bfjit::JIT::InnerData;
+  using OutputBuffer = bfjit::OutputBuffer;
+  constexpr auto OUTPUT = int32_t(offsetof(InnerData, output));
+  constexpr auto OUTPUT_DATA = OUTPUT + int32_t(offsetof(OutputBuffer, m_data));
+  constexpr auto OUTPUT_SIZE = OUTPUT + int32_t(offsetof(OutputBuffer, m_size));
+  constexpr auto OUTPUT_CAPACITY =
+      OUTPUT + int32_t(offsetof(OutputBuffer, m_capacity));
+  using InputBuffer = bfjit::InputBuffer;
+  constexpr auto INPUT = int32_t(offsetof(InnerData, input));
+  constexpr auto INPUT_DATA = INPUT + int32_t(offsetof(InputBuffer, m_data));
+  constexpr auto INPUT_POS = INPUT + int32_t(offsetof(InputBuffer, m_pos));
+  constexpr auto INPUT_SIZE = INPUT + int32_t(offsetof(InputBuffer, m_size));
+  constexpr auto LOOP_COUNTERS = int32_t(offsetof(InnerData, loop_counters));
+  constexpr auto FUEL = int32_t(offsetof(InnerData, fuel));
+  constexpr auto STOPPED_AT = int32_t(offsetof(InnerData, stopped_at));
+  constexpr auto STOPPED_PTR = int32_t(offsetof(InnerData, stopped_ptr));
+
   std::stack<asmjit::Label> loop_labels;
+  // where each LoopEnd goes once out of fuel, with its index in `code`
+  std::vector<std::pair<asmjit::Label, size_t>> out_of_fuel;
+  // LoopBeg seen so far, which makes the number of the next one
+  size_t loops = 0;
+  auto const width = opts.cell_width;
+  auto const mask = bfjit::cell_mask(width);
+  auto const cache = cell_sized(CACHE_VALUE, width);
+  // the cell at index `reg`
+  auto cell_at = [&](a64::Gp const &reg) {
+    return a64::Mem(DATA_BASE, reg, a64::lsl(uint32_t(std::countr_zero(width))));
+  };
+  // cell at DATA_INDEX + offset, offset 0 lives in CACHE_VALUE instead
+  auto cell = [&](int64_t offset) {
+    emit_cell_index(a, TEMP_ADDR, offset);
+    return cell_at(TEMP_ADDR);
+  };
+  // reg += value, with reg already cell sized
+  auto add_value = [&](a64::Gp const &reg, uint64_t value) {
+    value &= mask;
+    auto const negated = -value & mask;
+    if (value <= 4095) {
+      a.add(reg, reg, asmjit::Imm(value));
+    } else if (negated <= 4095) {
+      a.sub(reg, reg, asmjit::Imm(negated));
+    } else {
+      a.mov(cell_sized(TEMP_REG, width), asmjit::Imm(value));
+      a.add(reg, reg, cell_sized(TEMP_REG, width));
+    }
+    wrap_cell(a, reg, width);
+  };
+  // jumps to outside_bounds if reg isn't a valid index
+  auto check_limit = [&](a64::Gp const &reg) {
+    a.mov(TEMP_LIMIT, asmjit::Imm(data_size));
+    a.cmp(reg, TEMP_LIMIT);
+    a.b_hs(outside_bounds);
+  };
+  auto check_index = [&](int64_t offset) {
+    emit_cell_index(a, TEMP_ADDR, offset);
+    check_limit(TEMP_ADDR);
+  };
+  // calls into C++ keeping the JIT state, `setup` loads the argument registers
+  auto call_runtime = [&](auto fn, auto setup) {
+    a.sub(a64::sp, a64::sp, asmjit::Imm(32));
+    a.str(CACHE_VALUE, a64::Mem(a64::sp, 0));
+    a.str(DATA_INDEX, a64::Mem(a64::sp, 8));
+    a.str(DATA_BASE, a64::Mem(a64::sp, 16));
+    setup();
+
+    a.bl(asmjit::Imm(fn));
+
+    a.ldr(CACHE_VALUE, a64::Mem(a64::sp, 0));
+    a.ldr(DATA_INDEX, a64::Mem(a64::sp, 8));
+    a.ldr(DATA_BASE, a64::Mem(a64::sp, 16));
+    a.add(a64::sp, a64::sp, asmjit::Imm(32));
+  };
   for (size_t i = 0; i < code.size(); i++) {
     auto const &op = code[i];
+    jump_offsets.push_back(a.offset());
+
+    // offset accesses don't move the pointer, so check the whole range a block
+    // touches when entering it instead
+    if (checked && (i == 0 || code[i - 1].m_type == bfjit::BFOp::Type::LoopBeg ||
+                    code[i - 1].m_type == bfjit::BFOp::Type::LoopEnd ||
+                    code[i - 1].m_type == bfjit::BFOp::Type::ModPtr ||
+                    code[i - 1].m_type == bfjit::BFOp::Type::Scan)) {
+      auto const [min, max] = bfjit::block_offset_range(code.subspan(i));
+      if (min < 0)
+        check_index(min);
+      if (max > 0)
+        check_index(max);
+    }
+
     switch (op.m_type) {
     case bfjit::BFOp::Type::Mod:
-      jump_offsets.push_back(a.offset());
-      a.add(CACHE_VALUE, CACHE_VALUE, asmjit::Imm(op.inc_arg));
-      a.and_(CACHE_VALUE, CACHE_VALUE, asmjit::Imm(255));
+      if (op.m_offset == 0) {
+        add_value(cache, op.inc_arg);
+      } else {
+        auto const mem = cell(op.m_offset);
+        auto const value = cell_sized(TEMP_VALUE_W, width);
+        load_cell(a, value, mem, width);
+        add_value(value, op.inc_arg);
+        store_cell(a, value, mem, width);
+      }
       if (opts.debug_info) {
         a.ldr(TEMP_REG, a64::Mem(DEBUG_INFO, 0));
         a.add(TEMP_REG, TEMP_REG, asmjit::Imm(1));
@@ -152,54 +513,91 @@ void do_codegen(asmjit::a64::Assembler &a, std::span<bfjit::BFOp const> code,
       }
       break;
     case bfjit::BFOp::Type::ModPtr:
-      jump_offsets.push_back(a.offset());
-      a.strb(CACHE_VALUE_W, asmjit::a64::Mem(DATA_BASE, DATA_INDEX));
-      if (op.inc_ptr_arg < 0)
+      store_cell(a, CACHE_VALUE, current_cell(width), width);
+      // merged moves can be longer than the 12 bit immediate of add/sub
+      if (op.inc_ptr_arg >= -4095 && op.inc_ptr_arg < 0) {
         a.sub(DATA_INDEX, DATA_INDEX, asmjit::Imm(-op.inc_ptr_arg));
-      else
+      } else if (op.inc_ptr_arg >= 0 && op.inc_ptr_arg <= 4095) {
         a.add(DATA_INDEX, DATA_INDEX, asmjit::Imm(op.inc_ptr_arg));
-      a.cmp(DATA_INDEX, asmjit::Imm(data_size));
-      a.b_gt(outside_bounds);
-      a.ldrb(CACHE_VALUE_W, asmjit::a64::Mem(DATA_BASE, DATA_INDEX));
+      } else {
+        a.mov(TEMP_ADDR, asmjit::Imm(op.inc_ptr_arg));
+        a.add(DATA_INDEX, DATA_INDEX, TEMP_ADDR);
+      }
+      // on a guarded tape the load below faults instead
+      if (checked)
+        check_limit(DATA_INDEX);
+      load_cell(a, CACHE_VALUE, current_cell(width), width);
       if (opts.debug_info) {
         a.ldr(TEMP_REG, a64::Mem(DEBUG_INFO, 8));
         a.add(TEMP_REG, TEMP_REG, asmjit::Imm(1));
         a.str(TEMP_REG, a64::Mem(DEBUG_INFO, 8));
       }
       break;
-    case bfjit::BFOp::Type::Out:
-      jump_offsets.push_back(a.offset());
-      a.sub(a64::sp, a64::sp, asmjit::Imm(32));
-      a.str(CACHE_VALUE, a64::Mem(a64::sp, 0));
-      a.str(DATA_INDEX, a64::Mem(a64::sp, 8));
-      a.str(DATA_BASE, a64::Mem(a64::sp, 16));
-      if (opts.debug_info) {
-        a.str(DEBUG_INFO, a64::Mem(a64::sp, 24));
+    case bfjit::BFOp::Type::Out: {
+      // only the low byte of the cell is written
+      auto const value = op.m_offset == 0 ? CACHE_VALUE_W : TEMP_VALUE_W;
+      if (op.m_offset != 0)
+        load_cell(a, value, cell(op.m_offset), width);
+      // append to the output buffer
+      a.ldr(TEMP_ADDR, a64::Mem(CONTEXT, OUTPUT_SIZE));
+      a.ldr(TEMP_LIMIT, a64::Mem(CONTEXT, OUTPUT_DATA));
+      a.strb(value, a64::Mem(TEMP_LIMIT, TEMP_ADDR));
+      a.add(TEMP_ADDR, TEMP_ADDR, asmjit::Imm(1));
+      a.str(TEMP_ADDR, a64::Mem(CONTEXT, OUTPUT_SIZE));
+      // and only call out to write it once it's full
+      auto flush = a.newLabel();
+      auto done = a.newLabel();
+      a.ldr(TEMP_LIMIT, a64::Mem(CONTEXT, OUTPUT_CAPACITY));
+      a.cmp(TEMP_ADDR, TEMP_LIMIT);
+      if (opts.line_buffered) {
+        a.b_hs(flush);
+        if (width == 1) {
+          a.cmp(value, asmjit::Imm('\n'));
+        } else {
+          a.and_(TEMP_SOURCE_W, value, asmjit::Imm(255));
+          a.cmp(TEMP_SOURCE_W, asmjit::Imm('\n'));
+        }
+        a.b_ne(done);
+      } else {
+        a.b_lo(done);
       }
-
-      a.mov(a64::x0, CACHE_VALUE);
-      a.bl(asmjit::Imm(print_char));
-
-      if (opts.debug_info) {
-        a.ldr(DEBUG_INFO, a64::Mem(a64::sp, 24));
-      }
-      a.ldr(CACHE_VALUE, a64::Mem(a64::sp, 0));
-      a.ldr(DATA_INDEX, a64::Mem(a64::sp, 8));
-      a.ldr(DATA_BASE, a64::Mem(a64::sp, 16));
-      a.add(a64::sp, a64::sp, asmjit::Imm(32));
+      a.bind(flush);
+      call_runtime(flush_output, [&]() {
+        a.add(a64::x0, CONTEXT, asmjit::Imm(OUTPUT));
+      });
+      a.bind(done);
       if (opts.debug_info) {
         a.ldr(TEMP_REG, a64::Mem(DEBUG_INFO, 16));
         a.add(TEMP_REG, TEMP_REG, asmjit::Imm(1));
         a.str(TEMP_REG, a64::Mem(DEBUG_INFO, 16));
       }
       break;
+    }
     case bfjit::BFOp::Type::LoopBeg: {
-      jump_offsets.push_back(a.offset());
       auto end = a.newLabel();
       auto start = a.newLabel();
+      // LoopCounters[loop].field += 1
+      auto const loop = loops++;
+      auto count = [&](size_t field) {
+        auto at = loop * sizeof(bfjit::LoopCounters) + field;
+        a.ldr(TEMP_REG, a64::Mem(CONTEXT, LOOP_COUNTERS));
+        // past what a scaled 12 bit offset reaches
+        if (at > 4095 * 8) {
+          a.mov(TEMP_ADDR, asmjit::Imm(at));
+          a.add(TEMP_REG, TEMP_REG, TEMP_ADDR);
+          at = 0;
+        }
+        a.ldr(TEMP_ADDR, a64::Mem(TEMP_REG, int32_t(at)));
+        a.add(TEMP_ADDR, TEMP_ADDR, asmjit::Imm(1));
+        a.str(TEMP_ADDR, a64::Mem(TEMP_REG, int32_t(at)));
+      };
+      if (opts.profile_loops)
+        count(offsetof(bfjit::LoopCounters, entries));
       a.bind(start);
       a.cmp(CACHE_VALUE, 0);
       a.b_eq(end);
+      if (opts.profile_loops)
+        count(offsetof(bfjit::LoopCounters, iterations));
 
       loop_labels.push(start);
       loop_labels.push(end);
@@ -216,7 +614,13 @@ void do_codegen(asmjit::a64::Assembler &a, std::span<bfjit::BFOp const> code,
       loop_labels.pop();
       auto start = loop_labels.top();
       loop_labels.pop();
-      jump_offsets.push_back(a.offset());
+      if (opts.fuel) {
+        auto const stop = out_of_fuel.emplace_back(a.newLabel(), i).first;
+        a.ldr(TEMP_REG, a64::Mem(CONTEXT, FUEL));
+        a.cbz(TEMP_REG, stop);
+        a.sub(TEMP_REG, TEMP_REG, asmjit::Imm(1));
+        a.str(TEMP_REG, a64::Mem(CONTEXT, FUEL));
+      }
       a.b(start);
       a.bind(end);
       if (opts.debug_info) {
@@ -228,18 +632,179 @@ void do_codegen(asmjit::a64::Assembler &a, std::span<bfjit::BFOp const> code,
     }
 
     case bfjit::BFOp::Type::SetValue:
-      jump_offsets.push_back(a.offset());
-      a.mov(CACHE_VALUE, asmjit::Imm(op.set_arg));
+      if (op.m_offset == 0) {
+        a.mov(CACHE_VALUE, asmjit::Imm(op.set_arg & mask));
+      } else {
+        auto const value = cell_sized(TEMP_VALUE_W, width);
+        a.mov(value, asmjit::Imm(op.set_arg & mask));
+        store_cell(a, value, cell(op.m_offset), width);
+      }
       if (opts.debug_info) {
         a.ldr(TEMP_REG, a64::Mem(DEBUG_INFO, 40));
         a.add(TEMP_REG, TEMP_REG, asmjit::Imm(1));
         a.str(TEMP_REG, a64::Mem(DEBUG_INFO, 40));
       }
       break;
-    case bfjit::BFOp::Type::In:
-      std::abort();
-    case bfjit::BFOp::Type::Halt:
-      std::abort();
+    case bfjit::BFOp::Type::MulAdd: {
+      auto const target = int64_t(op.m_offset) + op.mul_arg.offset;
+      auto const value =
+          op.m_offset == 0 ? cache : cell_sized(TEMP_SOURCE_W, width);
+      auto const factor = cell_sized(TEMP_FACTOR_W, width);
+      if (op.m_offset != 0)
+        load_cell(a, value, cell(op.m_offset), width);
+      // the original loop never touches the target when the cell is zero
+      auto skip = a.newLabel();
+      a.cbz(value, skip);
+      // sign extended to 64 bits, or to 32 bits, the low bits are all a
+      // narrower cell keeps
+      if (width == 8)
+        a.mov(factor, asmjit::Imm(int64_t(op.mul_arg.factor)));
+      else
+        a.mov(factor, asmjit::Imm(uint32_t(op.mul_arg.factor)));
+      // data[idx + target] += data[idx + offset] * factor
+      if (target == 0) {
+        a.madd(cache, value, factor, cache);
+        wrap_cell(a, cache, width);
+      } else {
+        auto const target_value = cell_sized(TEMP_VALUE_W, width);
+        emit_cell_index(a, TEMP_ADDR, target);
+        if (checked)
+          check_limit(TEMP_ADDR);
+        load_cell(a, target_value, cell_at(TEMP_ADDR), width);
+        a.madd(target_value, value, factor, target_value);
+        store_cell(a, target_value, cell_at(TEMP_ADDR), width);
+      }
+      a.bind(skip);
+      if (opts.debug_info) {
+        a.ldr(TEMP_REG, a64::Mem(DEBUG_INFO, 48));
+        a.add(TEMP_REG, TEMP_REG, asmjit::Imm(1));
+        a.str(TEMP_REG, a64::Mem(DEBUG_INFO, 48));
+      }
+      break;
     }
+    case bfjit::BFOp::Type::Scan: {
+      // nothing to search if the loop wouldn't even start
+      auto done = a.newLabel();
+      a.cbz(CACHE_VALUE, done);
+      // save cached data, the search reads it from the buffer
+      store_cell(a, CACHE_VALUE, current_cell(width), width);
+      call_runtime(bfjit::scan_zero_for(width), [&]() {
+        a.mov(a64::x0, DATA_BASE);
+        a.mov(a64::x1, asmjit::Imm(data_size));
+        a.mov(a64::x2, DATA_INDEX);
+        a.mov(a64::x3, asmjit::Imm(op.scan_arg));
+      });
+      a.mov(DATA_INDEX, a64::x0);
+      // SCAN_NOT_FOUND also fails the bounds check
+      check_limit(DATA_INDEX);
+      // the search stops on a zero cell
+      a.mov(CACHE_VALUE, asmjit::Imm(0));
+      a.bind(done);
+      if (opts.debug_info) {
+        a.ldr(TEMP_REG, a64::Mem(DEBUG_INFO, 56));
+        a.add(TEMP_REG, TEMP_REG, asmjit::Imm(1));
+        a.str(TEMP_REG, a64::Mem(DEBUG_INFO, 56));
+      }
+      break;
+    }
+    case bfjit::BFOp::Type::In: {
+      auto store = [&](a64::Gp const &value) {
+        if (op.m_offset == 0)
+          a.mov(cache, value);
+        else
+          store_cell(a, value, cell(op.m_offset), width);
+      };
+      // take the next byte straight from the input buffer
+      auto refill = a.newLabel();
+      auto done = a.newLabel();
+      a.ldr(TEMP_ADDR, a64::Mem(CONTEXT, INPUT_POS));
+      a.ldr(TEMP_LIMIT, a64::Mem(CONTEXT, INPUT_SIZE));
+      a.cmp(TEMP_ADDR, TEMP_LIMIT);
+      a.b_hs(refill);
+      a.ldr(TEMP_LIMIT, a64::Mem(CONTEXT, INPUT_DATA));
+      a.ldrb(TEMP_VALUE_W, a64::Mem(TEMP_LIMIT, TEMP_ADDR));
+      a.add(TEMP_ADDR, TEMP_ADDR, asmjit::Imm(1));
+      a.str(TEMP_ADDR, a64::Mem(CONTEXT, INPUT_POS));
+      store(cell_sized(TEMP_VALUE_W, width));
+      a.b(done);
+      // and only call out to read more (or handle EOF) once it's empty
+      a.bind(refill);
+      call_runtime(read_input, [&]() {
+        if (op.m_offset == 0)
+          a.mov(a64::x1, CACHE_VALUE);
+        else
+          load_cell(a, a64::x1, cell(op.m_offset), width);
+        a.add(a64::x0, CONTEXT, asmjit::Imm(INPUT));
+      });
+      if (width == 4)
+        a.mov(a64::w0, a64::w0);
+      else
+        wrap_cell(a, a64::w0, width);
+      store(cell_sized(a64::x0, width));
+      a.bind(done);
+      break;
+    }
+    case bfjit::BFOp::Type::Halt: {
+      // a loop like [] that never ends once entered
+      auto done = a.newLabel();
+      a.cbz(CACHE_VALUE, done);
+      if (opts.fuel) {
+        // so it spins like the loop would, until it's out of fuel
+        auto spin = a.newLabel();
+        auto const stop = out_of_fuel.emplace_back(a.newLabel(), i).first;
+        a.bind(spin);
+        a.ldr(TEMP_REG, a64::Mem(CONTEXT, FUEL));
+        a.cbz(TEMP_REG, stop);
+        a.sub(TEMP_REG, TEMP_REG, asmjit::Imm(1));
+        a.str(TEMP_REG, a64::Mem(CONTEXT, FUEL));
+        a.b(spin);
+      } else {
+        call_runtime(infinite_loop, [&]() { a.mov(a64::x0, CONTEXT); });
+        a.b(exit);
+      }
+      a.bind(done);
+      break;
+    }
+    }
+  }
+
+  // out of the way of the loops, the current cell goes back to the tape
+  if (!out_of_fuel.empty())
+    a.b(exit);
+  for (auto const &[stop, at] : out_of_fuel) {
+    a.bind(stop);
+    store_cell(a, CACHE_VALUE, current_cell(width), width);
+    a.str(DATA_INDEX, a64::Mem(CONTEXT, STOPPED_PTR));
+    a.mov(TEMP_REG, asmjit::Imm(at));
+    a.str(TEMP_REG, a64::Mem(CONTEXT, STOPPED_AT));
+    a.b(exit);
   }
 }
+
+uint64_t read_input(bfjit::InputBuffer *in, uint64_t current) {
+  auto const value = in->next_or(current);
+  // a program that mostly waits for input may not reach enough LoopEnd for
+  // run_limited() to see the request, this stops it at the next one
+  if (bfjit::stop_requested()) {
+    auto *const data = reinterpret_cast<bfjit::JIT::InnerData *>(
+        reinterpret_cast<char *>(in) - offsetof(bfjit::JIT::InnerData, input));
+    data->fuel = 0;
+  }
+  return value;
+}
+
+void outsize_of_bounds(bfjit::JIT::InnerData *data) {
+  data->output.flush();
+  data->out_of_bounds = true;
+  // whoever lent the output gets told by run_on() instead
+  if (data->output.m_sink == nullptr)
+    fmt::print(stderr, "trying to access data outside of bouds\n");
+}
+
+void infinite_loop(bfjit::JIT::InnerData *data) {
+  data->output.flush();
+  data->halted = true;
+  // whoever lent the output gets told by run_on() instead
+  if (data->output.m_sink == nullptr)
+    fmt::print("halted, reason: infinte loop reached\n");
+}
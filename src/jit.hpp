@@ -4,8 +4,12 @@
 #include <span>
 #include <vector>
 
+#include "cache.hpp"
+#include "io.hpp"
 #include "options.hpp"
 #include "parser.hpp"
+#include "profile.hpp"
+#include "tape.hpp"
 
 #include <asmjit/asmjit.h>
 
@@ -13,7 +17,10 @@ namespace bfjit {
 
 class JIT {
 public:
-  std::vector<uint8_t> m_buffer;
+  Tape m_buffer;
+  // bytes of tape the code is generated for, m_buffer.size() unless the JIT
+  // only generates code
+  size_t m_tape_size;
   size_t m_ptr;
   size_t m_ip;
   std::span<BFOp const> m_bytecode;
@@ -26,11 +33,28 @@ public:
   using MFuncType = void (*)(uint64_t base, uint64_t idx, uint64_t jump_addr, void *extra);
 #endif
   MFuncType main_function;
+  // runs a single loop starting at its LoopBeg, returns the data index after
+  // it or LOOP_FAILED if it stopped on an out of bounds access
+  using MLoopType = uint64_t (*)(uint64_t base, uint64_t idx, void *extra);
+  static constexpr uint64_t LOOP_FAILED = UINT64_MAX;
   bfjit::CLIOpts const &m_cli_opts;
   struct InnerData;
   std::unique_ptr<InnerData> m_inner_data;
+  // what main_function points into when it came from the cache
+  std::unique_ptr<CachedCode> m_cached_code;
+  size_t m_code_size = 0;
+  // only with profile_loops, the generated code counts into it
+  std::unique_ptr<LoopProfile> m_profile;
 
   JIT(std::span<BFOp const> bytecode, bfjit::CLIOpts const &cli_opts);
+  // runs code an earlier process compiled, do_codegen() must not be called
+  JIT(std::unique_ptr<CachedCode> cached, bfjit::CLIOpts const &cli_opts);
+  // Only generates code for run_on(): there's no tape, no buffers on stdin
+  // and stdout nor loop profile, so nothing else but do_codegen() can be
+  // called. The code is always bounds checked.
+  struct CodeOnly {};
+  JIT(std::span<BFOp const> bytecode, bfjit::CLIOpts const &cli_opts,
+      CodeOnly);
   ~JIT();
   JIT(JIT const &) = delete;
   JIT(JIT &&) = delete;
@@ -38,7 +62,54 @@ public:
   JIT &operator=(JIT &&) = delete;
 
   void run_until_end();
+  // Runs from m_ip like run_until_end(), but the code do_codegen() generated
+  // with CLIOpts::fuel stops after `fuel` loop iterations. True if the
+  // program ended, false if it stopped first, right before a LoopEnd or a
+  // Halt it spins on, with m_ip and m_ptr (and the tape) where it was, so
+  // another call carries on from there. The output is only flushed once it
+  // ends.
+  [[nodiscard]]
+  auto run_for(uint64_t fuel) -> bool;
+  // InnerData::stopped_at while the code hasn't stopped
+  static constexpr uint64_t NOT_STOPPED = UINT64_MAX;
+  // Runs the code do_codegen() generated from the start on a tape lent by
+  // the caller, at least m_tape_size bytes, reading `input` and writing to
+  // `output`. Allocates nothing and leaves the JIT alone, so it can run on
+  // several threads at once. The code must have been generated with
+  // checked_tape (or CodeOnly), there are no guard pages around `tape`.
+  enum class RunOnResult {
+    Finished,
+    // the program accessed data outside of the tape
+    OutOfBounds,
+    // the program reached a Halt, a loop it would never leave
+    InfiniteLoop,
+  };
+  [[nodiscard]]
+  auto run_on(std::span<uint8_t> tape, std::span<uint8_t const> input,
+              OutputSink &output) const -> RunOnResult;
+  // output run_on() buffers before handing it to the sink
+  static constexpr size_t RUN_ON_OUTPUT_CAPACITY = 4096;
   void do_codegen();
+  // compiles m_bytecode[begin, loop end] on its own, nullptr if it can't be
+  [[nodiscard]]
+  auto compile_loop(size_t begin) -> MLoopType;
+  // compiles `bytecode` into a static executable at `path` that carries its
+  // own small runtime, false (after printing why) if it couldn't
+  [[nodiscard]]
+  static auto write_executable(std::span<BFOp const> bytecode,
+                               bfjit::CLIOpts const &cli_opts, char const *path)
+      -> bool;
+  // what do_codegen() generated, empty if it can't be reused by another
+  // process
+  [[nodiscard]]
+  auto machine_code() const -> std::span<uint8_t const>;
+  // the program accessed data outside of the tape, which stopped it
+  [[nodiscard]]
+  auto out_of_bounds() const -> bool;
+  [[nodiscard]]
+  auto output() -> OutputBuffer &;
+  [[nodiscard]]
+  auto input() -> InputBuffer &;
 };
 
 } // namespace bfjit
@@ -1,18 +1,65 @@
 
 #include "jit.hpp"
 #include "asmjit/core/operand.h"
+#include "elf.hpp"
+#include "io.hpp"
+#include "optimizer.hpp"
 #include "options.hpp"
 #include "parser.hpp"
+#include "scan.hpp"
+#include "snapshot.hpp"
 
+#include <cerrno>
+#include <cstddef>
 #include <cstdlib>
+#include <elf.h>
+#include <fmt/color.h>
 #include <fmt/format.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <map>
 #include <stack>
 
 namespace x64 = asmjit::x86;
 constexpr auto DATA_BASE   = x64::rcx;
 constexpr auto DATA_INDEX  = x64::rdx;
-constexpr auto CACHE_VALUE = x64::r8b;
+// holds the current cell, in its low cell width bytes
+constexpr auto CACHE_VALUE = x64::r8;
+// JIT::InnerData, callee saved so it survives calls into the runtime
+constexpr auto CONTEXT     = x64::rbx;
+// Cells other than the current one that a block uses the most, callee saved
+// too so they stay live across calls into the runtime
+constexpr x64::Gp CELL_REGISTERS[] = { x64::r12, x64::r13, x64::r14, x64::r15 };
+#ifdef _WIN32
+constexpr auto ARG0 = x64::rcx;
+constexpr auto ARG1 = x64::rdx;
+constexpr auto ARG2 = x64::r8;
+constexpr auto ARG3 = x64::r9;
+#else
+constexpr auto ARG0 = x64::rdi;
+constexpr auto ARG1 = x64::rsi;
+constexpr auto ARG2 = x64::rdx;
+constexpr auto ARG3 = x64::rcx;
+#endif
+
+// The part of `reg` a cell `cell_width` bytes wide fits in
+auto cell_sized(x64::Gp const& reg, size_t cell_width) -> x64::Gp {
+	switch (cell_width) {
+	case 2: return reg.r16();
+	case 4: return reg.r32();
+	case 8: return reg.r64();
+	default: return reg.r8();
+	}
+}
+// Cell at DATA_INDEX + offset, DATA_INDEX counts cells
+auto tape_cell(int32_t offset, size_t cell_width) -> x64::Mem {
+	auto const shift = uint32_t(std::countr_zero(cell_width));
+	return x64::ptr(DATA_BASE, DATA_INDEX, shift, int32_t(int64_t(offset) * int64_t(cell_width)), uint32_t(cell_width));
+}
 
 struct EHandler : public asmjit::ErrorHandler {
 	void handleError(asmjit::Error err, char const* msg, asmjit::BaseEmitter*) override {
@@ -21,35 +68,120 @@ struct EHandler : public asmjit::ErrorHandler {
 	}
 };
 
-#ifdef _WIN32
-void __fastcall print_char(uint64_t r) {
-#else
-void print_char(uint64_t r) {
-#endif
-	r = r & 0xff;
-	fmt::print("{}", char(r));
-}
-#ifdef _WIN32
-void __fastcall print_char(uint64_t r) {
-#else
-void outsize_of_bounds() {
-#endif
-	fmt::print("trying to access data outside of bouds\n");
+void flush_output(bfjit::OutputBuffer* out) {
+	out->flush();
 }
+// `current` is the cell zero extended, the result is truncated to a cell
+uint64_t read_input(bfjit::InputBuffer* in, uint64_t current);
+void outsize_of_bounds(bfjit::JIT::InnerData* data);
+void infinite_loop(bfjit::JIT::InnerData* data);
+
+// What the generated code calls: the functions above when it runs in this
+// process, routines emitted along with it when it's written to an executable
+struct RuntimeCalls {
+	asmjit::Operand flush_output;
+	asmjit::Operand read_input;
+	asmjit::Operand scan_zero;
+	// Halt without CLIOpts::fuel, write_executable() never emits one
+	asmjit::Operand infinite_loop;
+};
 
-void do_codegen(asmjit::x86::Assembler& a, std::span<bfjit::BFOp const> code, asmjit::Label& exit, asmjit::Label& outside_bounds, uint32_t data_size, std::vector<size_t>& jump_offsets);
+void do_codegen(asmjit::x86::Assembler& a, std::span<bfjit::BFOp const> code, asmjit::Label& exit, asmjit::Label& outside_bounds, uint64_t data_size, bool checked, std::vector<size_t>& jump_offsets, bfjit::CLIOpts const& opts, RuntimeCalls const& runtime);
+
+// Saves and restores CONTEXT and the cell registers
+void push_saved_registers(asmjit::x86::Assembler& a) {
+	a.push(CONTEXT);
+	for (auto const& reg : CELL_REGISTERS)
+		a.push(reg.r64());
+}
+void pop_saved_registers(asmjit::x86::Assembler& a) {
+	for (size_t i = std::size(CELL_REGISTERS); i > 0; i--)
+		a.pop(CELL_REGISTERS[i - 1].r64());
+	a.pop(CONTEXT);
+}
 
 namespace bfjit {
 
-    struct JIT::InnerData {};
+    struct JIT::InnerData {
+        OutputBuffer output;
+        InputBuffer input;
+
+        // the runtime is called through these, so the generated code doesn't
+        // depend on where bfjit was loaded and can be cached
+        void (*flush_output)(OutputBuffer*) = ::flush_output;
+        uint64_t (*read_input)(InputBuffer*, uint64_t) = ::read_input;
+        size_t (*scan_zero)(uint8_t const*, size_t, size_t, int64_t) = bfjit::scan_zero;
+        void (*outside_bounds)(InnerData*) = ::outsize_of_bounds;
+        void (*infinite_loop)(InnerData*) = ::infinite_loop;
+        bool out_of_bounds = false;
+        // reached a Halt on a non zero cell
+        bool halted = false;
+        // LoopProfile::counters(), when profiling
+        LoopCounters* loop_counters = nullptr;
+        // loop iterations left with CLIOpts::fuel, and where the code
+        // stopped once there were none: the LoopEnd it didn't run and the
+        // data index
+        uint64_t fuel = UINT64_MAX;
+        uint64_t stopped_at = NOT_STOPPED;
+        uint64_t stopped_ptr = 0;
+
+        explicit InnerData(CLIOpts const& cli_opts) :
+            output(1, cli_opts.line_buffered),
+            input(0, cli_opts.eof_behavior, &output),
+            scan_zero(scan_zero_for(cli_opts.cell_width))
+        {}
+        InnerData(CLIOpts const& cli_opts, std::span<uint8_t const> input_data, OutputSink& sink, std::span<uint8_t> output_storage) :
+            output(sink, output_storage, cli_opts.line_buffered),
+            input(input_data, cli_opts.eof_behavior),
+            scan_zero(scan_zero_for(cli_opts.cell_width))
+        {}
+    };
+
+    namespace {
+        auto in_process_runtime() -> RuntimeCalls {
+            return RuntimeCalls{
+                .flush_output = x64::qword_ptr(CONTEXT, int32_t(offsetof(JIT::InnerData, flush_output))),
+                .read_input = x64::qword_ptr(CONTEXT, int32_t(offsetof(JIT::InnerData, read_input))),
+                .scan_zero = x64::qword_ptr(CONTEXT, int32_t(offsetof(JIT::InnerData, scan_zero))),
+                .infinite_loop = x64::qword_ptr(CONTEXT, int32_t(offsetof(JIT::InnerData, infinite_loop))),
+            };
+        }
+    }
 
     JIT::JIT(std::span<BFOp const> bytecode, bfjit::CLIOpts const& cli_opts) :
+        // guard pages must be wider than anything the code can reach unchecked
+        m_buffer(cli_opts.tape_size * cli_opts.cell_width, cli_opts.checked_tape ? 0 : (max_cell_reach(bytecode) + 1) * cli_opts.cell_width),
+        m_tape_size(m_buffer.size()),
+        m_ptr(0),
         m_ip(0),
+        m_bytecode(bytecode),
+	m_cli_opts(cli_opts),
+	m_inner_data(std::make_unique<InnerData>(cli_opts))
+    {
+        if (cli_opts.profile_loops) {
+            m_profile = std::make_unique<LoopProfile>(bytecode);
+            m_inner_data->loop_counters = m_profile->counters().data();
+        }
+    }
+    JIT::JIT(std::unique_ptr<CachedCode> cached, bfjit::CLIOpts const& cli_opts) :
+        m_buffer(cli_opts.tape_size * cli_opts.cell_width, cached->guard_size()),
+        m_tape_size(m_buffer.size()),
         m_ptr(0),
+        m_ip(0),
+        mapping_bytecode_to_code(cached->mapping().begin(), cached->mapping().end()),
+        main_function(reinterpret_cast<MFuncType>(const_cast<uint8_t*>(cached->code()))),
+        m_cli_opts(cli_opts),
+        m_inner_data(std::make_unique<InnerData>(cli_opts)),
+        m_cached_code(std::move(cached))
+    {
+    }
+    JIT::JIT(std::span<BFOp const> bytecode, bfjit::CLIOpts const& cli_opts, CodeOnly) :
+        m_tape_size(Tape::rounded_size(cli_opts.tape_size * cli_opts.cell_width)),
+        m_ptr(0),
+        m_ip(0),
         m_bytecode(bytecode),
-	m_cli_opts(cli_opts)
+        m_cli_opts(cli_opts)
     {
-        m_buffer.resize(4096);
     }
     JIT::~JIT() = default;
 
@@ -71,29 +203,36 @@ namespace bfjit {
         a.mov(x64::r8, 0);
         a.jmp(x64::r9);
 #else
+        push_saved_registers(a);
+        a.mov(CONTEXT, x64::rcx);
         a.mov(x64::r9, x64::rdx);
         a.mov(DATA_BASE, x64::rdi);
         a.mov(DATA_INDEX, x64::rsi);
-        a.mov(CACHE_VALUE, x64::ptr( DATA_BASE, DATA_INDEX ));
+        a.mov(cell_sized(CACHE_VALUE, m_cli_opts.cell_width), tape_cell(0, m_cli_opts.cell_width));
         a.jmp(x64::r9);
 #endif
         auto exit_label = a.newLabel();
 		auto outside_of_bounds = a.newLabel();
 
-        ::do_codegen(a, m_bytecode, exit_label, outside_of_bounds, (uint32_t)this->m_buffer.size(), this->mapping_bytecode_to_code);
+        ::do_codegen(a, m_bytecode, exit_label, outside_of_bounds, this->m_tape_size / m_cli_opts.cell_width, !this->m_buffer.guarded(), this->mapping_bytecode_to_code, m_cli_opts, in_process_runtime());
 
+        // the caller's tape is left as the program did, run_on() hands it back
         a.bind(exit_label);
+        a.mov(tape_cell(0, m_cli_opts.cell_width), cell_sized(CACHE_VALUE, m_cli_opts.cell_width));
+        pop_saved_registers(a);
         a.ret();
         a.bind(outside_of_bounds);
 
 		a.push(x64::rbp);
 		a.mov(x64::rbp, x64::rsp);
-		a.add(x64::rsp, 15);
+		a.sub(x64::rsp, 15);
 		a.and_(x64::rsp, uint64_t(~0xf));
-        a.call(outside_of_bounds);
+		a.mov(ARG0, CONTEXT);
+        a.call(x64::qword_ptr(CONTEXT, int32_t(offsetof(InnerData, outside_bounds))));
         a.mov( x64::rsp, x64::rbp );
 		a.pop( x64::rbp );
 
+        pop_saved_registers(a);
         a.ret();
 
         //void(__fastcall* func)(uint64_t base, uint64_t idx, uint64_t addr);
@@ -104,88 +243,616 @@ namespace bfjit {
             return;
         }
         this->main_function = func;
+        m_code_size = code_holder.codeSize();
     }
-    void JIT::run_until_end() {
-        if (this->main_function) {
-            // skip if already completed
-            if (m_ip >= mapping_bytecode_to_code.size())
-                return;
-
-            auto data = uint64_t(this->m_buffer.data());
-            auto const offset = mapping_bytecode_to_code[m_ip];
-            auto const addr = uint64_t(this->main_function) + offset;
-            this->main_function(data, this->m_ptr, addr, nullptr);
+    auto JIT::compile_loop(size_t begin) -> MLoopType {
+        auto const loop = std::span(m_bytecode).subspan(begin, m_bytecode[begin].loop_arg - begin + 1);
+        // Halt stops the whole program, the loop has no way to say so
+        for (auto const& op : loop)
+            if (op.m_type == BFOp::Type::Halt)
+                return nullptr;
+
+        EHandler ehandler;
+
+        asmjit::CodeHolder code_holder;
+        code_holder.init(runtime.environment());
+        code_holder.setErrorHandler(&ehandler);
+
+        asmjit::x86::Assembler a(&code_holder);
+#ifdef _WIN32
+        #error "not implemented yet for windows"
+#else
+        push_saved_registers(a);
+        a.mov(CONTEXT, x64::rdx);
+        a.mov(DATA_BASE, x64::rdi);
+        a.mov(DATA_INDEX, x64::rsi);
+        a.mov(cell_sized(CACHE_VALUE, m_cli_opts.cell_width), tape_cell(0, m_cli_opts.cell_width));
+#endif
+        auto exit_label = a.newLabel();
+        auto outside_of_bounds = a.newLabel();
+        std::vector<size_t> jump_offsets;
+        // the caller has nowhere to carry on from if it stopped in the middle
+        auto opts = m_cli_opts;
+        opts.fuel = false;
+
+        ::do_codegen(a, loop, exit_label, outside_of_bounds, this->m_tape_size / m_cli_opts.cell_width, !this->m_buffer.guarded(), jump_offsets, opts, in_process_runtime());
+
+        // hand the state back to the caller
+        a.bind(exit_label);
+        a.mov(tape_cell(0, m_cli_opts.cell_width), cell_sized(CACHE_VALUE, m_cli_opts.cell_width));
+        a.mov(x64::rax, DATA_INDEX);
+        pop_saved_registers(a);
+        a.ret();
+        a.bind(outside_of_bounds);
+
+        a.push(x64::rbp);
+        a.mov(x64::rbp, x64::rsp);
+        a.sub(x64::rsp, 15);
+        a.and_(x64::rsp, uint64_t(~0xf));
+        a.mov(ARG0, CONTEXT);
+        a.call(x64::qword_ptr(CONTEXT, int32_t(offsetof(InnerData, outside_bounds))));
+        a.mov( x64::rsp, x64::rbp );
+        a.pop( x64::rbp );
+
+        a.mov(x64::rax, LOOP_FAILED);
+        pop_saved_registers(a);
+        a.ret();
+
+        MLoopType func;
+        auto const err = runtime.add(&func, &code_holder);
+        if (err) {
+            fmt::print("error creating the function, err: {}", err);
+            return nullptr;
         }
-        else {
+        return func;
+    }
+    auto JIT::run_on(std::span<uint8_t> tape, std::span<uint8_t const> input, OutputSink& output) const -> RunOnResult {
+        std::array<uint8_t, RUN_ON_OUTPUT_CAPACITY> storage;
+        InnerData context(m_cli_opts, input, output, storage);
+        if (!mapping_bytecode_to_code.empty())
+            this->main_function(uint64_t(tape.data()), 0, uint64_t(this->main_function) + mapping_bytecode_to_code[0], &context);
+        context.output.flush();
+        if (context.out_of_bounds)
+            return RunOnResult::OutOfBounds;
+        return context.halted ? RunOnResult::InfiniteLoop : RunOnResult::Finished;
+    }
+    auto JIT::machine_code() const -> std::span<uint8_t const> {
+        if (!main_function || m_cached_code)
+            return {};
+        return { reinterpret_cast<uint8_t const*>(main_function), m_code_size };
+    }
+    auto JIT::out_of_bounds() const -> bool {
+        return m_inner_data->out_of_bounds;
+    }
+    auto JIT::output() -> OutputBuffer& {
+        return m_inner_data->output;
+    }
+    auto JIT::input() -> InputBuffer& {
+        return m_inner_data->input;
+    }
+    void JIT::run_until_end() {
+        while (!run_for(UINT64_MAX));
+    }
+    auto JIT::run_for(uint64_t fuel) -> bool {
+        if (!this->main_function) {
             fmt::print("you need to call do_codegen first\n");
+            return true;
         }
+        // skip if already completed
+        if (m_ip >= mapping_bytecode_to_code.size())
+            return true;
+
+        auto data = uint64_t(this->m_buffer.data());
+        auto const offset = mapping_bytecode_to_code[m_ip];
+        auto const addr = uint64_t(this->main_function) + offset;
+        m_inner_data->fuel = fuel;
+        m_inner_data->stopped_at = NOT_STOPPED;
+        this->main_function(data, this->m_ptr, addr, m_inner_data.get());
+        if (m_inner_data->stopped_at != NOT_STOPPED) {
+            m_ip = m_inner_data->stopped_at;
+            m_ptr = m_inner_data->stopped_ptr;
+            return false;
+        }
+        m_ip = mapping_bytecode_to_code.size();
+        m_inner_data->output.flush();
+        return true;
+    }
+    auto JIT::write_executable(std::span<BFOp const> bytecode, bfjit::CLIOpts const& cli_opts, char const* path) -> bool {
+        auto print_error = [](std::string_view message) {
+            fmt::print(fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
+            fmt::print(": {}\n", message);
+        };
+        // there's no runtime to report it from
+        for (auto const& op : bytecode) {
+            if (op.m_type == BFOp::Type::Halt) {
+                print_error("the program can get stuck in an infinite loop, it can't be compiled");
+                return false;
+            }
+        }
+        // the routines below only know about bytes
+        if (cli_opts.cell_width != 1) {
+            print_error("executables can only have 1 byte cells");
+            return false;
+        }
+        // nor is there anywhere to count loops into or report them from
+        if (cli_opts.profile_loops) {
+            print_error("executables can't profile loops");
+            return false;
+        }
+        // or to carry on from once stopped
+        if (cli_opts.fuel) {
+            print_error("executables can't run on a budget of loop iterations");
+            return false;
+        }
+        // there's no fault handler to turn guard page hits into an error, so
+        // the tape is always checked
+        constexpr uint64_t PAGE_SIZE = 4096;
+        auto const tape_size = (cli_opts.tape_size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+        constexpr auto OUTPUT = int32_t(offsetof(InnerData, output));
+        constexpr auto INPUT = int32_t(offsetof(InnerData, input));
+        auto output_field = [](size_t member) { return OUTPUT + int32_t(member); };
+        auto input_field = [](size_t member) { return INPUT + int32_t(member); };
+        // InnerData followed by what the buffers point to, all in one mapping
+        constexpr auto CONTEXT_SIZE = int32_t((sizeof(InnerData) + 63) / 64 * 64);
+        constexpr auto MEMORY_SIZE = CONTEXT_SIZE + OutputBuffer::DEFAULT_CAPACITY + InputBuffer::DEFAULT_CAPACITY;
+        constexpr char OUT_OF_BOUNDS[] = "trying to access data outside of bouds\n";
+        constexpr char OUT_OF_MEMORY[] = "error: could not allocate the tape\n";
+
+        EHandler ehandler;
+
+        asmjit::CodeHolder code_holder;
+        code_holder.init(asmjit::Environment::host());
+        code_holder.setErrorHandler(&ehandler);
+
+        asmjit::x86::Assembler a(&code_holder);
+        auto exit_label = a.newLabel();
+        auto outside_of_bounds = a.newLabel();
+        auto out_of_memory = a.newLabel();
+        auto flush_label = a.newLabel();
+        auto read_label = a.newLabel();
+        auto scan_label = a.newLabel();
+        auto out_of_bounds_message = a.newLabel();
+        auto out_of_memory_message = a.newLabel();
+        auto const runtime = RuntimeCalls{ .flush_output = flush_label, .read_input = read_label, .scan_zero = scan_label };
+
+        auto exit_group = [&](int32_t status) {
+            a.mov(x64::edi, status);
+            a.mov(x64::eax, SYS_exit_group);
+            a.syscall();
+        };
+        auto write_message = [&](int32_t fd, asmjit::Label const& message, size_t size) {
+            a.mov(x64::edi, fd);
+            a.lea(x64::rsi, x64::ptr(message));
+            a.mov(x64::edx, int32_t(size));
+            a.mov(x64::eax, SYS_write);
+            a.syscall();
+        };
+        // rax = zeroed pages, fails the whole program if there's no memory
+        auto map_memory = [&](uint64_t size) {
+            a.xor_(x64::edi, x64::edi);
+            a.mov(x64::rsi, size);
+            a.mov(x64::edx, PROT_READ | PROT_WRITE);
+            a.mov(x64::r10d, MAP_PRIVATE | MAP_ANONYMOUS);
+            a.mov(x64::r8, -1);
+            a.xor_(x64::r9d, x64::r9d);
+            a.mov(x64::eax, SYS_mmap);
+            a.syscall();
+            // errors come back as -4095..-1
+            a.cmp(x64::rax, -4095);
+            a.jae(out_of_memory);
+        };
+
+        // the entry point, sets up what JIT::InnerData would hold. The fields
+        // nothing here uses stay zero
+        map_memory(MEMORY_SIZE);
+        a.mov(CONTEXT, x64::rax);
+        a.lea(x64::rax, x64::ptr(CONTEXT, CONTEXT_SIZE));
+        a.mov(x64::qword_ptr(CONTEXT, output_field(offsetof(OutputBuffer, m_data))), x64::rax);
+        a.mov(x64::qword_ptr(CONTEXT, output_field(offsetof(OutputBuffer, m_capacity))), int32_t(OutputBuffer::DEFAULT_CAPACITY));
+        a.mov(x64::dword_ptr(CONTEXT, output_field(offsetof(OutputBuffer, m_fd))), 1);
+        a.add(x64::rax, int32_t(OutputBuffer::DEFAULT_CAPACITY));
+        a.mov(x64::qword_ptr(CONTEXT, input_field(offsetof(InputBuffer, m_data))), x64::rax);
+        a.mov(x64::qword_ptr(CONTEXT, input_field(offsetof(InputBuffer, m_storage))), x64::rax);
+        a.mov(x64::qword_ptr(CONTEXT, input_field(offsetof(InputBuffer, m_capacity))), int32_t(InputBuffer::DEFAULT_CAPACITY));
+        a.lea(x64::rax, x64::ptr(CONTEXT, OUTPUT));
+        a.mov(x64::qword_ptr(CONTEXT, input_field(offsetof(InputBuffer, m_tied))), x64::rax);
+        map_memory(tape_size);
+        a.mov(DATA_BASE, x64::rax);
+        a.xor_(x64::edx, x64::edx);
+        a.xor_(x64::r8d, x64::r8d);
+
+        std::vector<size_t> jump_offsets;
+        ::do_codegen(a, bytecode, exit_label, outside_of_bounds, tape_size, true, jump_offsets, cli_opts, runtime);
+
+        a.bind(exit_label);
+        a.lea(ARG0, x64::ptr(CONTEXT, OUTPUT));
+        a.call(flush_label);
+        exit_group(0);
+        a.bind(outside_of_bounds);
+        a.lea(ARG0, x64::ptr(CONTEXT, OUTPUT));
+        a.call(flush_label);
+        write_message(2, out_of_bounds_message, sizeof(OUT_OF_BOUNDS) - 1);
+        exit_group(1);
+        a.bind(out_of_memory);
+        write_message(2, out_of_memory_message, sizeof(OUT_OF_MEMORY) - 1);
+        exit_group(1);
+
+        // OutputBuffer::flush(), rdi = the buffer
+        {
+            auto again = a.newLabel();
+            auto done = a.newLabel();
+            a.bind(flush_label);
+            a.mov(x64::r10, ARG0);
+            a.mov(x64::rsi, x64::qword_ptr(x64::r10, int32_t(offsetof(OutputBuffer, m_data))));
+            a.mov(x64::rdx, x64::qword_ptr(x64::r10, int32_t(offsetof(OutputBuffer, m_size))));
+            a.bind(again);
+            a.test(x64::rdx, x64::rdx);
+            a.jz(done);
+            a.mov(x64::edi, x64::dword_ptr(x64::r10, int32_t(offsetof(OutputBuffer, m_fd))));
+            a.mov(x64::eax, SYS_write);
+            a.syscall();
+            a.cmp(x64::rax, -EINTR);
+            a.je(again);
+            // nowhere to report a failed write, drop the output like OutputBuffer does
+            a.test(x64::rax, x64::rax);
+            a.jle(done);
+            a.add(x64::rsi, x64::rax);
+            a.sub(x64::rdx, x64::rax);
+            a.jmp(again);
+            a.bind(done);
+            a.mov(x64::qword_ptr(x64::r10, int32_t(offsetof(OutputBuffer, m_size))), 0);
+            a.ret();
+        }
+        // InputBuffer::next_or() once the buffer is empty, rdi = the buffer and
+        // rsi = the current cell
+        {
+            auto again = a.newLabel();
+            auto at_eof = a.newLabel();
+            auto eof = a.newLabel();
+            auto done = a.newLabel();
+            auto untied = a.newLabel();
+            a.bind(read_label);
+            a.push(x64::rsi);
+            a.push(x64::rdi);
+            a.cmp(x64::byte_ptr(x64::rdi, int32_t(offsetof(InputBuffer, m_eof))), 0);
+            a.jne(eof);
+            // so prompts show up before blocking
+            a.mov(x64::rdi, x64::qword_ptr(x64::rdi, int32_t(offsetof(InputBuffer, m_tied))));
+            a.test(x64::rdi, x64::rdi);
+            a.jz(untied);
+            a.call(flush_label);
+            a.bind(untied);
+            a.mov(x64::r10, x64::qword_ptr(x64::rsp));
+            a.bind(again);
+            a.mov(x64::edi, x64::dword_ptr(x64::r10, int32_t(offsetof(InputBuffer, m_fd))));
+            a.mov(x64::rsi, x64::qword_ptr(x64::r10, int32_t(offsetof(InputBuffer, m_storage))));
+            a.mov(x64::rdx, x64::qword_ptr(x64::r10, int32_t(offsetof(InputBuffer, m_capacity))));
+            a.xor_(x64::eax, x64::eax);
+            static_assert(SYS_read == 0);
+            a.syscall();
+            a.cmp(x64::rax, -EINTR);
+            a.je(again);
+            a.test(x64::rax, x64::rax);
+            a.jle(at_eof);
+            a.mov(x64::qword_ptr(x64::r10, int32_t(offsetof(InputBuffer, m_data))), x64::rsi);
+            a.mov(x64::qword_ptr(x64::r10, int32_t(offsetof(InputBuffer, m_size))), x64::rax);
+            a.mov(x64::qword_ptr(x64::r10, int32_t(offsetof(InputBuffer, m_pos))), 1);
+            a.movzx(x64::eax, x64::byte_ptr(x64::rsi));
+            a.jmp(done);
+            a.bind(at_eof);
+            a.mov(x64::byte_ptr(x64::r10, int32_t(offsetof(InputBuffer, m_eof))), 1);
+            a.bind(eof);
+            switch (cli_opts.eof_behavior) {
+            case EofBehavior::Unchanged:
+                a.mov(x64::rax, x64::qword_ptr(x64::rsp, 8));
+                break;
+            case EofBehavior::Zero:
+                a.xor_(x64::eax, x64::eax);
+                break;
+            case EofBehavior::MinusOne:
+                a.mov(x64::eax, 255);
+                break;
+            }
+            a.bind(done);
+            a.add(x64::rsp, 16);
+            a.ret();
+        }
+        // scan_zero(), same arguments
+        {
+            auto again = a.newLabel();
+            auto done = a.newLabel();
+            a.bind(scan_label);
+            a.bind(again);
+            a.cmp(ARG2, ARG1);
+            a.jae(done);
+            a.cmp(x64::byte_ptr(ARG0, ARG2), 0);
+            a.je(done);
+            a.add(ARG2, ARG3);
+            a.jmp(again);
+            a.bind(done);
+            // an index past the end fails the caller's bounds check just like
+            // SCAN_NOT_FOUND does
+            a.mov(x64::rax, ARG2);
+            a.ret();
+        }
+
+        a.bind(out_of_bounds_message);
+        a.embed(OUT_OF_BOUNDS, sizeof(OUT_OF_BOUNDS) - 1);
+        a.bind(out_of_memory_message);
+        a.embed(OUT_OF_MEMORY, sizeof(OUT_OF_MEMORY) - 1);
+
+        code_holder.flatten();
+        code_holder.resolveUnresolvedLinks();
+        code_holder.relocateToBase(elf_code_address());
+        std::vector<uint8_t> image(code_holder.codeSize());
+        code_holder.copyFlattenedData(image.data(), image.size(), asmjit::CopySectionFlags::kPadTargetBuffer);
+        if (!write_elf_executable(path, image, EM_X86_64)) {
+            print_error(fmt::format("could not write {}", path));
+            return false;
+        }
+        return true;
     }
 }
 
-void do_codegen(asmjit::x86::Assembler& a, std::span<bfjit::BFOp const> code, asmjit::Label& exit, asmjit::Label& outside_bounds, uint32_t data_size, std::vector<size_t>& jump_offsets) {
+void do_codegen(asmjit::x86::Assembler& a, std::span<bfjit::BFOp const> code, asmjit::Label& exit, asmjit::Label& outside_bounds, uint64_t data_size, bool checked, std::vector<size_t>& jump_offsets, bfjit::CLIOpts const& opts, RuntimeCalls const& runtime) {
+    using InnerData = bfjit::JIT::InnerData;
+    using OutputBuffer = bfjit::OutputBuffer;
+    constexpr auto OUTPUT = int32_t(offsetof(InnerData, output));
+    constexpr auto OUTPUT_DATA = OUTPUT + int32_t(offsetof(OutputBuffer, m_data));
+    constexpr auto OUTPUT_SIZE = OUTPUT + int32_t(offsetof(OutputBuffer, m_size));
+    constexpr auto OUTPUT_CAPACITY = OUTPUT + int32_t(offsetof(OutputBuffer, m_capacity));
+    using InputBuffer = bfjit::InputBuffer;
+    constexpr auto INPUT = int32_t(offsetof(InnerData, input));
+    constexpr auto INPUT_DATA = INPUT + int32_t(offsetof(InputBuffer, m_data));
+    constexpr auto INPUT_POS = INPUT + int32_t(offsetof(InputBuffer, m_pos));
+    constexpr auto INPUT_SIZE = INPUT + int32_t(offsetof(InputBuffer, m_size));
+    constexpr auto LOOP_COUNTERS = int32_t(offsetof(InnerData, loop_counters));
+    constexpr auto FUEL = int32_t(offsetof(InnerData, fuel));
+    constexpr auto STOPPED_AT = int32_t(offsetof(InnerData, stopped_at));
+    constexpr auto STOPPED_PTR = int32_t(offsetof(InnerData, stopped_ptr));
+
     std::stack<asmjit::Label> loop_labels;
+	// where each LoopEnd goes once out of fuel, with its index in `code`
+	std::vector<std::pair<asmjit::Label, size_t>> out_of_fuel;
+	// LoopBeg seen so far, which makes the number of the next one
+	size_t loops = 0;
+	auto const width = opts.cell_width;
+	auto const cache = cell_sized(CACHE_VALUE, width);
+	// Cell at DATA_INDEX + offset, offset 0 lives in CACHE_VALUE instead
+	auto cell = [&](int32_t offset) { return tape_cell(offset, width); };
+	// Immediates are at most 32 bits (sign extended), bigger values for
+	// 64 bit cells go through r10
+	auto cell_value = [&](uint64_t value) -> asmjit::Operand {
+		auto const imm = bfjit::sign_extend_cell(value, width);
+		if (imm == int32_t(imm))
+			return asmjit::Imm(imm);
+		a.mov(x64::r10, imm);
+		return x64::r10;
+	};
+	// 64 bit dst = the cell in src, zero extended
+	auto load_zero_extended = [&](x64::Gp const& dst, auto const& src) {
+		if (width == 8)
+			a.mov(dst, src);
+		else if (width == 4)
+			a.mov(dst.r32(), src);
+		else
+			a.movzx(dst, src);
+	};
+	// Jumps to outside_bounds if reg isn't a valid index
+	auto check_limit = [&](x64::Gp const& reg) {
+		if (data_size - 1 <= INT32_MAX) {
+			a.cmp(reg, int32_t(data_size - 1));
+		} else {
+			a.mov(x64::r10, data_size - 1);
+			a.cmp(reg, x64::r10);
+		}
+		a.ja(outside_bounds);
+	};
+	auto check_index = [&](int64_t offset) {
+		a.lea(x64::r9, x64::ptr(DATA_INDEX, int32_t(offset)));
+		check_limit(x64::r9);
+	};
+	// Calls into the runtime keeping the JIT state, `setup` loads the ARGn registers
+	auto call_runtime = [&](asmjit::Operand const& fn, auto setup) {
+		a.push(DATA_BASE);
+		a.push(DATA_INDEX);
+		a.push(x64::r8);
+		setup();
+
+		// align stack
+		a.push(x64::rbp);
+		a.mov(x64::rbp, x64::rsp);
+		a.sub(x64::rsp, 15);
+		a.and_(x64::rsp, uint64_t(~0xf));
+#ifdef _WIN32
+		a.sub(x64::rsp, 32);
+#endif
+
+		a.emit(x64::Inst::kIdCall, fn);
+
+		a.mov( x64::rsp, x64::rbp );
+		a.pop( x64::rbp );
+
+		a.pop(x64::r8);
+		a.pop(DATA_INDEX);
+		a.pop(DATA_BASE);
+	};
+
+	// Cells of the current block that live in CELL_REGISTERS (same index), they
+	// are loaded on first use and written back when the block ends
+	struct CellRegister {
+		int32_t offset;
+		bool loaded;
+		bool dirty;
+	};
+	std::vector<CellRegister> cell_registers;
+	auto ends_block = [](bfjit::BFOp const& op) {
+		switch (op.m_type) {
+		case bfjit::BFOp::Type::Mod:
+		case bfjit::BFOp::Type::SetValue:
+		case bfjit::BFOp::Type::In:
+		case bfjit::BFOp::Type::Out:
+		case bfjit::BFOp::Type::MulAdd:
+			return false;
+		default:
+			return true;
+		}
+	};
+	// Gives registers to the most used cells of the block. Only cells some
+	// operation accesses unconditionally are candidates, so loading them early
+	// can't touch anything the program wouldn't (and the block check covers them)
+	auto allocate_cell_registers = [&](std::span<bfjit::BFOp const> block) {
+		std::map<int32_t, size_t> uses;
+		for (auto const& op : block) {
+			if (ends_block(op))
+				break;
+			if (op.m_offset != 0)
+				uses[op.m_offset] += 1;
+		}
+		for (auto const& op : block) {
+			if (ends_block(op))
+				break;
+			if (op.m_type != bfjit::BFOp::Type::MulAdd)
+				continue;
+			auto const target = int64_t(op.m_offset) + op.mul_arg.offset;
+			if (target == int32_t(target) && uses.contains(int32_t(target)))
+				uses[int32_t(target)] += 1;
+		}
+		std::vector<std::pair<size_t, int32_t>> by_uses;
+		for (auto const& [offset, count] : uses)
+			if (count > 1)
+				by_uses.emplace_back(count, offset);
+		std::sort(by_uses.rbegin(), by_uses.rend());
+
+		cell_registers.clear();
+		for (size_t r = 0; r < std::min(by_uses.size(), std::size(CELL_REGISTERS)); r++)
+			cell_registers.push_back(CellRegister{ .offset = by_uses[r].second, .loaded = false, .dirty = false });
+	};
+	auto spill_cell_registers = [&]() {
+		for (size_t r = 0; r < cell_registers.size(); r++)
+			if (cell_registers[r].dirty)
+				a.mov(cell(cell_registers[r].offset), cell_sized(CELL_REGISTERS[r], width));
+		cell_registers.clear();
+	};
+	// Calls fn with wherever the cell at offset lives: CACHE_VALUE, a cell
+	// register or the tape
+	auto with_cell = [&](int64_t offset, bool read, bool write, auto fn) {
+		if (offset == 0) {
+			fn(cache);
+			return;
+		}
+		for (size_t r = 0; r < cell_registers.size(); r++) {
+			auto& reg = cell_registers[r];
+			if (reg.offset != offset)
+				continue;
+			auto const sized = cell_sized(CELL_REGISTERS[r], width);
+			if (read && !reg.loaded)
+				a.mov(sized, cell(reg.offset));
+			reg.loaded = true;
+			reg.dirty |= write;
+			fn(sized);
+			return;
+		}
+		fn(cell(int32_t(offset)));
+	};
+	// Loads the cell's register now, when the first use is behind a branch
+	auto load_cell = [&](int64_t offset) {
+		with_cell(offset, true, false, [](auto const&) {});
+	};
+
 	for (size_t i = 0; i < code.size(); i++) {
 		auto const& op = code[i];
+		if (ends_block(op))
+			spill_cell_registers();
+		jump_offsets.push_back(a.offset());
+
+		// Offset accesses don't move the pointer, so check the whole range a block
+		// touches when entering it instead
+		if (checked && (i == 0 || code[i - 1].m_type == bfjit::BFOp::Type::LoopBeg || code[i - 1].m_type == bfjit::BFOp::Type::LoopEnd || code[i - 1].m_type == bfjit::BFOp::Type::ModPtr || code[i - 1].m_type == bfjit::BFOp::Type::Scan)) {
+			auto const [min, max] = bfjit::block_offset_range(code.subspan(i));
+			if (min < 0)
+				check_index(min);
+			if (max > 0)
+				check_index(max);
+		}
+		if (!ends_block(op) && (i == 0 || ends_block(code[i - 1])))
+			allocate_cell_registers(code.subspan(i));
+
 		switch (op.m_type) {
 		case bfjit::BFOp::Type::Mod:
-			jump_offsets.push_back(a.offset());
-			a.add(CACHE_VALUE, uint8_t(op.inc_arg));
+			with_cell(op.m_offset, true, true, [&](auto const& dst) {
+				a.emit(x64::Inst::kIdAdd, dst, cell_value(op.inc_arg));
+			});
 			break;
 		case bfjit::BFOp::Type::ModPtr:
-			jump_offsets.push_back(a.offset());
 			// Save cached data
-			a.mov(x64::ptr(DATA_BASE, DATA_INDEX), CACHE_VALUE);
-			// Increment index
-			a.add(DATA_INDEX, int32_t(op.inc_ptr_arg));
-			// Check if next step will get out of bounds
-			a.cmp(DATA_INDEX, data_size - 1);
-			a.ja(outside_bounds);
+			a.mov(cell(0), cache);
+			// Increment index, merged moves may not fit a 32 bit immediate
+			if (op.inc_ptr_arg == int32_t(op.inc_ptr_arg)) {
+				a.add(DATA_INDEX, int32_t(op.inc_ptr_arg));
+			} else {
+				a.mov(x64::r10, op.inc_ptr_arg);
+				a.add(DATA_INDEX, x64::r10);
+			}
+			// Check if next step will get out of bounds, on a guarded tape the
+			// load below faults instead
+			if (checked)
+				check_limit(DATA_INDEX);
 			// Load new data
-			a.mov(CACHE_VALUE, x64::ptr(DATA_BASE, DATA_INDEX));
+			a.mov(cache, cell(0));
 			break;
-		case bfjit::BFOp::Type::Out:
-			jump_offsets.push_back(a.offset());
-#ifdef _WIN32
-			a.push(DATA_BASE);
-			a.push(DATA_INDEX);
-			a.push(x64::r8);
-			a.mov(x64::rcx, x64::r8);
-
-			a.call(print_char);
-
-			a.pop(x64::r8);
-			a.pop(DATA_INDEX);
-			a.pop(DATA_BASE);
-			break;
-#else
-			a.push(DATA_BASE);
-			a.push(DATA_INDEX);
-			a.push(x64::r8);
-			a.mov(x64::rdi, x64::r8);
-
-			// align stack
-			a.push(x64::rbp);
-			a.mov(x64::rbp, x64::rsp);
-			a.sub(x64::rsp, 15);
-			a.and_(x64::rsp, uint64_t(~0xf));
-
-			a.call(print_char);
-
-			a.mov( x64::rsp, x64::rbp );
-			a.pop( x64::rbp );
-
-			a.pop(x64::r8);
-			a.pop(DATA_INDEX);
-			a.pop(DATA_BASE);
+		case bfjit::BFOp::Type::Out: {
+			// only the low byte of the cell is written
+			auto const value = x64::r10b;
+			with_cell(op.m_offset, true, false, [&](auto const& src) {
+				a.mov(cell_sized(x64::r10, width), src);
+			});
+			// Append to the output buffer
+			a.mov(x64::rax, x64::qword_ptr(CONTEXT, OUTPUT_SIZE));
+			a.mov(x64::r9, x64::qword_ptr(CONTEXT, OUTPUT_DATA));
+			a.mov(x64::byte_ptr(x64::r9, x64::rax), value);
+			a.inc(x64::rax);
+			a.mov(x64::qword_ptr(CONTEXT, OUTPUT_SIZE), x64::rax);
+			// and only call out to write it once it's full
+			auto flush = a.newLabel();
+			auto done = a.newLabel();
+			a.cmp(x64::rax, x64::qword_ptr(CONTEXT, OUTPUT_CAPACITY));
+			if (opts.line_buffered) {
+				a.jae(flush);
+				a.cmp(value, '\n');
+				a.jne(done);
+			} else {
+				a.jb(done);
+			}
+			a.bind(flush);
+			call_runtime(runtime.flush_output, [&]() {
+				a.lea(ARG0, x64::ptr(CONTEXT, OUTPUT));
+			});
+			a.bind(done);
 			break;
-#endif
+		}
 		case bfjit::BFOp::Type::LoopBeg: {
-			jump_offsets.push_back(a.offset());
 			auto end = a.newLabel();
 			auto start = a.newLabel();
+			// LoopCounters[loop].field += 1, nothing is live in rax here
+			auto const loop = loops++;
+			auto count = [&](size_t field) {
+				auto const at = loop * sizeof(bfjit::LoopCounters) + field;
+				a.mov(x64::rax, x64::qword_ptr(CONTEXT, LOOP_COUNTERS));
+				if (at > INT32_MAX) {
+					a.mov(x64::r10, at);
+					a.add(x64::qword_ptr(x64::rax, x64::r10), 1);
+				} else {
+					a.add(x64::qword_ptr(x64::rax, int32_t(at)), 1);
+				}
+			};
+			if (opts.profile_loops)
+				count(offsetof(bfjit::LoopCounters, entries));
 			a.bind(start);
-			a.cmp(CACHE_VALUE, 0);
+			a.cmp(cache, 0);
 			a.je(end);
+			if (opts.profile_loops)
+				count(offsetof(bfjit::LoopCounters, iterations));
 
             loop_labels.push( start );
             loop_labels.push( end );
@@ -197,22 +864,183 @@ void do_codegen(asmjit::x86::Assembler& a, std::span<bfjit::BFOp const> code, as
             loop_labels.pop();
             auto start = loop_labels.top();
             loop_labels.pop();
-            jump_offsets.push_back(a.offset());
+			if (opts.fuel) {
+				// borrows once there's no iteration left
+				auto const stop = out_of_fuel.emplace_back(a.newLabel(), i).first;
+				a.sub(x64::qword_ptr(CONTEXT, FUEL), 1);
+				a.jb(stop);
+			}
 			a.jmp(start);
 			a.bind(end);
         }
 			break;
 		case bfjit::BFOp::Type::SetValue:
-			jump_offsets.push_back(a.offset());
-            if (op.inc_arg == 0)
+			if (op.m_offset != 0)
+				with_cell(op.m_offset, false, true, [&](auto const& dst) {
+					a.emit(x64::Inst::kIdMov, dst, cell_value(op.set_arg));
+				});
+            else if ((op.set_arg & bfjit::cell_mask(width)) == 0)
                 a.xor_(x64::r8, x64::r8);
             else
-                a.mov( x64::r8, uint8_t( op.inc_arg ) );
+                a.mov( x64::r8, op.set_arg & bfjit::cell_mask(width) );
+			break;
+		case bfjit::BFOp::Type::MulAdd: {
+			auto const target = int64_t(op.m_offset) + op.mul_arg.offset;
+			auto const value = op.m_offset == 0 ? cache : cell_sized(x64::rax, width);
+			if (op.m_offset != 0)
+				with_cell(op.m_offset, true, false, [&](auto const& src) {
+					a.mov(value, src);
+				});
+			load_cell(target);
+			// The original loop never touches the target when the cell is zero
+			auto skip = a.newLabel();
+			a.test(value, value);
+			a.jz(skip);
+			// data[idx + target] += data[idx + offset] * factor
+			auto emit = [&](auto const& dst) {
+				if (op.mul_arg.factor == 1) {
+					a.add(dst, value);
+				} else if (op.mul_arg.factor == -1) {
+					a.sub(dst, value);
+				} else if (width == 8) {
+					a.imul(x64::rax, value, op.mul_arg.factor);
+					a.add(dst, x64::rax);
+				} else {
+					// the low bits of a 32 bit product are all a cell keeps
+					load_zero_extended(x64::rax, value);
+					a.imul(x64::eax, x64::eax, op.mul_arg.factor);
+					a.add(dst, cell_sized(x64::rax, width));
+				}
+			};
+			if (target == 0) {
+				emit(cache);
+			} else {
+				// Check that the target cell is inside the buffer
+				if (checked)
+					check_index(target);
+				with_cell(target, true, true, emit);
+			}
+			a.bind(skip);
+			break;
+		}
+		case bfjit::BFOp::Type::Scan: {
+			// Nothing to search if the loop wouldn't even start
+			auto done = a.newLabel();
+			a.test(cache, cache);
+			a.jz(done);
+			// Save cached data, the search reads it from the buffer
+			a.mov(cell(0), cache);
+			call_runtime(runtime.scan_zero, [&]() {
+				// in this order so no argument overwrites the source of another
+				a.mov(ARG2, DATA_INDEX);
+				a.mov(ARG0, DATA_BASE);
+				a.mov(ARG1, data_size);
+				a.mov(ARG3, op.scan_arg);
+			});
+			// SCAN_NOT_FOUND also fails the bounds check
+			a.mov(DATA_INDEX, x64::rax);
+			check_limit(DATA_INDEX);
+			// The search stops on a zero cell
+			a.xor_(x64::r8, x64::r8);
+			a.bind(done);
 			break;
-        case bfjit::BFOp::Type::In:
-            std::abort();
-        case bfjit::BFOp::Type::Halt:
-            std::abort();
+		}
+		case bfjit::BFOp::Type::In: {
+			auto store = [&](auto const& value) {
+				with_cell(op.m_offset, false, true, [&](auto const& dst) {
+					a.mov(dst, value);
+				});
+			};
+			// Both paths below must see the same registers
+			load_cell(op.m_offset);
+			// Take the next byte straight from the input buffer
+			auto refill = a.newLabel();
+			auto done = a.newLabel();
+			a.mov(x64::rax, x64::qword_ptr(CONTEXT, INPUT_POS));
+			a.cmp(x64::rax, x64::qword_ptr(CONTEXT, INPUT_SIZE));
+			a.jae(refill);
+			a.mov(x64::r9, x64::qword_ptr(CONTEXT, INPUT_DATA));
+			a.movzx(x64::r10d, x64::byte_ptr(x64::r9, x64::rax));
+			a.inc(x64::rax);
+			a.mov(x64::qword_ptr(CONTEXT, INPUT_POS), x64::rax);
+			store(cell_sized(x64::r10, width));
+			a.jmp(done);
+			// and only call out to read more (or handle EOF) once it's empty
+			a.bind(refill);
+			call_runtime(runtime.read_input, [&]() {
+				// the cell first, on Windows ARG0 and ARG1 are the tape registers
+				with_cell(op.m_offset, true, false, [&](auto const& src) {
+					load_zero_extended(ARG1, src);
+				});
+				a.lea(ARG0, x64::ptr(CONTEXT, INPUT));
+			});
+			store(cell_sized(x64::rax, width));
+			a.bind(done);
+			break;
+		}
+		case bfjit::BFOp::Type::Halt: {
+			// A loop like [] that never ends once entered
+			auto done = a.newLabel();
+			a.test(cache, cache);
+			a.jz(done);
+			if (opts.fuel) {
+				// so it spins like the loop would, until it's out of fuel
+				auto spin = a.newLabel();
+				auto const stop = out_of_fuel.emplace_back(a.newLabel(), i).first;
+				a.bind(spin);
+				a.sub(x64::qword_ptr(CONTEXT, FUEL), 1);
+				a.jb(stop);
+				a.jmp(spin);
+			} else {
+				call_runtime(runtime.infinite_loop, [&]() {
+					a.mov(ARG0, CONTEXT);
+				});
+				a.jmp(exit);
+			}
+			a.bind(done);
+			break;
+		}
 		}
 	}
+	spill_cell_registers();
+
+	// Out of the way of the loops, nothing is in a cell register at a LoopEnd
+	// or a Halt
+	if (!out_of_fuel.empty())
+		a.jmp(exit);
+	for (auto const& [stop, at] : out_of_fuel) {
+		a.bind(stop);
+		a.mov(cell(0), cache);
+		a.mov(x64::qword_ptr(CONTEXT, STOPPED_PTR), DATA_INDEX);
+		a.mov(x64::rax, uint64_t(at));
+		a.mov(x64::qword_ptr(CONTEXT, STOPPED_AT), x64::rax);
+		a.jmp(exit);
+	}
+}
+
+uint64_t read_input(bfjit::InputBuffer* in, uint64_t current) {
+	auto const value = in->next_or(current);
+	// A program that mostly waits for input may not reach enough LoopEnd
+	// for run_limited() to see the request, this stops it at the next one
+	if (bfjit::stop_requested()) {
+		auto* const data = reinterpret_cast<bfjit::JIT::InnerData*>(reinterpret_cast<char*>(in) - offsetof(bfjit::JIT::InnerData, input));
+		data->fuel = 0;
+	}
+	return value;
+}
+
+void outsize_of_bounds(bfjit::JIT::InnerData* data) {
+	data->output.flush();
+	data->out_of_bounds = true;
+	// whoever lent the output gets told by run_on() instead
+	if (data->output.m_sink == nullptr)
+		fmt::print(stderr, "trying to access data outside of bouds\n");
+}
+
+void infinite_loop(bfjit::JIT::InnerData* data) {
+	data->output.flush();
+	data->halted = true;
+	// whoever lent the output gets told by run_on() instead
+	if (data->output.m_sink == nullptr)
+		fmt::print("halted, reason: infinte loop reached\n");
 }
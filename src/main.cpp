@@ -1,27 +1,71 @@
 
+#include "batch.hpp"
+#include "cache.hpp"
 #include "interpreter.hpp"
+#include "io.hpp"
 #include "jit.hpp"
 #include "optimizer.hpp"
 #include "options.hpp"
 #include "parser.hpp"
+#include "prefix.hpp"
+#include "snapshot.hpp"
+#include "source.hpp"
+#include "threaded.hpp"
+#include "tiered.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
 #include <string>
 #include <iostream>
+#include <memory>
 #include <fstream>
 #include <filesystem>
 #include <fmt/format.h>
 #include <fmt/color.h>
 #include <string_view>
+#include <charconv>
+#include <cstdio>
+#include <optional>
+#include <thread>
+#include <unistd.h>
 
-std::string load_program(char const* path);
+std::vector<uint8_t> read_all(int fd);
+std::optional<size_t> parse_size(std::string_view str);
+std::optional<uint64_t> parse_seconds(std::string_view str);
 void print_usage(char const* argv);
-size_t print_bfcode(std::vector<bfjit::BFOp> const& code, size_t start = 0, size_t offset = 0);
+size_t print_bfcode(std::vector<bfjit::BFOp> const& code, size_t cell_width, size_t start = 0, size_t offset = 0);
+bfjit::Snapshot take_snapshot(uint64_t bytecode_hash, size_t cell_width, size_t ip, bfjit::Tape const& tape, size_t ptr, bfjit::InputBuffer const& input, bfjit::OutputBuffer const& output);
+bool restore_snapshot(bfjit::Snapshot const& snapshot, bfjit::Tape& tape, size_t& ptr, bfjit::InputBuffer& input, bfjit::OutputBuffer& output);
+std::optional<std::string> run_limited(bfjit::JIT& jit, std::optional<uint64_t> fuel, std::optional<uint64_t> seconds);
+
+// exit status of a program stopped before its end by -S, -F or -L
+constexpr int EXIT_STOPPED = 2;
 
 int main(int const argc, char const *argv[]) {
-    std::string program;
     char const* program_path = nullptr;
     bool run_interpreter = false;
+    bool run_threaded = false;
+    bool run_tiered = false;
     bool do_not_optimize = false;
     bool print_and_exit = false;
+    // write an executable there instead of running
+    char const* output_path = nullptr;
+    // where compiled code is kept between runs, only used by the JIT
+    char const* cache_directory = nullptr;
+    // ops to run ahead of time, 0 to not do it
+    size_t prefix_budget = 0;
+    // run once per record of the input instead of once over all of it
+    std::optional<bfjit::RecordFormat> batch_format;
+    bool tape_size_given = false;
+    size_t batch_threads = std::max(1u, std::thread::hardware_concurrency());
+    // loops the profile report lists
+    size_t profile_top = 0;
+    // where to write a snapshot when stopped, and the one to carry on from
+    char const* snapshot_path = nullptr;
+    char const* resume_path = nullptr;
+    // loop iterations and seconds the JIT may run for
+    std::optional<uint64_t> fuel_limit;
+    std::optional<uint64_t> time_limit;
     bfjit::CLIOpts cli_opts;
 
     for (int i = 1; i < argc; i++) {
@@ -29,6 +73,10 @@ int main(int const argc, char const *argv[]) {
         if (arg.starts_with("-")) {
             if (arg == "-i") {
                 run_interpreter = true;
+            } else if (arg == "-I") {
+                run_threaded = true;
+            } else if (arg == "-T") {
+                run_tiered = true;
             } else if (arg == "-d") {
                 do_not_optimize = true;
             } else if (arg == "-h") {
@@ -38,6 +86,120 @@ int main(int const argc, char const *argv[]) {
                 print_and_exit = true;
             } else if (arg == "-v") {
                 cli_opts.debug_info = true;
+            } else if (arg == "-l") {
+                cli_opts.line_buffered = true;
+            } else if (arg == "-e") {
+                auto const mode = i + 1 < argc ? std::string_view{ argv[i + 1] } : std::string_view{};
+                if (mode == "0") {
+                    cli_opts.eof_behavior = bfjit::EofBehavior::Zero;
+                } else if (mode == "-1") {
+                    cli_opts.eof_behavior = bfjit::EofBehavior::MinusOne;
+                } else if (mode == "keep") {
+                    cli_opts.eof_behavior = bfjit::EofBehavior::Unchanged;
+                } else {
+                    fmt::print("-e expects 0, -1 or keep\n");
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                i++;
+            } else if (arg == "-c") {
+                cli_opts.checked_tape = true;
+            } else if (arg == "-t") {
+                auto size = i + 1 < argc ? parse_size(argv[i + 1]) : std::nullopt;
+                if (!size || *size > bfjit::MAX_TAPE_SIZE) {
+                    fmt::print("-t expects a size up to 64G, like 30000, 64K or 2G\n");
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                cli_opts.tape_size = *size;
+                tape_size_given = true;
+                i++;
+            } else if (arg == "-w") {
+                auto bits = i + 1 < argc ? parse_size(argv[i + 1]) : std::nullopt;
+                if (!bits || *bits % 8 != 0 || !bfjit::valid_cell_width(*bits / 8)) {
+                    fmt::print("-w expects 8, 16, 32 or 64\n");
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                cli_opts.cell_width = *bits / 8;
+                i++;
+            } else if (arg == "-C") {
+                if (i + 1 == argc) {
+                    fmt::print("-C expects a directory\n");
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                cache_directory = argv[++i];
+            } else if (arg == "-o") {
+                if (i + 1 == argc) {
+                    fmt::print("-o expects the path of the executable to write\n");
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                output_path = argv[++i];
+            } else if (arg == "-b") {
+                auto const format = i + 1 < argc ? std::string_view{ argv[i + 1] } : std::string_view{};
+                if (format == "lines") {
+                    batch_format = bfjit::RecordFormat::Lines;
+                } else if (format == "len") {
+                    batch_format = bfjit::RecordFormat::LengthPrefixed;
+                } else {
+                    fmt::print("-b expects lines or len\n");
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                i++;
+            } else if (arg == "-j") {
+                auto threads = i + 1 < argc ? parse_size(argv[i + 1]) : std::nullopt;
+                if (!threads) {
+                    fmt::print("-j expects a number of threads\n");
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                batch_threads = *threads;
+                i++;
+            } else if (arg == "-r") {
+                auto top = i + 1 < argc ? parse_size(argv[i + 1]) : std::nullopt;
+                if (!top || *top == 0) {
+                    fmt::print("-r expects the number of loops to report\n");
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                profile_top = *top;
+                cli_opts.profile_loops = true;
+                i++;
+            } else if (arg == "-S" || arg == "-R") {
+                if (i + 1 == argc) {
+                    fmt::print("{} expects the path of a snapshot\n", arg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                (arg == "-S" ? snapshot_path : resume_path) = argv[++i];
+            } else if (arg == "-F") {
+                fuel_limit = i + 1 < argc ? parse_size(argv[i + 1]) : std::nullopt;
+                if (!fuel_limit) {
+                    fmt::print("-F expects a number of loop iterations, like 5000 or 20G\n");
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                i++;
+            } else if (arg == "-L") {
+                time_limit = i + 1 < argc ? parse_seconds(argv[i + 1]) : std::nullopt;
+                if (!time_limit) {
+                    fmt::print("-L expects a duration, like 90, 90s, 5m or 2h\n");
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                i++;
+            } else if (arg == "-P") {
+                auto steps = i + 1 < argc ? parse_size(argv[i + 1]) : std::nullopt;
+                if (!steps) {
+                    fmt::print("-P expects a number of steps, like 100000 or 50M\n");
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                prefix_budget = *steps;
+                i++;
             } else {
                 fmt::print("unknown flag: {}\n", arg);
                 print_usage(argv[0]);
@@ -53,46 +215,316 @@ int main(int const argc, char const *argv[]) {
         print_usage(argv[0]);
         return 1;
     }
-    program = load_program(program_path);
-    auto bytecode = bfjit::parse_program(program);
-    if (!do_not_optimize)
-        bytecode = bfjit::optimize(bytecode);
+    auto const source = std::make_unique<bfjit::SourceFile>(program_path);
+    auto const program = source->text();
+    if (cli_opts.cell_width != 1) {
+        if (run_threaded || run_tiered || output_path) {
+            fmt::print(fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
+            fmt::print(": -w only works with the JIT and -i\n");
+            return 1;
+        }
+        // the prefix evaluator only knows 8 bit cells
+        prefix_budget = 0;
+    }
+    if (cli_opts.profile_loops && (run_threaded || run_tiered || output_path || batch_format)) {
+        fmt::print(fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
+        fmt::print(": -r only works with the JIT and -i\n");
+        return 1;
+    }
+    // the loops left after running ahead of time aren't where the source
+    // has them anymore
+    if (cli_opts.profile_loops)
+        prefix_budget = 0;
+    if (batch_format) {
+        if (run_interpreter || run_threaded || run_tiered || output_path) {
+            fmt::print(fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
+            fmt::print(": -b only works with the JIT\n");
+            return 1;
+        }
+        // there are no guard pages around the tapes of the worker threads,
+        // and every record starts from scratch, nothing to run ahead of time
+        cli_opts.checked_tape = true;
+        prefix_budget = 0;
+        // the tape is cleared for every record
+        if (!tape_size_given)
+            cli_opts.tape_size = bfjit::BATCH_TAPE_SIZE;
+    }
+
+    if (snapshot_path || resume_path) {
+        if (run_threaded || run_tiered || output_path || batch_format || print_and_exit) {
+            fmt::print(fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
+            fmt::print(": -S and -R only work with the JIT and -i\n");
+            return 1;
+        }
+        // the output of what ran ahead of time would be written again on
+        // every resume
+        prefix_budget = 0;
+    }
+    if ((fuel_limit || time_limit) && (run_interpreter || run_threaded || run_tiered || output_path || batch_format)) {
+        fmt::print(fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
+        fmt::print(": -F and -L only work with the JIT\n");
+        return 1;
+    }
+    // the JIT can only stop by running out of fuel
+    cli_opts.fuel = !run_interpreter && (snapshot_path || fuel_limit || time_limit);
+    std::optional<bfjit::Snapshot> resume;
+    if (resume_path) {
+        resume = bfjit::read_snapshot(resume_path);
+        if (!resume)
+            return 1;
+    }
+    if (snapshot_path)
+        bfjit::install_stop_handler();
+
+    // -P output and -p have nothing to do with the compiled code
+    bool const use_cache = cache_directory && !run_interpreter && !run_threaded && !run_tiered
+        && !print_and_exit && !output_path && prefix_budget == 0 && !batch_format && !cli_opts.profile_loops
+        && !resume_path && !cli_opts.fuel;
+    uint64_t cache_key = 0;
+    if (use_cache) {
+        cache_key = bfjit::cache_key(program, cli_opts, !do_not_optimize);
+        if (auto cached = bfjit::load_cached_code(cache_directory, cache_key, program)) {
+            auto jit = bfjit::JIT( std::move(cached), cli_opts );
+            jit.run_until_end();
+            return jit.out_of_bounds() ? 1 : 0;
+        }
+    }
+    // where the loops are in the source, for the profile report
+    std::vector<size_t> loop_positions;
+    auto* const positions = cli_opts.profile_loops ? &loop_positions : nullptr;
+    auto bytecode = source->parse(std::max(1u, std::thread::hardware_concurrency()), positions);
+    if (!do_not_optimize) {
+        auto passes = bfjit::PassManager::default_pipeline(cli_opts.cell_width, cli_opts.tape_size);
+        passes.run(bytecode, positions);
+        if (cli_opts.debug_info) {
+            passes.print_stats();
+            // before the program's own output, which doesn't go through stdio
+            std::fflush(stdout);
+        }
+    }
+
+    // what runs ahead of time would have to be baked into the executable
+    if (prefix_budget != 0 && output_path == nullptr) {
+        if (auto residual = bfjit::evaluate_prefix(bytecode, cli_opts, prefix_budget)) {
+            if (cli_opts.debug_info)
+                fmt::print("Ran {} steps ahead of time, {} ops left\n", residual->steps, residual->bytecode.size());
+            bytecode = std::move(residual->bytecode);
+            if (!do_not_optimize)
+                bytecode = bfjit::optimize(bytecode, cli_opts.cell_width, cli_opts.tape_size);
+            if (!print_and_exit) {
+                std::fflush(stdout);
+                bfjit::OutputBuffer output(1, cli_opts.line_buffered);
+                for (auto const ch : residual->output)
+                    output.put(uint8_t(ch));
+                output.flush();
+            }
+        }
+    }
 
     if (print_and_exit) {
-        print_bfcode(bytecode);
+        print_bfcode(bytecode, cli_opts.cell_width);
         return 0;
     }
 
-    if (run_interpreter) {
-        auto interpreter = bfjit::Interpreter( bytecode );
+    if (output_path)
+        return bfjit::JIT::write_executable(bytecode, cli_opts, output_path) ? 0 : 1;
+
+    if (batch_format) {
+        // only the code, every worker brings its own tape and buffers
+        auto const program = bfjit::CompiledProgram::compile(std::move(bytecode), cli_opts);
+        auto const input = read_all(0);
+        return bfjit::run_batch(*program, input, *batch_format, batch_threads) ? 0 : 1;
+    }
+
+    auto const hash = snapshot_path || resume ? bfjit::bytecode_hash(bytecode) : 0;
+    if (resume && (resume->bytecode_hash != hash || resume->cell_width != cli_opts.cell_width || resume->ip >= bytecode.size())) {
+        fmt::print(fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
+        fmt::print(": the snapshot was taken from another program, or with other -d or -w options\n");
+        return 1;
+    }
+
+    if (run_tiered) {
+        auto tiered = bfjit::Tiered( bytecode, cli_opts );
+        tiered.run_until_end();
+        return tiered.m_out_of_bounds ? 1 : 0;
+    } else if (run_threaded) {
+        auto interpreter = bfjit::ThreadedInterpreter( bytecode, cli_opts );
         interpreter.run_until_end();
+        return interpreter.m_out_of_bounds ? 1 : 0;
+    } else if (run_interpreter) {
+        auto run = [&]<typename Cell>() -> int {
+            auto interpreter = bfjit::BasicInterpreter<Cell>( bytecode, cli_opts );
+            if (resume) {
+                if (!restore_snapshot(*resume, interpreter.m_buffer, interpreter.m_ptr, interpreter.m_input, interpreter.m_output))
+                    return 1;
+                interpreter.jump_to_op(resume->ip);
+            }
+            if (!snapshot_path) {
+                interpreter.run_until_end();
+            } else if (!interpreter.run_until_end_or_stop()) {
+                auto const snapshot = take_snapshot(hash, cli_opts.cell_width, interpreter.op_index(), interpreter.m_buffer, interpreter.m_ptr, interpreter.m_input, interpreter.m_output);
+                if (!bfjit::write_snapshot(snapshot_path, snapshot))
+                    return 1;
+                fmt::print(stderr, "stopped, carry on with -R {}\n", snapshot_path);
+                return EXIT_STOPPED;
+            }
+            if (interpreter.m_out_of_bounds)
+                return 1;
+            if (interpreter.m_profile)
+                interpreter.m_profile->report(program, loop_positions, profile_top);
+            return 0;
+        };
+        switch (cli_opts.cell_width) {
+        case 2: return run.operator()<uint16_t>();
+        case 4: return run.operator()<uint32_t>();
+        case 8: return run.operator()<uint64_t>();
+        default: return run.operator()<uint8_t>();
+        }
     } else {
         auto jit = bfjit::JIT( bytecode, cli_opts );
         jit.do_codegen();
-        jit.run_until_end();
+        if (resume) {
+            auto const type = bytecode[resume->ip].m_type;
+            if (type != bfjit::BFOp::Type::LoopBeg && type != bfjit::BFOp::Type::LoopEnd && type != bfjit::BFOp::Type::Halt) {
+                fmt::print(fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
+                fmt::print(": the snapshot was taken while waiting for input, carry on with -i\n");
+                return 1;
+            }
+            if (!restore_snapshot(*resume, jit.m_buffer, jit.m_ptr, jit.input(), jit.output()))
+                return 1;
+            jit.m_ip = resume->ip;
+        }
+        if (use_cache)
+            bfjit::store_cached_code(cache_directory, cache_key, program, jit.machine_code(), jit.mapping_bytecode_to_code, jit.m_buffer.guard_size());
+        if (!cli_opts.fuel) {
+            jit.run_until_end();
+        } else if (auto const why = run_limited(jit, fuel_limit, time_limit)) {
+            jit.output().flush();
+            if (!snapshot_path) {
+                fmt::print(stderr, "stopped {}\n", *why);
+                return EXIT_STOPPED;
+            }
+            auto const snapshot = take_snapshot(hash, cli_opts.cell_width, jit.m_ip, jit.m_buffer, jit.m_ptr, jit.input(), jit.output());
+            if (!bfjit::write_snapshot(snapshot_path, snapshot))
+                return 1;
+            fmt::print(stderr, "stopped {}, carry on with -R {}\n", *why, snapshot_path);
+            return EXIT_STOPPED;
+        }
+        if (jit.out_of_bounds())
+            return 1;
+        if (jit.m_profile)
+            jit.m_profile->report(program, loop_positions, profile_top);
     }
 }
 
-std::string load_program(char const* path) {
-    if (!std::filesystem::is_regular_file(path)) {
-        fmt::print(fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
-        fmt::print(": file is not a regular file\n");
-        std::abort();
+std::vector<uint8_t> read_all(int fd) {
+    std::vector<uint8_t> data;
+    size_t size = 0;
+    while (true) {
+        if (data.size() - size < 64 * 1024)
+            data.resize(std::max<size_t>(data.size() * 2, 64 * 1024));
+        auto const count = read(fd, data.data() + size, data.size() - size);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            break;
+        size += size_t(count);
     }
-    auto const fsize = std::filesystem::file_size(path);
-    if (fsize > 1024*1024) {
+    data.resize(size);
+    return data;
+}
+
+bfjit::Snapshot take_snapshot(uint64_t bytecode_hash, size_t cell_width, size_t ip, bfjit::Tape const& tape, size_t ptr, bfjit::InputBuffer const& input, bfjit::OutputBuffer const& output) {
+    bfjit::Snapshot snapshot{
+        .bytecode_hash = bytecode_hash,
+        .cell_width = cell_width,
+        .ip = ip,
+        .ptr = ptr,
+        .input_position = input.position(),
+        .output_position = output.written(),
+    };
+    snapshot.save_tape({ tape.data(), tape.size() });
+    return snapshot;
+}
+
+bool restore_snapshot(bfjit::Snapshot const& snapshot, bfjit::Tape& tape, size_t& ptr, bfjit::InputBuffer& input, bfjit::OutputBuffer& output) {
+    if (snapshot.tape_size > tape.size()) {
         fmt::print(fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
-        fmt::print(": file is too big ({} KB)\n", (fsize + 511) / 1024);
-        std::abort();
-    }
-    auto handle = std::ifstream( path );
-    std::string buffer;
-    buffer.resize(fsize+1, 0);
-    handle.read(buffer.data(), fsize);
-    return buffer;
+        fmt::print(": the snapshot needs a tape of at least {} cells, see -t\n", snapshot.tape_size / snapshot.cell_width);
+        return false;
+    }
+    snapshot.restore_tape({ tape.data(), tape.size() });
+    ptr = snapshot.ptr;
+    // the input is given again from the start, the output was already written
+    input.skip(snapshot.input_position);
+    output.m_flushed = snapshot.output_position;
+    return true;
+}
+
+std::optional<std::string> run_limited(bfjit::JIT& jit, std::optional<uint64_t> fuel, std::optional<uint64_t> seconds) {
+    // short enough to notice a signal or the time limit quickly
+    constexpr uint64_t SLICE = 1024 * 1024;
+    auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds.value_or(0));
+    auto left = fuel.value_or(UINT64_MAX);
+    while (true) {
+        auto const slice = std::min(left, SLICE);
+        if (jit.run_for(slice))
+            return std::nullopt;
+        left -= slice;
+        if (left == 0)
+            return fmt::format("after {} loop iterations", *fuel);
+        if (seconds && std::chrono::steady_clock::now() >= deadline)
+            return fmt::format("after {} seconds", *seconds);
+        if (bfjit::stop_requested())
+            return "on request";
+    }
+}
+
+std::string at_offset(bfjit::BFOp const& bc) {
+    if (bc.m_offset == 0)
+        return "";
+    return fmt::format("@{}", bc.m_offset);
 }
 
-size_t print_bfcode(std::vector<bfjit::BFOp> const& code, size_t start, size_t offset) {
+std::optional<size_t> parse_size(std::string_view str) {
+    size_t value = 0;
+    auto const [end, err] = std::from_chars(str.data(), str.data() + str.size(), value);
+    if (err != std::errc() || value == 0)
+        return std::nullopt;
+    auto const suffix = str.substr(end - str.data());
+    if (suffix.empty())
+        return value;
+    if (suffix == "K" || suffix == "k")
+        return value << 10;
+    if (suffix == "M" || suffix == "m")
+        return value << 20;
+    if (suffix == "G" || suffix == "g")
+        return value << 30;
+    return std::nullopt;
+}
+
+// seconds, minutes or hours, rather than parse_size()'s binary multiples
+std::optional<uint64_t> parse_seconds(std::string_view str) {
+    uint64_t value = 0;
+    auto const [end, err] = std::from_chars(str.data(), str.data() + str.size(), value);
+    if (err != std::errc() || value == 0)
+        return std::nullopt;
+    auto const suffix = str.substr(end - str.data());
+    uint64_t unit = 0;
+    if (suffix.empty() || suffix == "s")
+        unit = 1;
+    else if (suffix == "m")
+        unit = 60;
+    else if (suffix == "h")
+        unit = 60 * 60;
+    // a century, the deadline has to fit in a steady_clock::time_point
+    constexpr uint64_t MAX_SECONDS = uint64_t(100) * 365 * 24 * 60 * 60;
+    if (unit == 0 || value > MAX_SECONDS / unit)
+        return std::nullopt;
+    return value * unit;
+}
+
+size_t print_bfcode(std::vector<bfjit::BFOp> const& code, size_t cell_width, size_t start, size_t offset) {
     size_t i = start;
     for (; i < code.size(); i++) {
         auto const& bc = code[i];
@@ -100,27 +532,36 @@ size_t print_bfcode(std::vector<bfjit::BFOp> const& code, size_t start, size_t o
             for (int j = 0; j < offset; j++) fmt::print(" ");
         switch (bc.m_type) {
         case bfjit::BFOp::Type::Mod:
-            fmt::print("<{}:{}>\n", bc.inc_arg < 0 ? '-' : '+', int8_t(bc.inc_arg));
+        {
+            auto const value = bfjit::sign_extend_cell(bc.inc_arg, cell_width);
+            fmt::print("<{}:{}{}>\n", value < 0 ? '-' : '+', value, at_offset(bc));
             break;
+        }
         case bfjit::BFOp::Type::ModPtr:
             fmt::print("<{}:{}>\n", bc.inc_ptr_arg < 0 ? '<' : '>', bc.inc_ptr_arg);
             break;
         case bfjit::BFOp::Type::In:
-            fmt::print("<In>\n");
+            fmt::print("<In{}>\n", at_offset(bc));
             break;
         case bfjit::BFOp::Type::Out:
-            fmt::print("<Out>\n");
+            fmt::print("<Out{}>\n", at_offset(bc));
             break;
         case bfjit::BFOp::Type::LoopBeg:
             fmt::print("<LoopBegin>\n");
-            i = print_bfcode(code, i+1, offset+1);
+            i = print_bfcode(code, cell_width, i+1, offset+1);
             for (int j = 0; j < offset; j++) fmt::print(" ");
             fmt::print("<LoopEnd>\n");
             break;
         case bfjit::BFOp::Type::LoopEnd:
             return i;
         case bfjit::BFOp::Type::SetValue:
-            fmt::print("<Set:{}>\n", bc.set_arg);
+            fmt::print("<Set:{}{}>\n", bc.set_arg & bfjit::cell_mask(cell_width), at_offset(bc));
+            break;
+        case bfjit::BFOp::Type::MulAdd:
+            fmt::print("<MulAdd:{}*{}{}>\n", bc.mul_arg.offset, bc.mul_arg.factor, at_offset(bc));
+            break;
+        case bfjit::BFOp::Type::Scan:
+            fmt::print("<Scan:{}>\n", bc.scan_arg);
             break;
         case bfjit::BFOp::Type::Halt:
             fmt::print("<Halt>\n");
@@ -132,11 +573,44 @@ size_t print_bfcode(std::vector<bfjit::BFOp> const& code, size_t start, size_t o
 
 void print_usage(char const* argv) {
     fmt::print(R"(Usage:
-{} [-d] [-i] SOURCE_FILE
+{} [-d] [-i] [-I] [-T] [-c] [-l] [-t SIZE] [-w BITS] [-e EOF] [-P OPS] [-r N] [-S FILE] [-R FILE] [-F N] [-L TIME] [-o FILE] [-C DIR] [-b FORMAT] [-j N] SOURCE_FILE
 OPTIONS:
     -d      disable optimizations
     -i      use interpreter instead of JIT
+    -I      use threaded-code interpreter instead of JIT, needs no executable memory
+    -T      start in the interpreter and only JIT the hot loops
     -h      print this message
     -p      print bytecode before execution and exit
+    -c      bounds check every pointer move instead of using guard pages
+    -t SIZE tape size in cells, accepts K, M and G suffixes (default 1M, or
+            32K with -b)
+    -w BITS bits in a cell: 8, 16, 32 or 64 (default 8). Wider cells only
+            work with the JIT and -i, and disable -P
+    -l      flush the output on every newline
+    -e EOF  value `,` stores at end of input: 0, -1 or keep (default keep)
+    -P OPS  run up to OPS ops ahead of time, stopping at the first `,`, and
+            only compile what's left. Accepts K, M and G suffixes
+    -r N    count how often every loop runs and report the N hottest on
+            stderr once the program ends (JIT and -i only). Disables -P
+    -S FILE on SIGTERM or SIGINT stop at the next loop, write where the
+            program was to FILE and exit with status 2. A second signal
+            terminates it right away. -S and -R disable -P
+    -R FILE carry on from a snapshot -S wrote, with the JIT or -i. The
+            program, -d, -w and the input must be the same as when it was
+            taken, the input is read again from the start and skipped
+    -F N    stop after N loop iterations, accepts K, M and G suffixes (JIT
+            only). Exits with status 2, after writing a snapshot with -S
+    -L TIME stop after running for TIME, in seconds or with an s, m or h
+            suffix, like -F (JIT only)
+    -o FILE write a standalone executable instead of running (x86-64
+            Linux only). -l, -e and -t apply to it, the tape is always checked
+    -C DIR  keep the JIT's code in DIR and reuse it when the same program
+            runs again with the same options and bfjit build
+    -b FMT  run the program once per record of the input, in parallel, and
+            write the outputs in order. FMT is lines (one record per line) or
+            len (records and outputs prefixed by their 32 bit LE size). The
+            tape is always checked, and cleared before every record, so keep
+            it no bigger than the program needs with -t
+    -j N    threads -b runs on (default one per core)
 )", argv);
 }
@@ -6,68 +6,389 @@
 #include <algorithm>
 #include <numeric>
 #include <stack>
+#include <utility>
+#include <chrono>
+#include <cstdint>
+#include <fmt/format.h>
+#include <unordered_map>
+#include <unordered_set>
 
 namespace bfjit {
-    auto match_manny(std::span<BFOp const> code, BFOp::Type type) -> size_t;
     bool matches(std::span<BFOp const> code, std::initializer_list<BFOp::Type> sequence);
+    auto reduce_balanced_loop(std::span<BFOp const> code, std::vector<BFOp>& out, size_t cell_width) -> size_t;
 
-    auto one_step_optimize(std::span<BFOp const> buffer_in, bool *did_something) -> std::vector<BFOp> {
-        auto worked = [&]() { if (did_something) *did_something = true; };
-        
-        std::vector<BFOp> buffer;
-        buffer.reserve(buffer_in.size());
-        while (not buffer_in.empty()) {
-            if (auto rep = match_manny(buffer_in, BFOp::Type::Mod); rep > 1) {
-                uint8_t acc = 0;
-                for (size_t i = 0; i < rep; i++)
-                    acc += buffer_in[i].inc_arg;
-                buffer_in = buffer_in.subspan(rep);
-                buffer.push_back( BFOp{ .m_type = BFOp::Type::Mod, .inc_arg = acc } );
-                worked();
+    PassManager::PassManager(size_t cell_width, size_t tape_size) :
+        m_cell_width(cell_width),
+        m_tape_size(tape_size)
+    {
+    }
+    void PassManager::add(Pass pass) {
+        m_passes.push_back(pass);
+    }
+    void PassManager::run(std::vector<BFOp>& buffer, std::vector<size_t>* loop_positions) {
+        m_stats.clear();
+        for (auto const& pass : m_passes) {
+            auto const ops_before = buffer.size();
+            auto const start = std::chrono::steady_clock::now();
+            pass.run(buffer, m_cell_width, m_tape_size, loop_positions);
+            auto const elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+            m_stats.push_back(PassStats{ .name = pass.name, .milliseconds = elapsed.count(), .ops_before = ops_before, .ops_after = buffer.size() });
+        }
+    }
+    auto PassManager::stats() const -> std::span<PassStats const> {
+        return m_stats;
+    }
+    void PassManager::print_stats() const {
+        fmt::print("Optimizer passes:\n");
+        for (auto const& stats : m_stats)
+            fmt::print("\t{:<20} {:8.3f} ms {:>10} -> {:<10} ops\n", stats.name, stats.milliseconds, stats.ops_before, stats.ops_after);
+    }
+    auto PassManager::default_pipeline(size_t cell_width, size_t tape_size) -> PassManager {
+        PassManager passes(cell_width, tape_size);
+        // only reduce-loops and propagate-constants drop loops
+        passes.add({ "fold-runs", [](std::vector<BFOp>& buffer, size_t cell_width, size_t, std::vector<size_t>*) { fold_runs(buffer, cell_width); } });
+        passes.add({ "reduce-loops", [](std::vector<BFOp>& buffer, size_t cell_width, size_t, std::vector<size_t>* loop_values) { reduce_loops(buffer, cell_width, loop_values); } });
+        passes.add({ "sink-pointer-moves", [](std::vector<BFOp>& buffer, size_t, size_t, std::vector<size_t>*) { sink_pointer_moves(buffer); } });
+        passes.add({ "relink-loops", [](std::vector<BFOp>& buffer, size_t, size_t, std::vector<size_t>*) { do_loop_relink(buffer); } });
+        passes.add({ "propagate-constants", propagate_constants });
+        // removed loops can leave pointer moves next to each other
+        passes.add({ "sink-pointer-moves", [](std::vector<BFOp>& buffer, size_t, size_t, std::vector<size_t>*) { sink_pointer_moves(buffer); } });
+        passes.add({ "drop-dead-stores", [](std::vector<BFOp>& buffer, size_t, size_t, std::vector<size_t>*) { drop_dead_stores(buffer); } });
+        passes.add({ "relink-loops", [](std::vector<BFOp>& buffer, size_t, size_t, std::vector<size_t>*) { do_loop_relink(buffer); } });
+        return passes;
+    }
+
+    auto optimize(std::span<BFOp const> buffer_in, size_t cell_width, size_t tape_size) -> std::vector<BFOp> {
+        auto buffer = std::vector<BFOp>(buffer_in.begin(), buffer_in.end());
+        PassManager::default_pipeline(cell_width, tape_size).run(buffer);
+        return buffer;
+    }
+
+    // Merges runs of Mod (on the same cell) and ModPtr into a single op and drops
+    // the ones that end up doing nothing, which may expose a new run to merge.
+    // Mod amounts come out truncated to the cell width.
+    void fold_runs(std::vector<BFOp>& buffer, size_t cell_width) {
+        auto const mask = cell_mask(cell_width);
+        size_t out = 0;
+        for (size_t i = 0; i < buffer.size(); i++) {
+            auto op = buffer[i];
+            if (op.m_type == BFOp::Type::Mod)
+                op.inc_arg &= mask;
+            if (op.m_type != BFOp::Type::Mod && op.m_type != BFOp::Type::ModPtr) {
+                buffer[out++] = op;
+                continue;
+            }
+            if (out > 0 && buffer[out - 1].m_type == op.m_type && buffer[out - 1].m_offset == op.m_offset) {
+                auto& last = buffer[out - 1];
+                if (op.m_type == BFOp::Type::Mod)
+                    last.inc_arg = (last.inc_arg + op.inc_arg) & mask;
+                else
+                    last.inc_ptr_arg += op.inc_ptr_arg;
+                if ((op.m_type == BFOp::Type::Mod && last.inc_arg == 0) || (op.m_type == BFOp::Type::ModPtr && last.inc_ptr_arg == 0))
+                    out--;
                 continue;
             }
-            if (auto rep = match_manny(buffer_in, BFOp::Type::ModPtr); rep > 1) {
-                int64_t acc = 0;
-                for (size_t i = 0; i < rep; i++)
-                    acc += buffer_in[i].inc_ptr_arg;
-                buffer_in = buffer_in.subspan(rep);
-                buffer.push_back( BFOp{ .m_type = BFOp::Type::ModPtr, .inc_ptr_arg = acc } );
-                worked();
+            if ((op.m_type == BFOp::Type::Mod && op.inc_arg == 0) || (op.m_type == BFOp::Type::ModPtr && op.inc_ptr_arg == 0))
+                continue;
+            buffer[out++] = op;
+        }
+        buffer.resize(out);
+    }
+    // Replaces loop idioms ([-], [>], [], [->+<]) with dedicated ops. Every loop
+    // is looked at once, when its end is reached, so inner loops have already
+    // been rewritten by then. The replacement is never longer than the loop, so
+    // it's written over it. Leaves loop_arg stale.
+    void reduce_loops(std::vector<BFOp>& buffer, size_t cell_width, std::vector<size_t>* loop_values) {
+        auto const mask = cell_mask(cell_width);
+        std::vector<size_t> loop_starts;
+        std::vector<BFOp> replacement;
+        // the values of `loop_values` for the LoopBeg in buffer[0, out)
+        std::vector<size_t> kept_loops;
+        size_t seen_loops = 0;
+        size_t out = 0;
+        for (size_t i = 0; i < buffer.size(); i++) {
+            auto const op = buffer[i];
+            buffer[out++] = op;
+            if (op.m_type == BFOp::Type::LoopBeg) {
+                loop_starts.push_back(out - 1);
+                if (loop_values)
+                    kept_loops.push_back((*loop_values)[seen_loops++]);
                 continue;
             }
+            if (op.m_type != BFOp::Type::LoopEnd || loop_starts.empty())
+                continue;
+            auto const start = loop_starts.back();
+            loop_starts.pop_back();
 
-            if (matches(buffer_in, { BFOp::Type::LoopBeg, BFOp::Type::Mod, BFOp::Type::LoopEnd })) {
-                if (buffer_in[1].inc_arg == 255) {
-                    buffer_in = buffer_in.subspan<3>();
-                    buffer.push_back( BFOp{ .m_type = BFOp::Type::SetValue, .set_arg = 0 } );
-                    worked();
+            auto const loop = std::span<BFOp const>(buffer).subspan(start, out - start);
+            replacement.clear();
+            if (matches(loop, { BFOp::Type::LoopBeg, BFOp::Type::LoopEnd })) {
+                replacement.push_back( BFOp{ .m_type = BFOp::Type::Halt, .halt_reason = BFOp::HaltReason::InfiniteLoop } );
+            } else if (matches(loop, { BFOp::Type::LoopBeg, BFOp::Type::Mod, BFOp::Type::LoopEnd }) && loop.size() == 3 && (loop[1].inc_arg & mask) == mask && loop[1].m_offset == 0) {
+                replacement.push_back( BFOp{ .m_type = BFOp::Type::SetValue, .set_arg = 0 } );
+            } else if (matches(loop, { BFOp::Type::LoopBeg, BFOp::Type::ModPtr, BFOp::Type::LoopEnd }) && loop.size() == 3) {
+                replacement.push_back( BFOp{ .m_type = BFOp::Type::Scan, .scan_arg = loop[1].inc_ptr_arg } );
+            } else if (reduce_balanced_loop(loop, replacement, cell_width) == 0) {
+                continue;
+            }
+            if (loop_values)
+                kept_loops.resize(kept_loops.size() - size_t(std::count_if(loop.begin(), loop.end(), [](BFOp const& op) { return op.m_type == BFOp::Type::LoopBeg; })));
+            std::copy(replacement.begin(), replacement.end(), buffer.begin() + start);
+            out = start + replacement.size();
+        }
+        buffer.resize(out);
+        if (loop_values)
+            *loop_values = std::move(kept_loops);
+    }
+    // Turns sequences like >+>+<< into +@1 +@2 > so the pointer is moved once at
+    // the end of every basic block instead of before every access. Never writes
+    // more ops than it has read, so it works in place.
+    void sink_pointer_moves(std::vector<BFOp>& buffer) {
+        size_t out = 0;
+        int64_t pos = 0;
+        auto flush = [&]() {
+            if (pos != 0)
+                buffer[out++] = BFOp{ .m_type = BFOp::Type::ModPtr, .inc_ptr_arg = pos };
+            pos = 0;
+        };
+        for (size_t i = 0; i < buffer.size(); i++) {
+            auto op = buffer[i];
+            switch (op.m_type) {
+            case BFOp::Type::ModPtr:
+                pos += op.inc_ptr_arg;
+                break;
+            case BFOp::Type::Mod:
+            case BFOp::Type::SetValue:
+            case BFOp::Type::In:
+            case BFOp::Type::Out:
+            case BFOp::Type::MulAdd:
+                if (pos + op.m_offset < INT32_MIN || pos + op.m_offset > INT32_MAX) {
+                    flush();
+                } else {
+                    op.m_offset += int32_t(pos);
+                }
+                buffer[out++] = op;
+                break;
+            case BFOp::Type::LoopBeg:
+            case BFOp::Type::LoopEnd:
+            case BFOp::Type::Scan:
+            case BFOp::Type::Halt:
+                flush();
+                buffer[out++] = op;
+                break;
+            }
+        }
+        flush();
+        buffer.resize(out);
+    }
+    namespace {
+        // What constant propagation knows about the tape. Cells are keyed by
+        // their distance from where the pointer was when everything was last
+        // forgotten, so moving the pointer only changes `base`.
+        struct KnownCells {
+            std::unordered_map<int64_t, std::optional<uint64_t>> cells;
+            int64_t base = 0;
+            // cells missing from `cells` still hold their initial zero. Only
+            // true until the pointer goes somewhere we can't follow, until
+            // then `base` is the absolute position
+            bool rest_zero = true;
+            // in cells. Only those in [0, tape_size) are zero, an access
+            // outside of them has to stay to fail at runtime
+            int64_t tape_size = 0;
+
+            [[nodiscard]]
+            auto get(int64_t offset) const -> std::optional<uint64_t> {
+                auto const cell = base + offset;
+                // only there once an op accessed the cell, which failed if
+                // it's outside of the tape
+                if (auto const found = cells.find(cell); found != cells.end())
+                    return found->second;
+                if (rest_zero && cell >= 0 && cell < tape_size)
+                    return 0;
+                return std::nullopt;
+            }
+            void set(int64_t offset, std::optional<uint64_t> value) {
+                cells[base + offset] = value;
+            }
+            void forget() {
+                cells.clear();
+                base = 0;
+                rest_zero = false;
+            }
+        };
+    }
+    // Runs the program abstractly, starting from the all zero tape, and rewrites
+    // what only depends on cells with a known value: Mod on a known cell becomes
+    // a SetValue, SetValue to the value a cell already holds, MulAdd from a known
+    // cell and loops (or Scan and Halt) entered on a zero cell are dropped. A
+    // loop body that stays on one cell only forgets the cells it writes, other
+    // loops forget everything. Cells past either end of the tape are never
+    // known, so what accesses them still fails. Needs loop_arg and leaves it
+    // stale.
+    void propagate_constants(std::vector<BFOp>& buffer, size_t cell_width, size_t tape_size, std::vector<size_t>* loop_values) {
+        auto const mask = cell_mask(cell_width);
+        auto const loops = build_loop_tree(buffer);
+        size_t next_loop = 0;
+        // the values of `loop_values` for the loops that are kept
+        std::vector<size_t> kept_loops;
+        KnownCells known{ .tape_size = int64_t(std::min<size_t>(tape_size, INT64_MAX)) };
+        // state before each open loop that stays on one cell, with what it
+        // writes forgotten. It is also the state after the loop
+        std::vector<std::optional<KnownCells>> loop_entry;
+        size_t out = 0;
+        for (size_t i = 0; i < buffer.size(); i++) {
+            auto op = buffer[i];
+            switch (op.m_type) {
+            case BFOp::Type::Mod:
+                if (auto const value = known.get(op.m_offset)) {
+                    op = BFOp{ .m_type = BFOp::Type::SetValue, .m_offset = op.m_offset, .set_arg = (*value + op.inc_arg) & mask };
+                    known.set(op.m_offset, op.set_arg);
+                }
+                break;
+            case BFOp::Type::SetValue:
+                op.set_arg &= mask;
+                if (known.get(op.m_offset) == op.set_arg)
                     continue;
+                known.set(op.m_offset, op.set_arg);
+                break;
+            case BFOp::Type::In:
+                known.set(op.m_offset, std::nullopt);
+                break;
+            case BFOp::Type::Out:
+                break;
+            case BFOp::Type::ModPtr:
+                known.base += op.inc_ptr_arg;
+                break;
+            case BFOp::Type::MulAdd: {
+                auto const source = known.get(op.m_offset);
+                auto const target = int64_t(op.m_offset) + op.mul_arg.offset;
+                if (source == 0)
+                    continue;
+                auto const value = known.get(target);
+                if (!source || target < INT32_MIN || target > INT32_MAX) {
+                    known.set(target, std::nullopt);
+                    break;
                 }
+                auto const delta = (*source * uint64_t(int64_t(op.mul_arg.factor))) & mask;
+                if (value)
+                    op = BFOp{ .m_type = BFOp::Type::SetValue, .m_offset = int32_t(target), .set_arg = (*value + delta) & mask };
+                else
+                    op = BFOp{ .m_type = BFOp::Type::Mod, .m_offset = int32_t(target), .inc_arg = delta };
+                known.set(target, value ? std::optional<uint64_t>(op.set_arg) : std::nullopt);
+                break;
             }
-            if (matches(buffer_in, { BFOp::Type::LoopBeg, BFOp::Type::LoopEnd })) {
-                buffer_in = buffer_in.subspan<2>();
-                buffer.push_back( BFOp{ .m_type = BFOp::Type::Halt, .halt_reason = BFOp::HaltReason::InfiniteLoop } );
-                worked();
-                continue;
+            case BFOp::Type::Scan:
+                if (known.get(0) == 0)
+                    continue;
+                known.forget();
+                known.set(0, 0);
+                break;
+            case BFOp::Type::Halt:
+                if (known.get(0) == 0)
+                    continue;
+                break;
+            case BFOp::Type::LoopBeg: {
+                while (loops[next_loop].begin != i)
+                    next_loop++;
+                auto const& loop = loops[next_loop];
+                if (known.get(0) == 0) {
+                    i = loop.end;
+                    continue;
+                }
+                if (loop_values)
+                    kept_loops.push_back((*loop_values)[next_loop]);
+                if (loop.moves_pointer) {
+                    known.forget();
+                    loop_entry.emplace_back();
+                } else {
+                    for (auto const offset : loop.writes)
+                        known.set(offset, std::nullopt);
+                    loop_entry.emplace_back(known);
+                }
+                break;
             }
-
-            // TODO: loop reductions like [->+<] to add+setvalue or similar
-
-            buffer.push_back(buffer_in[0]);
-            buffer_in = buffer_in.subspan<1>();
+            case BFOp::Type::LoopEnd:
+                if (loop_entry.back())
+                    known = std::move(*loop_entry.back());
+                else
+                    known.forget();
+                loop_entry.pop_back();
+                known.set(0, 0);
+                break;
+            }
+            buffer[out++] = op;
         }
-        return buffer;
+        buffer.resize(out);
+        if (loop_values)
+            *loop_values = std::move(kept_loops);
     }
-    auto optimize(std::span<BFOp> buffer_in) -> std::vector<BFOp> {
-        bool did_something;
-        std::vector<BFOp> buffer;
-        do {
-            did_something = false;
-            buffer = one_step_optimize(buffer_in, &did_something);
-            buffer_in = buffer;
-        } while (did_something);
-        do_loop_relink(buffer);
-        return buffer;
+    // Drops stores to cells that are overwritten later in the same basic block
+    // without being read in between, like the SetValue 0 a reduced loop leaves
+    // before the cell is set again. Blocks are walked backwards, remembering
+    // the cells a later op overwrites.
+    void drop_dead_stores(std::vector<BFOp>& buffer) {
+        std::vector<bool> dead(buffer.size(), false);
+        std::unordered_set<int64_t> overwritten;
+        for (size_t i = buffer.size(); i-- > 0;) {
+            auto const& op = buffer[i];
+            switch (op.m_type) {
+            case BFOp::Type::SetValue:
+                dead[i] = !overwritten.insert(op.m_offset).second;
+                break;
+            case BFOp::Type::Mod:
+                // reads the cell, but only for a value that is overwritten anyway
+                dead[i] = overwritten.contains(op.m_offset);
+                break;
+            case BFOp::Type::MulAdd: {
+                auto const target = int64_t(op.m_offset) + op.mul_arg.offset;
+                dead[i] = overwritten.contains(target);
+                if (!dead[i]) {
+                    overwritten.erase(target);
+                    overwritten.erase(op.m_offset);
+                }
+                break;
+            }
+            case BFOp::Type::In:
+                // keeps the cell on EOF with -e keep, so it reads it too
+            case BFOp::Type::Out:
+                overwritten.erase(op.m_offset);
+                break;
+            case BFOp::Type::ModPtr:
+            case BFOp::Type::LoopBeg:
+            case BFOp::Type::LoopEnd:
+            case BFOp::Type::Scan:
+            case BFOp::Type::Halt:
+                overwritten.clear();
+                break;
+            }
+        }
+        size_t out = 0;
+        for (size_t i = 0; i < buffer.size(); i++)
+            if (!dead[i])
+                buffer[out++] = buffer[i];
+        buffer.resize(out);
+    }
+    // Smallest and biggest offset accessed unconditionally by the straight-line
+    // code at the start of `block`, used by the JITs to bounds check a whole block
+    // once instead of every access. MulAdd targets are not included, they are
+    // only touched when the source cell is not zero.
+    auto block_offset_range(std::span<BFOp const> block) -> std::pair<int64_t, int64_t> {
+        int64_t min = 0, max = 0;
+        for (auto const& op : block) {
+            switch (op.m_type) {
+            case BFOp::Type::Mod:
+            case BFOp::Type::SetValue:
+            case BFOp::Type::In:
+            case BFOp::Type::Out:
+            case BFOp::Type::MulAdd:
+                min = std::min<int64_t>(min, op.m_offset);
+                max = std::max<int64_t>(max, op.m_offset);
+                break;
+            default:
+                return { min, max };
+            }
+        }
+        return { min, max };
     }
     void do_loop_relink(std::span<BFOp> buffer) {
         std::stack<size_t> loop_stack;
@@ -88,16 +409,78 @@ namespace bfjit {
     }
 
 
-    auto match_manny(std::span<BFOp const> code, BFOp::Type type) -> size_t {
-        size_t ret = 0;
-        for (size_t i = 0; i < code.size(); i++) {
-            if (code[i].m_type != type)
-                return ret;
-            else
-                ret++;
+    auto build_loop_tree(std::span<BFOp const> buffer) -> std::vector<LoopInfo> {
+        std::vector<LoopInfo> loops;
+        size_t current = LoopInfo::NO_PARENT;
+        for (size_t i = 0; i < buffer.size(); i++) {
+            auto const& op = buffer[i];
+            if (op.m_type == BFOp::Type::LoopBeg) {
+                loops.push_back(LoopInfo{ .begin = i, .end = op.loop_arg, .parent = current, .moves_pointer = false, .writes = {} });
+                current = loops.size() - 1;
+                continue;
+            }
+            if (current == LoopInfo::NO_PARENT)
+                continue;
+            auto& loop = loops[current];
+            switch (op.m_type) {
+            case BFOp::Type::Mod:
+            case BFOp::Type::SetValue:
+            case BFOp::Type::In:
+                loop.writes.push_back(op.m_offset);
+                break;
+            case BFOp::Type::MulAdd:
+                loop.writes.push_back(int64_t(op.m_offset) + op.mul_arg.offset);
+                break;
+            case BFOp::Type::ModPtr:
+            case BFOp::Type::Scan:
+                loop.moves_pointer = true;
+                break;
+            case BFOp::Type::LoopEnd:
+                // the parent runs everything its children do
+                if (loop.parent != LoopInfo::NO_PARENT) {
+                    auto& parent = loops[loop.parent];
+                    parent.moves_pointer |= loop.moves_pointer;
+                    if (!parent.moves_pointer)
+                        parent.writes.insert(parent.writes.end(), loop.writes.begin(), loop.writes.end());
+                }
+                current = loop.parent;
+                break;
+            default:
+                break;
+            }
         }
-        return ret;
+        return loops;
+    }
+
+
+    // Biggest distance from a valid data pointer that any operation can access
+    // without a bounds check when running on a guarded tape. Scan is left out,
+    // it always checks its result.
+    auto max_cell_reach(std::span<BFOp const> buffer) -> size_t {
+        size_t reach = 0;
+        auto update = [&](int64_t offset) { reach = std::max<size_t>(reach, offset < 0 ? -offset : offset); };
+        for (auto const& op : buffer) {
+            switch (op.m_type) {
+            case BFOp::Type::ModPtr:
+                update(op.inc_ptr_arg);
+                break;
+            case BFOp::Type::MulAdd:
+                update(int64_t(op.m_offset) + op.mul_arg.offset);
+                update(op.m_offset);
+                break;
+            case BFOp::Type::Mod:
+            case BFOp::Type::SetValue:
+            case BFOp::Type::In:
+            case BFOp::Type::Out:
+                update(op.m_offset);
+                break;
+            default:
+                break;
+            }
+        }
+        return reach;
     }
+
     bool matches(std::span<BFOp const> code, std::initializer_list<BFOp::Type> sequence) {
         if (code.size() < sequence.size())
             return false;
@@ -106,6 +489,61 @@ namespace bfjit {
                 return false;
         return true;
     }
+    // Reduces loops like [->+<] or [->++>+++<<] that only contain Mod/ModPtr,
+    // end on the cell they started on and step that cell by -1 (or +1) every
+    // iteration. Those run exactly data[ptr] (or -data[ptr]) times, so each
+    // other touched cell just gets data[ptr] * delta added to it.
+    // Returns the amount of ops consumed, 0 if the loop can't be reduced.
+    auto reduce_balanced_loop(std::span<BFOp const> code, std::vector<BFOp>& out, size_t cell_width) -> size_t {
+        if (code.empty() || code[0].m_type != BFOp::Type::LoopBeg)
+            return 0;
+
+        auto const mask = cell_mask(cell_width);
+        std::vector<std::pair<int64_t, uint64_t>> deltas;
+        int64_t pos = 0;
+        size_t len = 1;
+        for (; len < code.size(); len++) {
+            auto const& op = code[len];
+            if (op.m_type == BFOp::Type::ModPtr) {
+                pos += op.inc_ptr_arg;
+            } else if (op.m_type == BFOp::Type::Mod) {
+                auto const cell = pos + op.m_offset;
+                auto it = std::find_if(deltas.begin(), deltas.end(), [&](auto const& d) { return d.first == cell; });
+                if (it == deltas.end())
+                    deltas.emplace_back(cell, op.inc_arg & mask);
+                else
+                    it->second = (it->second + op.inc_arg) & mask;
+            } else {
+                break;
+            }
+        }
+        if (len == code.size() || code[len].m_type != BFOp::Type::LoopEnd || pos != 0)
+            return 0;
+
+        auto origin = std::find_if(deltas.begin(), deltas.end(), [](auto const& d) { return d.first == 0; });
+        if (origin == deltas.end() || (origin->second != mask && origin->second != 1))
+            return 0;
+        // with a +1 step the loop runs -data[ptr] times, so flip every factor
+        bool const negate = origin->second == 1;
+        auto factor_of = [&](uint64_t delta) { return sign_extend_cell(negate ? -delta : delta, cell_width); };
+
+        for (auto const& [offset, delta] : deltas) {
+            if (offset == 0 || delta == 0)
+                continue;
+            if (offset < INT32_MIN || offset > INT32_MAX)
+                return 0;
+            // only wide cells can get factors this big
+            if (factor_of(delta) < INT32_MIN || factor_of(delta) > INT32_MAX)
+                return 0;
+        }
+        for (auto const& [offset, delta] : deltas) {
+            if (offset == 0 || delta == 0)
+                continue;
+            out.push_back( BFOp{ .m_type = BFOp::Type::MulAdd, .mul_arg = { .offset = int32_t(offset), .factor = int32_t(factor_of(delta)) } } );
+        }
+        out.push_back( BFOp{ .m_type = BFOp::Type::SetValue, .set_arg = 0 } );
+        return len + 1;
+    }
     size_t find_closing_loop(std::span<BFOp const> buffer_in) {
         size_t ret = 0;
         size_t cnt = 0;
@@ -1,13 +1,86 @@
 #pragma once
 
+#include "options.hpp"
 #include "parser.hpp"
 #include <span>
+#include <string_view>
+#include <utility>
+#include <cstdint>
 #include <vector>
 
 namespace bfjit {
 
-    auto one_step_optimize(std::span<BFOp const> buffer, bool *did_something = nullptr) -> std::vector<BFOp>;
-    auto optimize(std::span<BFOp> buffer) -> std::vector<BFOp>;
+    // A named rewrite of the whole program, done in place. Cells are
+    // `cell_width` bytes wide, which is where arithmetic wraps around, and
+    // there are `tape_size` of them, past which accesses fail.
+    // `loop_values`, when not null, has a value for every LoopBeg of `buffer` in
+    // order, and a pass that drops loops drops their values along with them
+    struct Pass {
+        std::string_view name;
+        void (*run)(std::vector<BFOp>& buffer, size_t cell_width, size_t tape_size, std::vector<size_t>* loop_values);
+    };
+    struct PassStats {
+        std::string_view name;
+        double milliseconds;
+        size_t ops_before;
+        size_t ops_after;
+    };
+
+    // Runs passes in the order they were added, timing each one
+    class PassManager {
+    public:
+        explicit PassManager(size_t cell_width = 1, size_t tape_size = DEFAULT_TAPE_SIZE);
+
+        void add(Pass pass);
+        // `loop_positions`, one per LoopBeg like Parser::finish() gives them,
+        // is kept in step with the loops the passes drop, see Pass
+        void run(std::vector<BFOp>& buffer, std::vector<size_t>* loop_positions = nullptr);
+        // of the last run
+        [[nodiscard]]
+        auto stats() const -> std::span<PassStats const>;
+        void print_stats() const;
+
+        // what optimize() runs
+        [[nodiscard]]
+        static auto default_pipeline(size_t cell_width = 1, size_t tape_size = DEFAULT_TAPE_SIZE) -> PassManager;
+
+    private:
+        size_t m_cell_width;
+        size_t m_tape_size;
+        std::vector<Pass> m_passes;
+        std::vector<PassStats> m_stats;
+    };
+
+    // A loop of a relinked program and what its body, nested loops included,
+    // may do to the tape
+    struct LoopInfo {
+        size_t begin;
+        size_t end;
+        // index of the enclosing loop in the tree, NO_PARENT at the top level
+        size_t parent;
+        // the body has a ModPtr or Scan somewhere, so it doesn't stay on one cell
+        bool moves_pointer;
+        // cells the body may write, relative to the pointer at the LoopBeg.
+        // Meaningless when moves_pointer is set
+        std::vector<int64_t> writes;
+
+        static constexpr size_t NO_PARENT = SIZE_MAX;
+    };
+
+    [[nodiscard]]
+    auto optimize(std::span<BFOp const> buffer, size_t cell_width = 1, size_t tape_size = DEFAULT_TAPE_SIZE) -> std::vector<BFOp>;
+    void fold_runs(std::vector<BFOp>& buffer, size_t cell_width = 1);
+    void reduce_loops(std::vector<BFOp>& buffer, size_t cell_width = 1, std::vector<size_t>* loop_values = nullptr);
+    void sink_pointer_moves(std::vector<BFOp>& buffer);
+    void propagate_constants(std::vector<BFOp>& buffer, size_t cell_width = 1, size_t tape_size = DEFAULT_TAPE_SIZE, std::vector<size_t>* loop_values = nullptr);
+    void drop_dead_stores(std::vector<BFOp>& buffer);
     void do_loop_relink(std::span<BFOp> buffer);
+    // every loop of a relinked program, ordered by where they begin
+    [[nodiscard]]
+    auto build_loop_tree(std::span<BFOp const> buffer) -> std::vector<LoopInfo>;
+    [[nodiscard]]
+    auto block_offset_range(std::span<BFOp const> block) -> std::pair<int64_t, int64_t>;
+    [[nodiscard]]
+    auto max_cell_reach(std::span<BFOp const> buffer) -> size_t;
 
 }
\ No newline at end of file
@@ -1,10 +1,45 @@
 #pragma once
 
+#include <cstddef>
+
 namespace bfjit {
 
+// what `,` stores once the input is exhausted
+enum class EofBehavior {
+    Unchanged,
+    Zero,
+    MinusOne,
+};
+
+// in cells, what a tape is unless -t says otherwise
+constexpr size_t DEFAULT_TAPE_SIZE = 1024 * 1024;
+
 struct CLIOpts {
     bool debug_info = false;
+    // count how often every loop runs, see LoopProfile. Only the interpreter
+    // and the JIT do
+    bool profile_loops = false;
+    // bounds check every pointer move instead of relying on guard pages
+    bool checked_tape = false;
+    // in cells
+    size_t tape_size = DEFAULT_TAPE_SIZE;
+    // bytes in a cell: 1, 2, 4 or 8. Only the interpreter and the JIT
+    // support wider cells than 1
+    size_t cell_width = 1;
+    // flush the output on every newline instead of when the buffer fills up
+    bool line_buffered = false;
+    // count loop iterations, so JIT::run_for() can stop the program after
+    // a given number of them. Only the JIT does
+    bool fuel = false;
+    EofBehavior eof_behavior = EofBehavior::Unchanged;
 };
 
+// in cells, the largest tape -t accepts
+constexpr size_t MAX_TAPE_SIZE = size_t(1) << 36;
+
+constexpr bool valid_cell_width(size_t cell_width) {
+    return cell_width == 1 || cell_width == 2 || cell_width == 4 || cell_width == 8;
+}
+
 }
 
@@ -0,0 +1,152 @@
+#include "packed.hpp"
+#include "parser.hpp"
+#include <cstdint>
+#include <vector>
+
+namespace bfjit {
+
+    namespace {
+        constexpr int64_t INT24_MIN = -(int64_t(1) << 23);
+        constexpr int64_t INT24_MAX = (int64_t(1) << 23) - 1;
+
+        auto fits(int64_t value, int64_t min, int64_t max) -> bool {
+            return value >= min && value <= max;
+        }
+        auto narrow(uint8_t type, uint32_t operand) -> PackedOp {
+            return PackedOp{ type | operand << 8 };
+        }
+        auto loop_distance(std::span<BFOp const> bytecode, size_t i) -> int64_t {
+            return int64_t(bytecode[i].loop_arg) - int64_t(i);
+        }
+        // words the operation takes once packed
+        auto packed_size(std::span<BFOp const> bytecode, size_t i, size_t cell_width) -> size_t {
+            auto const& op = bytecode[i];
+            bool fit = true;
+            switch (op.m_type) {
+            case BFOp::Type::Mod:
+            case BFOp::Type::SetValue:
+                // same bits for both
+                fit = fits(op.m_offset, INT16_MIN, INT16_MAX) && fits(sign_extend_cell(op.inc_arg, cell_width), INT8_MIN, INT8_MAX);
+                break;
+            case BFOp::Type::In:
+            case BFOp::Type::Out:
+                fit = fits(op.m_offset, INT24_MIN, INT24_MAX);
+                break;
+            case BFOp::Type::ModPtr:
+                fit = fits(op.inc_ptr_arg, INT24_MIN, INT24_MAX);
+                break;
+            case BFOp::Type::Scan:
+                fit = fits(op.scan_arg, INT24_MIN, INT24_MAX);
+                break;
+            case BFOp::Type::LoopBeg:
+            case BFOp::Type::LoopEnd: {
+                // positions aren't known yet, assume everything in between is wide
+                auto const distance = loop_distance(bytecode, i);
+                auto const words = (distance < 0 ? -distance : distance + 1) * int64_t(1 + PackedOp::WIDE_WORDS);
+                fit = words <= INT24_MAX;
+                break;
+            }
+            case BFOp::Type::MulAdd:
+                fit = fits(op.m_offset, INT8_MIN, INT8_MAX) && fits(op.mul_arg.offset, INT8_MIN, INT8_MAX) && fits(op.mul_arg.factor, INT8_MIN, INT8_MAX);
+                break;
+            case BFOp::Type::Halt:
+                break;
+            }
+            return fit ? 1 : 1 + PackedOp::WIDE_WORDS;
+        }
+    }
+
+    auto pack(std::span<BFOp const> bytecode, size_t cell_width) -> std::vector<PackedOp> {
+        std::vector<size_t> position(bytecode.size() + 1);
+        for (size_t i = 0; i < bytecode.size(); i++)
+            position[i + 1] = position[i] + packed_size(bytecode, i, cell_width);
+
+        std::vector<PackedOp> code;
+        code.reserve(position.back());
+        for (size_t i = 0; i < bytecode.size(); i++) {
+            auto const& op = bytecode[i];
+            auto const type = uint8_t(op.m_type);
+            int64_t arg = 0;
+            uint32_t value = 0;
+            switch (op.m_type) {
+            case BFOp::Type::Mod:
+            case BFOp::Type::SetValue:
+                // only the low byte is kept when narrow
+                value = uint32_t(op.inc_arg);
+                arg = sign_extend_cell(op.inc_arg, cell_width);
+                break;
+            case BFOp::Type::ModPtr:
+                arg = op.inc_ptr_arg;
+                break;
+            case BFOp::Type::Scan:
+                arg = op.scan_arg;
+                break;
+            case BFOp::Type::LoopBeg:
+            case BFOp::Type::LoopEnd:
+                // to the word after the matching operation
+                arg = int64_t(position[op.loop_arg + 1]) - int64_t(position[i]);
+                break;
+            case BFOp::Type::MulAdd:
+                arg = op.mul_arg.offset;
+                value = uint32_t(op.mul_arg.factor);
+                break;
+            case BFOp::Type::Halt:
+                arg = int64_t(op.halt_reason);
+                break;
+            case BFOp::Type::In:
+            case BFOp::Type::Out:
+                break;
+            }
+
+            if (position[i + 1] - position[i] != 1) {
+                code.push_back(narrow(PackedOp::WIDE, type));
+                code.push_back(PackedOp{ uint32_t(op.m_offset) });
+                code.push_back(PackedOp{ value });
+                code.push_back(PackedOp{ uint32_t(uint64_t(arg)) });
+                code.push_back(PackedOp{ uint32_t(uint64_t(arg) >> 32) });
+                continue;
+            }
+            switch (op.m_type) {
+            case BFOp::Type::Mod:
+            case BFOp::Type::SetValue:
+                code.push_back(narrow(type, (value & 0xff) | uint32_t(uint16_t(op.m_offset)) << 8));
+                break;
+            case BFOp::Type::In:
+            case BFOp::Type::Out:
+                code.push_back(narrow(type, uint32_t(op.m_offset) & 0xffffff));
+                break;
+            case BFOp::Type::MulAdd:
+                code.push_back(narrow(type, (value & 0xff) | uint32_t(uint8_t(op.m_offset)) << 8 | uint32_t(uint8_t(arg)) << 16));
+                break;
+            default:
+                code.push_back(narrow(type, uint32_t(arg) & 0xffffff));
+                break;
+            }
+        }
+
+        // pairs don't overlap, the first one found wins
+        for (size_t i = 0; i + 1 < bytecode.size(); i++) {
+            auto const fused = fused_type(bytecode[i].m_type, bytecode[i + 1].m_type);
+            if (fused == 0 || position[i + 1] - position[i] != 1 || position[i + 2] - position[i + 1] != 1)
+                continue;
+            auto& word = code[position[i]].word;
+            word = (word & ~uint32_t(0xff)) | fused;
+            i++;
+        }
+        return code;
+    }
+
+    auto op_index(std::span<PackedOp const> code, size_t pos) -> size_t {
+        size_t index = 0;
+        for (size_t at = 0; at < pos; index++)
+            (void)unpack(code, at);
+        return index;
+    }
+    auto op_position(std::span<PackedOp const> code, size_t index) -> size_t {
+        size_t pos = 0;
+        for (size_t i = 0; i < index && pos < code.size(); i++)
+            (void)unpack(code, pos);
+        return pos;
+    }
+
+}
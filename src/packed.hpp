@@ -0,0 +1,157 @@
+#pragma once
+
+#include "parser.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace bfjit {
+
+    // BFOp packed in a single 32 bit word: the low byte is the BFOp::Type and the
+    // other 24 bits hold the operands. Operations whose operands don't fit are
+    // stored as a WIDE word followed by WIDE_WORDS words with the full values.
+    //
+    //   Mod, SetValue   value:8  offset:16
+    //   In, Out         offset:24
+    //   ModPtr, Scan    delta:24
+    //   LoopBeg/End     distance:24, from this word to the one after the matching op
+    //   MulAdd          factor:8 offset:8 target:8 (target relative to offset)
+    //   Halt            reason:24
+    //   WIDE            type:8, then offset:32 value:32 argument:64
+    //
+    // Values and factors are sign extended from 8 bits (or 32 bits when
+    // wide) to the cell width. A wide Mod or SetValue keeps its value in the
+    // argument instead, cells can be 64 bits wide.
+    //
+    // Superinstructions: when two narrow ops that often run one after the
+    // other follow each other, the first word gets a fused type and the
+    // interpreter runs both with a single dispatch. The second word is left
+    // as it is, so a jump can still land on it. Which pairs are fused is
+    // picked when building (BFJIT_SUPERINSTRUCTIONS in CMakeLists.txt), the
+    // pairs below are the most frequent ones `bfjit_bench -g` found in
+    // examples/.
+    struct PackedOp {
+        static constexpr uint8_t WIDE = 0xff;
+        static constexpr size_t WIDE_WORDS = 4;
+        static constexpr uint8_t MULADD_SETVALUE = 0x10;
+        static constexpr uint8_t MODPTR_LOOPEND = 0x11;
+        static constexpr uint8_t SETVALUE_MODPTR = 0x12;
+        static constexpr uint8_t LOOPEND_MULADD = 0x13;
+
+        uint32_t word;
+
+        [[nodiscard]]
+        auto type() const -> uint8_t { return uint8_t(word); }
+        // type() of the first op of a fused pair, or type() itself
+        [[nodiscard]]
+        auto unfused_type() const -> uint8_t {
+            switch (type()) {
+            case MULADD_SETVALUE: return uint8_t(BFOp::Type::MulAdd);
+            case MODPTR_LOOPEND: return uint8_t(BFOp::Type::ModPtr);
+            case SETVALUE_MODPTR: return uint8_t(BFOp::Type::SetValue);
+            case LOOPEND_MULADD: return uint8_t(BFOp::Type::LoopEnd);
+            default: return type();
+            }
+        }
+        // bits 8..31, sign extended
+        [[nodiscard]]
+        auto operand() const -> int32_t { return int32_t(word) >> 8; }
+        [[nodiscard]]
+        auto byte(int n) const -> uint8_t { return uint8_t(word >> (8 * n)); }
+        // bits 16..31, sign extended
+        [[nodiscard]]
+        auto high() const -> int16_t { return int16_t(word >> 16); }
+    };
+    static_assert(sizeof(PackedOp) == 4);
+
+    // the fused type for `first` followed by `second`, 0 if this build doesn't
+    // fuse them
+    [[nodiscard]]
+    constexpr auto fused_type(BFOp::Type first, BFOp::Type second) -> uint8_t {
+#ifdef BFJIT_FUSE_MULADD_SETVALUE
+        if (first == BFOp::Type::MulAdd && second == BFOp::Type::SetValue)
+            return PackedOp::MULADD_SETVALUE;
+#endif
+#ifdef BFJIT_FUSE_MODPTR_LOOPEND
+        if (first == BFOp::Type::ModPtr && second == BFOp::Type::LoopEnd)
+            return PackedOp::MODPTR_LOOPEND;
+#endif
+#ifdef BFJIT_FUSE_SETVALUE_MODPTR
+        if (first == BFOp::Type::SetValue && second == BFOp::Type::ModPtr)
+            return PackedOp::SETVALUE_MODPTR;
+#endif
+#ifdef BFJIT_FUSE_LOOPEND_MULADD
+        if (first == BFOp::Type::LoopEnd && second == BFOp::Type::MulAdd)
+            return PackedOp::LOOPEND_MULADD;
+#endif
+        return 0;
+    }
+
+    // Loop jumps in the result are relative, so it can't be modified after packing
+    [[nodiscard]]
+    auto pack(std::span<BFOp const> bytecode, size_t cell_width = 1) -> std::vector<PackedOp>;
+
+    // Decodes the operation at `pos` and moves `pos` past it. The loop_arg of
+    // LoopBeg and LoopEnd is the position right after the matching operation.
+    [[nodiscard]]
+    inline auto unpack(std::span<PackedOp const> code, size_t& pos) -> BFOp {
+        auto const at = pos;
+        auto const op = code[pos++];
+        if (op.type() == PackedOp::WIDE) [[unlikely]] {
+            auto const offset = int32_t(code[pos].word);
+            auto const value = code[pos + 1].word;
+            auto const arg = int64_t(uint64_t(code[pos + 2].word) | uint64_t(code[pos + 3].word) << 32);
+            pos += PackedOp::WIDE_WORDS;
+            auto const type = BFOp::Type(op.byte(1));
+            switch (type) {
+            case BFOp::Type::Mod:
+                return BFOp{ .m_type = type, .m_offset = offset, .inc_arg = uint64_t(arg) };
+            case BFOp::Type::SetValue:
+                return BFOp{ .m_type = type, .m_offset = offset, .set_arg = uint64_t(arg) };
+            case BFOp::Type::ModPtr:
+                return BFOp{ .m_type = type, .inc_ptr_arg = arg };
+            case BFOp::Type::Scan:
+                return BFOp{ .m_type = type, .scan_arg = arg };
+            case BFOp::Type::LoopBeg:
+            case BFOp::Type::LoopEnd:
+                return BFOp{ .m_type = type, .loop_arg = size_t(int64_t(at) + arg) };
+            case BFOp::Type::MulAdd:
+                return BFOp{ .m_type = type, .m_offset = offset, .mul_arg = { .offset = int32_t(arg), .factor = int32_t(value) } };
+            default:
+                return BFOp{ .m_type = type, .m_offset = offset };
+            }
+        }
+        auto const type = BFOp::Type(op.unfused_type());
+        switch (type) {
+        case BFOp::Type::Mod:
+            return BFOp{ .m_type = type, .m_offset = op.high(), .inc_arg = uint64_t(int64_t(int8_t(op.byte(1)))) };
+        case BFOp::Type::SetValue:
+            return BFOp{ .m_type = type, .m_offset = op.high(), .set_arg = uint64_t(int64_t(int8_t(op.byte(1)))) };
+        case BFOp::Type::In:
+        case BFOp::Type::Out:
+            return BFOp{ .m_type = type, .m_offset = op.operand() };
+        case BFOp::Type::ModPtr:
+            return BFOp{ .m_type = type, .inc_ptr_arg = op.operand() };
+        case BFOp::Type::Scan:
+            return BFOp{ .m_type = type, .scan_arg = op.operand() };
+        case BFOp::Type::LoopBeg:
+        case BFOp::Type::LoopEnd:
+            return BFOp{ .m_type = type, .loop_arg = size_t(int64_t(at) + op.operand()) };
+        case BFOp::Type::MulAdd:
+            return BFOp{ .m_type = type, .m_offset = int8_t(op.byte(2)), .mul_arg = { .offset = int8_t(op.byte(3)), .factor = int8_t(op.byte(1)) } };
+        case BFOp::Type::Halt:
+            return BFOp{ .m_type = type, .halt_reason = BFOp::HaltReason(op.operand()) };
+        }
+        return BFOp{ .m_type = type };
+    }
+
+    // index in the bytecode `code` was packed from of the operation at `pos`,
+    // the size of the bytecode for code.size()
+    [[nodiscard]]
+    auto op_index(std::span<PackedOp const> code, size_t pos) -> size_t;
+    // position of the operation at `index` of the bytecode, the other way around
+    [[nodiscard]]
+    auto op_position(std::span<PackedOp const> code, size_t index) -> size_t;
+
+}
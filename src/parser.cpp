@@ -3,13 +3,16 @@
 #include "fmt/core.h"
 #include <algorithm>
 #include <iterator>
-#include <stack>
+#include <thread>
+#include <utility>
 #include <fmt/format.h>
 #include <fmt/color.h>
 
 namespace bfjit {
     [[noreturn]]
     void panic_not_opened_loop();
+    [[noreturn]]
+    void panic_not_closed_loop();
 
     auto skip_comment(std::string_view program) -> std::string_view {
         if (program.starts_with("[")) {
@@ -32,41 +35,169 @@ namespace bfjit {
         return program;
     }
     auto parse_program(std::string_view program) -> std::vector<BFOp> {
-        auto ret = std::vector<BFOp>();
-        ret.reserve(std::min<size_t>(program.size(), 1024 * 1024));
-        
-        program = skip_comment(program);
-        std::stack<size_t> loop_stack;
+        Parser parser;
+        parser.feed(program);
+        parser.require_balanced();
+        return parser.finish();
+    }
+    auto try_parse_program(std::string_view program) -> std::optional<std::vector<BFOp>> {
+        Parser parser;
+        parser.feed(program);
+        if (!parser.balanced())
+            return std::nullopt;
+        return parser.finish();
+    }
+
+    namespace {
+        // Folds a Mod or ModPtr into the last op of `ops` when it's of the same
+        // type, dropping both if they cancel out. False if it's not.
+        bool fold_into(std::vector<BFOp>& ops, BFOp const& op) {
+            if (ops.empty() || ops.back().m_type != op.m_type)
+                return false;
+            auto& last = ops.back();
+            if (op.m_type == BFOp::Type::Mod)
+                last.inc_arg += op.inc_arg;
+            else if (op.m_type == BFOp::Type::ModPtr)
+                last.inc_ptr_arg += op.inc_ptr_arg;
+            else
+                return false;
+            if ((op.m_type == BFOp::Type::Mod && last.inc_arg == 0) || (op.m_type == BFOp::Type::ModPtr && last.inc_ptr_arg == 0))
+                ops.pop_back();
+            return true;
+        }
+    }
+
+    void Parser::feed(std::string_view chunk, size_t threads) {
+        // can't be split, what's in it depends on what came before
+        chunk = chunk.substr(skip_leading_comment(chunk));
 
-        for (auto const& ch : program) {
-            auto const c_pos = ret.size();
+        threads = std::max<size_t>(1, std::min(threads, chunk.size() / MIN_PIECE_SIZE));
+        if (threads == 1) {
+            append(lex(chunk, m_position));
+        } else {
+            // runs and loops split between pieces are put back together by append()
+            auto const piece_size = (chunk.size() + threads - 1) / threads;
+            std::vector<Segment> segments(threads);
+            std::vector<std::thread> pool;
+            for (size_t i = 0; i < threads; i++) {
+                auto const begin = i * piece_size;
+                pool.emplace_back([&, i, begin]() {
+                    segments[i] = lex(chunk.substr(begin, piece_size), m_position + begin);
+                });
+            }
+            for (auto& thread : pool)
+                thread.join();
+            for (auto const& segment : segments)
+                append(segment);
+        }
+        m_position += chunk.size();
+    }
 
-            switch (ch) {
-                case '+': ret.push_back( BFOp{ .m_type = BFOp::Type::Mod, .inc_arg = 1   } ); break;
-                case '-': ret.push_back( BFOp{ .m_type = BFOp::Type::Mod, .inc_arg = 255 } ); break;
-                case '<': ret.push_back( BFOp{ .m_type = BFOp::Type::ModPtr, .inc_ptr_arg = -1 } ); break;
-                case '>': ret.push_back( BFOp{ .m_type = BFOp::Type::ModPtr, .inc_ptr_arg =  1 } ); break;
-                case '.': ret.push_back( BFOp{ .m_type = BFOp::Type::Out } ); break;
-                case ',': ret.push_back( BFOp{ .m_type = BFOp::Type::In } ); break;
+    auto Parser::lex(std::string_view text, size_t source_pos) -> Segment {
+        Segment segment;
+        auto& ops = segment.ops;
+        std::vector<size_t> loop_stack;
+        auto fold = [&](BFOp const& op) {
+            if (!fold_into(ops, op))
+                ops.push_back(op);
+        };
+        for (size_t i = 0; i < text.size(); i++) {
+            auto const c_pos = ops.size();
+            switch (text[i]) {
+                case '+': fold( BFOp{ .m_type = BFOp::Type::Mod, .inc_arg = 1 } ); break;
+                case '-': fold( BFOp{ .m_type = BFOp::Type::Mod, .inc_arg = UINT64_MAX } ); break;
+                case '<': fold( BFOp{ .m_type = BFOp::Type::ModPtr, .inc_ptr_arg = -1 } ); break;
+                case '>': fold( BFOp{ .m_type = BFOp::Type::ModPtr, .inc_ptr_arg =  1 } ); break;
+                case '.': ops.push_back( BFOp{ .m_type = BFOp::Type::Out } ); break;
+                case ',': ops.push_back( BFOp{ .m_type = BFOp::Type::In } ); break;
                 case '[':
-                    loop_stack.push( c_pos );
-                    ret.push_back( BFOp{ .m_type = BFOp::Type::LoopBeg, .loop_arg = c_pos } );
+                    loop_stack.push_back( c_pos );
+                    segment.loop_positions.push_back( source_pos + i );
+                    ops.push_back( BFOp{ .m_type = BFOp::Type::LoopBeg, .loop_arg = c_pos } );
                     break;
                 case ']':
                     if (loop_stack.empty()) {
-                        panic_not_opened_loop();
+                        segment.closes_outer.push_back( c_pos );
+                        ops.push_back( BFOp{ .m_type = BFOp::Type::LoopEnd, .loop_arg = c_pos } );
                     } else {
-                        auto loop_beg = loop_stack.top();
-                        loop_stack.pop();
-                        ret.push_back( BFOp{ .m_type = BFOp::Type::LoopEnd, .loop_arg = loop_beg } );
-                        ret[loop_beg].loop_arg = c_pos;
+                        auto loop_beg = loop_stack.back();
+                        loop_stack.pop_back();
+                        ops.push_back( BFOp{ .m_type = BFOp::Type::LoopEnd, .loop_arg = loop_beg } );
+                        ops[loop_beg].loop_arg = c_pos;
                     }
                     break;
                 default: break;
             }
         }
+        segment.left_open = std::move(loop_stack);
+        return segment;
+    }
 
-        return ret;
+    void Parser::append(Segment const& segment) {
+        // a run can continue from the previous segment, loops are never folded
+        // so only ops before the first one can go
+        size_t first = 0;
+        while (first < segment.ops.size() && fold_into(m_bytecode, segment.ops[first]))
+            first++;
+        auto const offset = m_bytecode.size() - first;
+        m_bytecode.reserve(m_bytecode.size() + segment.ops.size() - first);
+        for (size_t i = first; i < segment.ops.size(); i++) {
+            auto op = segment.ops[i];
+            if (op.m_type == BFOp::Type::LoopBeg || op.m_type == BFOp::Type::LoopEnd)
+                op.loop_arg += offset;
+            m_bytecode.push_back(op);
+        }
+        for (auto const local : segment.closes_outer) {
+            // left pointing at itself, finish() gives bytecode nothing runs
+            if (m_loop_stack.empty()) {
+                m_unopened_loop = true;
+                continue;
+            }
+            auto const loop_beg = m_loop_stack.back();
+            m_loop_stack.pop_back();
+            m_bytecode[local + offset].loop_arg = loop_beg;
+            m_bytecode[loop_beg].loop_arg = local + offset;
+        }
+        for (auto const local : segment.left_open)
+            m_loop_stack.push_back(local + offset);
+        m_loop_positions.insert(m_loop_positions.end(), segment.loop_positions.begin(), segment.loop_positions.end());
+    }
+
+    auto Parser::balanced() const -> bool {
+        return !m_unopened_loop && m_loop_stack.empty();
+    }
+    void Parser::require_balanced() const {
+        if (m_unopened_loop)
+            panic_not_opened_loop();
+        if (!m_loop_stack.empty())
+            panic_not_closed_loop();
+    }
+
+    auto Parser::skip_leading_comment(std::string_view chunk) -> size_t {
+        size_t i = 0;
+        // same as skip_comment()
+        if (m_position == 0 && chunk.starts_with('[')) {
+            m_comment_depth = 1;
+            i = 1;
+        }
+        for (; m_comment_depth > 0 && i < chunk.size(); i++) {
+            if (chunk[i] == '[')
+                m_comment_depth++;
+            else if (chunk[i] == ']')
+                m_comment_depth--;
+        }
+        m_position += i;
+        return i;
+    }
+
+    auto Parser::finish(std::vector<size_t>* loop_positions) -> std::vector<BFOp> {
+        if (m_comment_depth != 0) {
+            fmt::print(fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
+            fmt::print(": program stars with a comment but ends before the comment\n");
+        }
+        if (loop_positions)
+            *loop_positions = std::move(m_loop_positions);
+        return std::move(m_bytecode);
     }
 
     void panic_not_opened_loop() {
@@ -74,4 +205,9 @@ namespace bfjit {
         fmt::print(": program contains a loop ending operator (\"]\") that has no corresponding loop begining operator (\"[\")\n");
         std::abort();
     }
+    void panic_not_closed_loop() {
+        fmt::print(fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
+        fmt::print(": program contains a loop begining operator (\"[\") that has no corresponding loop ending operator (\"]\")\n");
+        std::abort();
+    }
 }
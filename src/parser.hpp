@@ -1,5 +1,6 @@
 #pragma once
 
+#include <optional>
 #include <vector>
 #include <string_view>
 #include <cstdint>
@@ -17,23 +18,121 @@ namespace bfjit {
 
             // Optimized operations
             SetValue,
+            MulAdd,
+            Scan,
             Halt,
         } m_type;
         enum class HaltReason {
             InfiniteLoop
         };
+        // data[ptr + m_offset + offset] += data[ptr + m_offset] * factor
+        struct MulArg {
+            int32_t offset;
+            // sign extended from the cell width, so -1 is -1 whatever it is
+            int32_t factor;
+        };
+        // cell the operation works on, relative to the data pointer. Only used by
+        // Mod, SetValue, In, Out and MulAdd, loops always test data[ptr]
+        int32_t m_offset = 0;
+        // Mod and SetValue amounts wrap around like the cells do, only the low
+        // cell width bytes of them count
         union {
-            uint8_t inc_arg;
-            uint8_t set_arg;
+            uint64_t inc_arg;
+            uint64_t set_arg;
             int64_t inc_ptr_arg;
+            int64_t scan_arg;
             size_t loop_arg;
             HaltReason halt_reason;
+            MulArg mul_arg;
         };
     };
 
+    static_assert(sizeof(BFOp) == 16);
+
+    // every value a cell `cell_width` bytes wide can hold
+    [[nodiscard]]
+    constexpr auto cell_mask(size_t cell_width) -> uint64_t {
+        return cell_width >= 8 ? UINT64_MAX : (uint64_t(1) << (8 * cell_width)) - 1;
+    }
+    // `value` truncated to a cell and read as signed
+    [[nodiscard]]
+    constexpr auto sign_extend_cell(uint64_t value, size_t cell_width) -> int64_t {
+        auto const unused = 64 - 8 * int(cell_width);
+        return int64_t(value << unused) >> unused;
+    }
+
     [[nodiscard]]
     auto skip_comment(std::string_view program) -> std::string_view;
+    // aborts (after saying why) if the loops of `program` don't match
     [[nodiscard]]
     auto parse_program(std::string_view program) -> std::vector<BFOp>;
+    // nullopt if the loops of `program` don't match, for whoever can't be
+    // aborted by a bad program
+    [[nodiscard]]
+    auto try_parse_program(std::string_view program) -> std::optional<std::vector<BFOp>>;
+
+    // Parses a program fed to it in pieces, so a source doesn't have to be in
+    // memory all at once. Runs of + and - (or < and >) are folded into a single
+    // op as they are read, so the bytecode grows with the folded program
+    // rather than with the text. parse_program() is a single feed().
+    //
+    // Big chunks can be lexed on several threads: every piece becomes a
+    // Segment with the loops inside of it already matched, and only the loops
+    // that cross pieces are matched when the segments are appended in order.
+    class Parser {
+    public:
+        Parser() = default;
+        ~Parser() = default;
+        Parser(Parser const&) = delete;
+        Parser(Parser &&) = delete;
+        Parser& operator = (Parser const&) = delete;
+        Parser& operator = (Parser &&) = delete;
+
+        // the next `chunk` bytes of the source
+        void feed(std::string_view chunk, size_t threads = 1);
+        // false once a `]` had no `[`, or while a `[` isn't closed. The
+        // bytecode finish() gives for a program that isn't can't be run
+        [[nodiscard]]
+        auto balanced() const -> bool;
+        // aborts (after saying why) unless balanced()
+        void require_balanced() const;
+        // `loop_positions` gets where the `[` of every LoopBeg is in the
+        // source, in the order of the bytecode, for the profiler
+        [[nodiscard]]
+        auto finish(std::vector<size_t>* loop_positions = nullptr) -> std::vector<BFOp>;
+
+        // smallest piece a thread is given to lex
+        static constexpr size_t MIN_PIECE_SIZE = 256 * 1024;
+
+    private:
+        // Bytecode of a piece of the source lexed on its own. Loops matched
+        // inside of it have their loop_arg relative to its start, the others
+        // point at themselves.
+        struct Segment {
+            std::vector<BFOp> ops;
+            // LoopEnd whose LoopBeg is in an earlier piece, in order
+            std::vector<size_t> closes_outer;
+            // LoopBeg whose LoopEnd is in a later piece, innermost last
+            std::vector<size_t> left_open;
+            // in the source, of every LoopBeg in order
+            std::vector<size_t> loop_positions;
+        };
+        [[nodiscard]]
+        static auto lex(std::string_view text, size_t source_pos) -> Segment;
+        void append(Segment const& segment);
+        // of the comment loop the program may start with, returns the bytes of
+        // `chunk` that are part of it
+        auto skip_leading_comment(std::string_view chunk) -> size_t;
+
+        std::vector<BFOp> m_bytecode;
+        std::vector<size_t> m_loop_positions;
+        std::vector<size_t> m_loop_stack;
+        // a `]` had no `[`
+        bool m_unopened_loop = false;
+        // in the source of the next byte fed
+        size_t m_position = 0;
+        // nesting of the comment loop the program starts with, while in it
+        uint64_t m_comment_depth = 0;
+    };
 
 }
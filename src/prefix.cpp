@@ -0,0 +1,102 @@
+#include "prefix.hpp"
+#include "interpreter.hpp"
+#include "io.hpp"
+#include "optimizer.hpp"
+#include "packed.hpp"
+#include "parser.hpp"
+#include "tape.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace bfjit {
+
+    namespace {
+        // collects what the program prints while it runs ahead of time
+        class StringSink : public OutputSink {
+        public:
+            explicit StringSink(std::string& out) :
+                m_out(out)
+            {}
+
+            void write(std::span<uint8_t const> data) override {
+                m_out.append(data.begin(), data.end());
+            }
+        private:
+            std::string& m_out;
+        };
+
+        // Ops that put a zeroed tape into the state of `tape` and leave the
+        // pointer on `ptr`
+        void restore_tape(std::span<uint8_t const> tape, size_t ptr, std::vector<BFOp>& out) {
+            size_t pos = 0;
+            for (size_t i = 0; i < tape.size(); i++) {
+                if (tape[i] == 0)
+                    continue;
+                if (i - pos > INT32_MAX) {
+                    out.push_back( BFOp{ .m_type = BFOp::Type::ModPtr, .inc_ptr_arg = int64_t(i - pos) } );
+                    pos = i;
+                }
+                out.push_back( BFOp{ .m_type = BFOp::Type::SetValue, .m_offset = int32_t(i - pos), .set_arg = tape[i] } );
+            }
+            if (ptr != pos)
+                out.push_back( BFOp{ .m_type = BFOp::Type::ModPtr, .inc_ptr_arg = int64_t(ptr) - int64_t(pos) } );
+        }
+        // Ops that continue `bytecode` from `ip`. Jumping into a loop isn't
+        // possible, so the rest of every iteration we're in is copied out
+        // before the loop itself. Leaves loop_arg stale.
+        void continue_from(std::span<BFOp const> bytecode, size_t ip, std::vector<BFOp>& out) {
+            auto const loops = build_loop_tree(bytecode);
+            // innermost loop whose body ip is in, LoopEnd included
+            auto inner = LoopInfo::NO_PARENT;
+            for (size_t i = 0; i < loops.size() && loops[i].begin < ip; i++)
+                if (ip <= loops[i].end)
+                    inner = i;
+            for (; inner != LoopInfo::NO_PARENT; inner = loops[inner].parent) {
+                auto const& loop = loops[inner];
+                out.insert(out.end(), bytecode.begin() + ip, bytecode.begin() + loop.end);
+                out.insert(out.end(), bytecode.begin() + loop.begin, bytecode.begin() + loop.end + 1);
+                ip = loop.end + 1;
+            }
+            out.insert(out.end(), bytecode.begin() + ip, bytecode.end());
+        }
+    }
+
+    auto evaluate_prefix(std::span<BFOp const> bytecode, CLIOpts const& cli_opts, uint64_t budget) -> std::optional<Residual> {
+        Residual residual{ .output = {}, .bytecode = {}, .steps = 0 };
+        // only the pages the program touches get memory, see tape.cpp
+        Tape tape(cli_opts.tape_size, 0);
+        StringSink sink(residual.output);
+        std::array<uint8_t, 4096> storage;
+        OutputBuffer output(sink, storage);
+        // never read, it stops before the first In
+        InputBuffer input(std::span<uint8_t const>{}, cli_opts.eof_behavior);
+        Interpreter interpreter(bytecode, cli_opts, tape, output, input);
+
+        // highest pointer the program was on, every cell it wrote is within
+        // max_cell_reach() of one of those
+        size_t top = 0;
+        while (residual.steps < budget && !interpreter.finished()) {
+            auto pos = interpreter.m_ip;
+            if (unpack(interpreter.m_bytecode, pos).m_type == BFOp::Type::In)
+                break;
+            if (!interpreter.run_one_step())
+                return std::nullopt;
+            residual.steps++;
+            top = std::max(top, interpreter.m_ptr);
+        }
+        output.flush();
+        // nothing left to run, the tape doesn't matter anymore
+        if (interpreter.finished())
+            return residual;
+        auto const touched = std::min(tape.size(), top + max_cell_reach(bytecode) + 1);
+        restore_tape(std::span(tape.data(), touched), interpreter.m_ptr, residual.bytecode);
+        continue_from(bytecode, interpreter.op_index(), residual.bytecode);
+        do_loop_relink(residual.bytecode);
+        return residual;
+    }
+
+}
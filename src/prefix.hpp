@@ -0,0 +1,31 @@
+#pragma once
+
+#include "options.hpp"
+#include "parser.hpp"
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace bfjit {
+
+    // What is left of a program once the part that doesn't depend on input
+    // has been run ahead of time
+    struct Residual {
+        // printed by the part that already ran, has to be written before
+        // `bytecode` runs
+        std::string output;
+        // sets the tape up the way it was left and continues from there
+        std::vector<BFOp> bytecode;
+        // interpreter steps run ahead of time, a fused pair of ops is one
+        uint64_t steps;
+    };
+
+    // Runs `bytecode` until it's about to read input, ends or has executed
+    // `budget` ops. Returns nullopt when it fails or halts before that, the
+    // program should then run unchanged so the error is reported as usual.
+    [[nodiscard]]
+    auto evaluate_prefix(std::span<BFOp const> bytecode, CLIOpts const& cli_opts, uint64_t budget) -> std::optional<Residual>;
+
+}
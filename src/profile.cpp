@@ -0,0 +1,66 @@
+#include "profile.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <fmt/format.h>
+#include <string>
+
+namespace bfjit {
+
+    LoopProfile::LoopProfile(std::span<BFOp const> bytecode) {
+        std::vector<size_t> open;
+        for (auto const& op : bytecode) {
+            switch (op.m_type) {
+            case BFOp::Type::LoopBeg:
+                open.push_back(m_loops.size());
+                m_loops.push_back(Loop{ .ops = 0 });
+                break;
+            case BFOp::Type::LoopEnd:
+                m_loops[open.back()].ops++;
+                open.pop_back();
+                break;
+            default:
+                if (open.empty())
+                    m_top_level_ops++;
+                else
+                    m_loops[open.back()].ops++;
+                break;
+            }
+        }
+        m_counters.resize(m_loops.size());
+    }
+
+    void LoopProfile::report(std::string_view source, std::span<size_t const> loop_positions, size_t top) const {
+        // every LoopBeg test, then the body and the LoopEnd test per iteration
+        auto ops_run = [&](size_t loop) {
+            return m_counters[loop].entries + m_counters[loop].iterations * m_loops[loop].ops;
+        };
+        double total = double(m_top_level_ops);
+        std::vector<size_t> order;
+        for (size_t i = 0; i < m_loops.size(); i++) {
+            total += double(ops_run(i));
+            if (m_counters[i].entries != 0)
+                order.push_back(i);
+        }
+        auto const shown = std::min(top, order.size());
+        std::partial_sort(order.begin(), order.begin() + shown, order.end(), [&](size_t a, size_t b) { return ops_run(a) > ops_run(b); });
+
+        fmt::print(stderr, "Hottest loops ({} of {} that ran, by share of the ops run):\n", shown, order.size());
+        fmt::print(stderr, "{:>8} {:>14} {:>12} {:>10}  {}\n", "share", "iterations", "entries", "avg trip", "line:column");
+        for (size_t i = 0; i < shown; i++) {
+            auto const loop = order[i];
+            auto const& counters = m_counters[loop];
+            auto where = std::string("?");
+            if (loop < loop_positions.size()) {
+                auto const before = source.substr(0, std::min(loop_positions[loop], source.size()));
+                auto const line = std::count(before.begin(), before.end(), '\n') + 1;
+                auto const line_start = before.rfind('\n');
+                auto const column = line_start == std::string_view::npos ? before.size() + 1 : before.size() - line_start;
+                where = fmt::format("{}:{}", line, column);
+            }
+            fmt::print(stderr, "{:>7.2f}% {:>14} {:>12} {:>10.1f}  {}\n",
+                100.0 * double(ops_run(loop)) / total, counters.iterations, counters.entries,
+                double(counters.iterations) / double(counters.entries), where);
+        }
+    }
+
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "parser.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace bfjit {
+
+    // What the backends count for every loop when profiling
+    struct LoopCounters {
+        // times the loop was reached
+        uint64_t entries = 0;
+        // times its body ran
+        uint64_t iterations = 0;
+    };
+
+    // The loops of a program, numbered in the order their LoopBeg appear in
+    // the bytecode, which is how every backend finds its LoopCounters.
+    class LoopProfile {
+    public:
+        explicit LoopProfile(std::span<BFOp const> bytecode);
+        ~LoopProfile() = default;
+        LoopProfile(LoopProfile const&) = delete;
+        LoopProfile(LoopProfile &&) = delete;
+        LoopProfile& operator = (LoopProfile const&) = delete;
+        LoopProfile& operator = (LoopProfile &&) = delete;
+
+        [[nodiscard]]
+        auto counters() -> std::span<LoopCounters> { return m_counters; }
+        // Prints the `top` loops that ran the most ops to stderr, with the
+        // line and column of their `[` in `source`, found in `loop_positions`
+        // (see Parser::finish()) by loop number. Ops of nested loops count
+        // for the innermost loop only, and a Scan or a MulAdd counts as one.
+        void report(std::string_view source, std::span<size_t const> loop_positions, size_t top) const;
+
+    private:
+        struct Loop {
+            // in the body and not in a nested loop, plus the LoopEnd test
+            size_t ops;
+        };
+        std::vector<Loop> m_loops;
+        std::vector<LoopCounters> m_counters;
+        // outside of every loop, each of them runs once at most
+        size_t m_top_level_ops = 0;
+    };
+
+}
@@ -0,0 +1,145 @@
+#include "scan.hpp"
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace bfjit {
+    namespace {
+#if defined(__AVX2__)
+        constexpr size_t WINDOW = 32;
+        auto zero_mask(uint8_t const* data) -> uint32_t {
+            auto const v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(data));
+            return uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+        }
+#elif defined(__SSE2__) || defined(_M_X64)
+        constexpr size_t WINDOW = 16;
+        auto zero_mask(uint8_t const* data) -> uint32_t {
+            auto const v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(data));
+            return uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())));
+        }
+#elif defined(__ARM_NEON)
+        constexpr size_t WINDOW = 16;
+        auto zero_mask(uint8_t const* data) -> uint32_t {
+            static constexpr uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+            auto const eq = vceqzq_u8(vld1q_u8(data));
+            auto const bits = vandq_u8(eq, vld1q_u8(weights));
+            return uint32_t(vaddv_u8(vget_low_u8(bits))) | (uint32_t(vaddv_u8(vget_high_u8(bits))) << 8);
+        }
+#else
+        constexpr size_t WINDOW = 8;
+        auto zero_mask(uint8_t const* data) -> uint32_t {
+            uint32_t mask = 0;
+            for (size_t i = 0; i < WINDOW; i++)
+                mask |= uint32_t(data[i] == 0) << i;
+            return mask;
+        }
+#endif
+        static_assert(WINDOW <= 32);
+
+        // zero_mask() where bit i only stays set if the Cell starting at byte
+        // i is all zero, the patterns only look at the first bytes of cells
+        template<typename Cell>
+        auto zero_cell_mask(uint8_t const* data) -> uint32_t {
+            auto mask = zero_mask(data);
+            for (size_t width = 1; width < sizeof(Cell); width *= 2)
+                mask &= mask >> width;
+            return mask;
+        }
+
+        // Bits of the cells of a window that are visited by a scan `stride`
+        // bytes at a time starting at the first (forward) or last (backward)
+        // `width` bytes cell of the window
+        struct Pattern {
+            uint32_t forward = 0;
+            uint32_t backward = 0;
+            size_t step = 0;
+        };
+        auto make_pattern(size_t stride, size_t width) -> Pattern {
+            Pattern p;
+            p.step = (WINDOW / stride) * stride;
+            for (size_t j = 0; j < p.step; j += stride) {
+                p.forward |= uint32_t(1) << j;
+                p.backward |= uint32_t(1) << (WINDOW - width - j);
+            }
+            return p;
+        }
+
+        // `size`, `idx` and `stride` count cells, the windows bytes
+        template<typename Cell>
+        auto scan_forward(uint8_t const* data, size_t size, size_t idx, size_t stride) -> size_t {
+            constexpr size_t WIDTH = sizeof(Cell);
+            if (stride <= WINDOW / WIDTH) {
+                auto const p = make_pattern(stride * WIDTH, WIDTH);
+                while ((idx + WINDOW / WIDTH) <= size) {
+                    if (auto const mask = zero_cell_mask<Cell>(data + idx * WIDTH) & p.forward; mask != 0)
+                        return idx + size_t(std::countr_zero(mask)) / WIDTH;
+                    idx += p.step / WIDTH;
+                }
+            }
+            auto const* cells = reinterpret_cast<Cell const*>(data);
+            for (; idx < size; idx += stride)
+                if (cells[idx] == 0)
+                    return idx;
+            return SCAN_NOT_FOUND;
+        }
+        template<typename Cell>
+        auto scan_backward(uint8_t const* data, size_t idx, size_t stride) -> size_t {
+            constexpr size_t WIDTH = sizeof(Cell);
+            constexpr size_t CELLS = WINDOW / WIDTH;
+            if (stride <= CELLS) {
+                auto const p = make_pattern(stride * WIDTH, WIDTH);
+                while (idx >= CELLS - 1) {
+                    auto const start = idx - (CELLS - 1);
+                    if (auto const mask = zero_cell_mask<Cell>(data + start * WIDTH) & p.backward; mask != 0)
+                        return start + size_t(31 - std::countl_zero(mask)) / WIDTH;
+                    if (idx < p.step / WIDTH)
+                        return SCAN_NOT_FOUND;
+                    idx -= p.step / WIDTH;
+                }
+            }
+            auto const* cells = reinterpret_cast<Cell const*>(data);
+            while (true) {
+                if (cells[idx] == 0)
+                    return idx;
+                if (idx < stride)
+                    return SCAN_NOT_FOUND;
+                idx -= stride;
+            }
+        }
+    }
+
+    template<typename Cell>
+    auto scan_zero_cells(uint8_t const* data, size_t size, size_t idx, int64_t stride) -> size_t {
+        if (idx >= size)
+            return SCAN_NOT_FOUND;
+        if (stride == 0)
+            return reinterpret_cast<Cell const*>(data)[idx] == 0 ? idx : SCAN_NOT_FOUND;
+        if (stride > 0)
+            return scan_forward<Cell>(data, size, idx, size_t(stride));
+        return scan_backward<Cell>(data, idx, size_t(-stride));
+    }
+    auto scan_zero(uint8_t const* data, size_t size, size_t idx, int64_t stride) -> size_t {
+        return scan_zero_cells<uint8_t>(data, size, idx, stride);
+    }
+    template auto scan_zero_cells<uint8_t>(uint8_t const*, size_t, size_t, int64_t) -> size_t;
+    template auto scan_zero_cells<uint16_t>(uint8_t const*, size_t, size_t, int64_t) -> size_t;
+    template auto scan_zero_cells<uint32_t>(uint8_t const*, size_t, size_t, int64_t) -> size_t;
+    template auto scan_zero_cells<uint64_t>(uint8_t const*, size_t, size_t, int64_t) -> size_t;
+
+    auto scan_zero_for(size_t cell_width) -> size_t (*)(uint8_t const*, size_t, size_t, int64_t) {
+        switch (cell_width) {
+        case 2: return scan_zero_cells<uint16_t>;
+        case 4: return scan_zero_cells<uint32_t>;
+        case 8: return scan_zero_cells<uint64_t>;
+        default: return scan_zero;
+        }
+    }
+}
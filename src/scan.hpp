@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace bfjit {
+
+    constexpr size_t SCAN_NOT_FOUND = SIZE_MAX;
+
+    // Index of the first zero cell in idx, idx + stride, idx + 2*stride, ...
+    // SCAN_NOT_FOUND if the search would leave [0, size) before finding one.
+    // Called directly from JIT code, so it must not be overloaded.
+    [[nodiscard]]
+    auto scan_zero(uint8_t const* data, size_t size, size_t idx, int64_t stride) -> size_t;
+
+    // scan_zero() on a tape of Cell sized cells, `size`, `idx` and the result
+    // count cells. The uint8_t one is scan_zero() itself
+    template<typename Cell>
+    [[nodiscard]]
+    auto scan_zero_cells(uint8_t const* data, size_t size, size_t idx, int64_t stride) -> size_t;
+    // the scan_zero_cells() for cells `cell_width` bytes wide, for JIT code
+    // to call
+    [[nodiscard]]
+    auto scan_zero_for(size_t cell_width) -> size_t (*)(uint8_t const*, size_t, size_t, int64_t);
+
+}
@@ -0,0 +1,193 @@
+#include "snapshot.hpp"
+#include "cache.hpp"
+#include "options.hpp"
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <signal.h>
+#include <cstring>
+#include <filesystem>
+#include <fmt/color.h>
+#include <fmt/format.h>
+#include <fstream>
+#include <system_error>
+#include <unistd.h>
+
+namespace bfjit {
+
+    namespace {
+        // bumped whenever the layout of a snapshot file changes
+        constexpr char MAGIC[8] = { 'b', 'f', 'j', 'i', 't', 's', 0, 1 };
+
+        // followed by page_count offsets, then the pages themselves
+        struct SnapshotHeader {
+            char magic[8];
+            uint64_t bytecode_hash;
+            uint64_t cell_width;
+            uint64_t ip;
+            uint64_t ptr;
+            uint64_t input_position;
+            uint64_t output_position;
+            uint64_t tape_size;
+            uint64_t page_count;
+        };
+
+        std::atomic<bool> stop_flag{ false };
+        static_assert(std::atomic<bool>::is_always_lock_free);
+
+        void on_stop_signal(int sig) {
+            if (stop_flag.exchange(true, std::memory_order_relaxed)) {
+                signal(sig, SIG_DFL);
+                raise(sig);
+            }
+        }
+
+        void print_error(std::string_view message, char const* path) {
+            fmt::print(fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
+            fmt::print(": {}: {}\n", message, path);
+        }
+    }
+
+    void Snapshot::save_tape(std::span<uint8_t const> tape) {
+        tape_size = tape.size();
+        page_offsets.clear();
+        pages.clear();
+        for (size_t offset = 0; offset < tape.size(); offset += PAGE_SIZE) {
+            auto const page = tape.subspan(offset, std::min(PAGE_SIZE, tape.size() - offset));
+            if (std::all_of(page.begin(), page.end(), [](uint8_t byte) { return byte == 0; }))
+                continue;
+            page_offsets.push_back(offset);
+            pages.insert(pages.end(), page.begin(), page.end());
+            // the last page is padded, every page is PAGE_SIZE in the file
+            pages.resize(page_offsets.size() * PAGE_SIZE, 0);
+        }
+    }
+    void Snapshot::restore_tape(std::span<uint8_t> tape) const {
+        for (size_t i = 0; i < page_offsets.size(); i++) {
+            auto const size = std::min<size_t>(PAGE_SIZE, tape.size() - page_offsets[i]);
+            std::memcpy(tape.data() + page_offsets[i], pages.data() + i * PAGE_SIZE, size);
+        }
+    }
+
+    auto bytecode_hash(std::span<BFOp const> bytecode) -> uint64_t {
+        Hasher hasher;
+        hasher.add(MAGIC);
+        hasher.add(bytecode.size());
+        for (auto const& op : bytecode) {
+            hasher.add(op.m_type);
+            hasher.add(op.m_offset);
+            switch (op.m_type) {
+            case BFOp::Type::MulAdd:
+                hasher.add(op.mul_arg.offset);
+                hasher.add(op.mul_arg.factor);
+                break;
+            case BFOp::Type::Halt:
+                hasher.add(op.halt_reason);
+                break;
+            case BFOp::Type::In:
+            case BFOp::Type::Out:
+                break;
+            default:
+                hasher.add(op.inc_arg);
+                break;
+            }
+        }
+        return hasher.value;
+    }
+
+    auto write_snapshot(char const* path, Snapshot const& snapshot) -> bool {
+        SnapshotHeader header;
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.bytecode_hash = snapshot.bytecode_hash;
+        header.cell_width = snapshot.cell_width;
+        header.ip = snapshot.ip;
+        header.ptr = snapshot.ptr;
+        header.input_position = snapshot.input_position;
+        header.output_position = snapshot.output_position;
+        header.tape_size = snapshot.tape_size;
+        header.page_count = snapshot.page_offsets.size();
+
+        auto temporary = std::filesystem::path(path);
+        temporary += fmt::format(".{}.tmp", getpid());
+        auto handle = std::ofstream( temporary, std::ios::binary | std::ios::trunc );
+        handle.write(reinterpret_cast<char const*>(&header), sizeof(header));
+        handle.write(reinterpret_cast<char const*>(snapshot.page_offsets.data()), std::streamsize(snapshot.page_offsets.size() * sizeof(uint64_t)));
+        handle.write(reinterpret_cast<char const*>(snapshot.pages.data()), std::streamsize(snapshot.pages.size()));
+        handle.close();
+        std::error_code error;
+        if (!handle) {
+            std::filesystem::remove(temporary, error);
+            print_error("could not write the snapshot", path);
+            return false;
+        }
+        std::filesystem::rename(temporary, path, error);
+        if (error) {
+            std::filesystem::remove(temporary, error);
+            print_error("could not write the snapshot", path);
+            return false;
+        }
+        return true;
+    }
+
+    auto read_snapshot(char const* path) -> std::optional<Snapshot> {
+        auto handle = std::ifstream( path, std::ios::binary );
+        SnapshotHeader header;
+        if (!handle.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+            print_error("could not read the snapshot", path);
+            return std::nullopt;
+        }
+        bool const valid = std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0
+            && valid_cell_width(header.cell_width)
+            && header.tape_size <= MAX_TAPE_SIZE * header.cell_width
+            && header.page_count <= header.tape_size / Snapshot::PAGE_SIZE + 1
+            && header.ptr < header.tape_size / header.cell_width;
+        if (!valid) {
+            print_error("not a snapshot of this version of bfjit", path);
+            return std::nullopt;
+        }
+        // before allocating anything, a corrupted page_count could ask for
+        // far more than the file holds
+        std::error_code error;
+        auto const file_size = std::filesystem::file_size(path, error);
+        if (error || header.page_count * (Snapshot::PAGE_SIZE + sizeof(uint64_t)) + sizeof(header) > file_size) {
+            print_error("the snapshot is truncated or corrupted", path);
+            return std::nullopt;
+        }
+
+        Snapshot snapshot{
+            .bytecode_hash = header.bytecode_hash,
+            .cell_width = header.cell_width,
+            .ip = header.ip,
+            .ptr = header.ptr,
+            .input_position = header.input_position,
+            .output_position = header.output_position,
+            .tape_size = header.tape_size,
+            .page_offsets = std::vector<uint64_t>(header.page_count),
+            .pages = std::vector<uint8_t>(header.page_count * Snapshot::PAGE_SIZE),
+        };
+        handle.read(reinterpret_cast<char*>(snapshot.page_offsets.data()), std::streamsize(header.page_count * sizeof(uint64_t)));
+        handle.read(reinterpret_cast<char*>(snapshot.pages.data()), std::streamsize(snapshot.pages.size()));
+        bool const in_tape = std::all_of(snapshot.page_offsets.begin(), snapshot.page_offsets.end(), [&](uint64_t offset) {
+            return offset < header.tape_size && offset % Snapshot::PAGE_SIZE == 0;
+        });
+        if (!handle || !in_tape) {
+            print_error("the snapshot is truncated or corrupted", path);
+            return std::nullopt;
+        }
+        return snapshot;
+    }
+
+    void install_stop_handler() {
+        // without SA_RESTART, so a read(2) waiting for input gives up
+        struct sigaction sa;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_stop_signal;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGTERM, &sa, nullptr);
+        sigaction(SIGINT, &sa, nullptr);
+    }
+    auto stop_requested() -> bool {
+        return stop_flag.load(std::memory_order_relaxed);
+    }
+
+}
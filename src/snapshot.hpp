@@ -0,0 +1,63 @@
+#pragma once
+
+#include "parser.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace bfjit {
+
+    // Where a stopped program was, enough for another process to carry on
+    // with the same bytecode and the same input. Only taken right before a
+    // LoopBeg, a LoopEnd or a Halt, where every engine can start running, the
+    // JIT can't enter a block in the middle. The interpreter also stops right
+    // before an In it was waiting for input at, which only it can resume.
+    struct Snapshot {
+        static constexpr size_t PAGE_SIZE = 4096;
+
+        // of the bytecode that was running, see bytecode_hash()
+        uint64_t bytecode_hash = 0;
+        size_t cell_width = 1;
+        // operation of the bytecode that runs next
+        size_t ip = 0;
+        // in cells
+        size_t ptr = 0;
+        // bytes of the input the program read and of the output it wrote
+        uint64_t input_position = 0;
+        uint64_t output_position = 0;
+        // bytes of the tape it ran on
+        size_t tape_size = 0;
+        // Only the pages of the tape that aren't all zero are kept, PAGE_SIZE
+        // bytes of `pages` for every offset of `page_offsets`
+        std::vector<uint64_t> page_offsets;
+        std::vector<uint8_t> pages;
+
+        void save_tape(std::span<uint8_t const> tape);
+        // `tape` must be all zero and at least tape_size bytes
+        void restore_tape(std::span<uint8_t> tape) const;
+    };
+
+    // Tells apart bytecode that can't run each other's snapshots, which is
+    // any change of the source or the optimizations
+    [[nodiscard]]
+    auto bytecode_hash(std::span<BFOp const> bytecode) -> uint64_t;
+    // Written to a temporary file and renamed, so a program killed while
+    // writing keeps its previous snapshot. False (after saying why) if it
+    // couldn't be written.
+    [[nodiscard]]
+    auto write_snapshot(char const* path, Snapshot const& snapshot) -> bool;
+    // nullopt (after saying why) if `path` can't be read or isn't a snapshot
+    [[nodiscard]]
+    auto read_snapshot(char const* path) -> std::optional<Snapshot>;
+
+    // From then on the first SIGTERM or SIGINT only makes stop_requested()
+    // true, so the program can be stopped where it can be snapshotted, and
+    // interrupts a read(2) waiting for input. A second one terminates it as
+    // usual.
+    void install_stop_handler();
+    [[nodiscard]]
+    auto stop_requested() -> bool;
+
+}
@@ -0,0 +1,63 @@
+#include "source.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <fcntl.h>
+#include <fmt/color.h>
+#include <fmt/format.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace bfjit {
+    [[noreturn]]
+    void panic_source(char const* message);
+
+    SourceFile::SourceFile(char const* path) {
+        auto const fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            panic_source("file can't be opened");
+        struct stat info;
+        if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+            close(fd);
+            panic_source("file is not a regular file");
+        }
+        m_size = size_t(info.st_size);
+        // mmap can't map nothing
+        if (m_size != 0) {
+            auto* const mapping = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                close(fd);
+                panic_source("file can't be mapped");
+            }
+            m_data = static_cast<char const*>(mapping);
+            madvise(mapping, m_size, MADV_SEQUENTIAL);
+        }
+        close(fd);
+    }
+
+    SourceFile::~SourceFile() {
+        if (m_data != nullptr)
+            munmap(const_cast<char*>(m_data), m_size);
+    }
+
+    auto SourceFile::parse(size_t threads, std::vector<size_t>* loop_positions) const -> std::vector<BFOp> {
+        Parser parser;
+        auto const step = CHUNK_SIZE * std::max<size_t>(1, threads);
+        for (size_t pos = 0; pos < m_size; pos += step) {
+            auto const size = std::min(step, m_size - pos);
+            parser.feed(text().substr(pos, size), threads);
+            // CHUNK_SIZE is a multiple of the page size, so only the last
+            // chunk can end in the middle of a page, which madvise rounds up
+            madvise(const_cast<char*>(m_data) + pos, size, MADV_DONTNEED);
+        }
+        parser.require_balanced();
+        return parser.finish(loop_positions);
+    }
+
+    void panic_source(char const* message) {
+        fmt::print(fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
+        fmt::print(": {}\n", message);
+        std::abort();
+    }
+
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "parser.hpp"
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+namespace bfjit {
+
+    // A program's source mapped in memory instead of copied into a string, so
+    // even sources of hundreds of MB only cost the pages being looked at
+    class SourceFile {
+    public:
+        // aborts (after saying why) if `path` can't be mapped
+        explicit SourceFile(char const* path);
+        ~SourceFile();
+        SourceFile(SourceFile const&) = delete;
+        SourceFile(SourceFile &&) = delete;
+        SourceFile& operator = (SourceFile const&) = delete;
+        SourceFile& operator = (SourceFile &&) = delete;
+
+        [[nodiscard]]
+        auto text() const -> std::string_view { return { m_data, m_size }; }
+        // Parses the source CHUNK_SIZE bytes per thread at a time, handing the
+        // pages back to the kernel once they're parsed. They are read again
+        // from the file if text() is looked at later. See Parser::finish()
+        // for `loop_positions`. Aborts (after saying why) if the loops of the
+        // source don't match.
+        [[nodiscard]]
+        auto parse(size_t threads = 1, std::vector<size_t>* loop_positions = nullptr) const -> std::vector<BFOp>;
+
+        static constexpr size_t CHUNK_SIZE = 1024 * 1024;
+
+    private:
+        char const* m_data = nullptr;
+        size_t m_size = 0;
+    };
+
+}
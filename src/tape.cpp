@@ -0,0 +1,146 @@
+#include "tape.hpp"
+#include "io.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <fmt/format.h>
+#include <fmt/color.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace bfjit {
+    [[noreturn]]
+    void panic_tape_alloc(size_t size);
+
+#ifndef _WIN32
+    namespace {
+        // Mappings that contain guard pages. Looked up from the signal handler,
+        // so it's a fixed table of atomics instead of anything allocating.
+        struct GuardedRegion {
+            std::atomic<uintptr_t> begin{0};
+            std::atomic<uintptr_t> end{0};
+        };
+        std::array<GuardedRegion, 64> guarded_regions;
+        struct sigaction previous_segv;
+        struct sigaction previous_bus;
+
+        void on_fault(int sig, siginfo_t* info, void*) {
+            auto const addr = uintptr_t(info->si_addr);
+            for (auto const& region : guarded_regions) {
+                if (addr >= region.begin.load(std::memory_order_relaxed) && addr < region.end.load(std::memory_order_relaxed)) {
+                    flush_all_outputs();
+                    constexpr char msg[] = "trying to access data outside of bouds\n";
+                    [[maybe_unused]] auto _ = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+                    _exit(1);
+                }
+            }
+            // not one of ours, let whoever was there before handle it
+            sigaction(sig, sig == SIGSEGV ? &previous_segv : &previous_bus, nullptr);
+        }
+        void install_fault_handler() {
+            static std::once_flag once;
+            std::call_once(once, []() {
+                struct sigaction sa;
+                std::memset(&sa, 0, sizeof(sa));
+                sa.sa_sigaction = on_fault;
+                sa.sa_flags = SA_SIGINFO;
+                sigemptyset(&sa.sa_mask);
+                sigaction(SIGSEGV, &sa, &previous_segv);
+                sigaction(SIGBUS, &sa, &previous_bus);
+            });
+        }
+        void register_region(uint8_t* begin, size_t size) {
+            for (auto& region : guarded_regions) {
+                uintptr_t expected = 0;
+                if (region.begin.compare_exchange_strong(expected, uintptr_t(begin))) {
+                    region.end.store(uintptr_t(begin) + size);
+                    return;
+                }
+            }
+            fmt::print(fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
+            fmt::print(": too many guarded tapes alive\n");
+            std::abort();
+        }
+        void unregister_region(uint8_t* begin) {
+            for (auto& region : guarded_regions) {
+                if (region.begin.load() == uintptr_t(begin)) {
+                    region.end.store(0);
+                    region.begin.store(0);
+                    return;
+                }
+            }
+        }
+    }
+
+    auto Tape::rounded_size(size_t size) -> size_t {
+        auto const page = size_t(sysconf(_SC_PAGESIZE));
+        return (std::max<size_t>(size, 1) + page - 1) / page * page;
+    }
+    Tape::Tape(size_t size, size_t guard_size) {
+        m_size = rounded_size(size);
+        m_guard_size = guard_size == 0 ? 0 : rounded_size(guard_size);
+        m_region_size = m_size + 2 * m_guard_size;
+
+        auto const region = mmap(nullptr, m_region_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (region == MAP_FAILED)
+            panic_tape_alloc(m_region_size);
+        m_region = static_cast<uint8_t*>(region);
+        m_data = m_region + m_guard_size;
+        if (mprotect(m_data, m_size, PROT_READ | PROT_WRITE) != 0)
+            panic_tape_alloc(m_size);
+
+        if (m_guard_size != 0) {
+            install_fault_handler();
+            register_region(m_region, m_region_size);
+        }
+    }
+    Tape::~Tape() {
+        if (m_region == nullptr)
+            return;
+        if (m_guard_size != 0)
+            unregister_region(m_region);
+        munmap(m_region, m_region_size);
+    }
+#else
+    // no guard pages on windows, the JIT keeps its bounds checks
+    auto Tape::rounded_size(size_t size) -> size_t {
+        return std::max<size_t>(size, 1);
+    }
+    Tape::Tape(size_t size, size_t) {
+        m_size = rounded_size(size);
+        m_guard_size = 0;
+        m_region_size = m_size;
+        m_region = static_cast<uint8_t*>(VirtualAlloc(nullptr, m_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+        if (m_region == nullptr)
+            panic_tape_alloc(m_size);
+        m_data = m_region;
+    }
+    Tape::~Tape() {
+        if (m_region != nullptr)
+            VirtualFree(m_region, 0, MEM_RELEASE);
+    }
+#endif
+
+    Tape::Tape() :
+        m_region(nullptr),
+        m_region_size(0),
+        m_data(nullptr),
+        m_size(0),
+        m_guard_size(0)
+    {}
+
+    void panic_tape_alloc(size_t size) {
+        fmt::print(fmt::fg(fmt::color::red) | fmt::emphasis::bold, "error");
+        fmt::print(": could not allocate a tape of {} bytes\n", size);
+        std::abort();
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace bfjit {
+
+    // Zero initialized data buffer for the programs. The memory is reserved up
+    // front but only committed when touched, so big tapes are cheap. When
+    // `guard_size` is not zero the buffer is surrounded by inaccessible pages
+    // of (at least) that size and any access to them terminates the program
+    // with an out of bounds error, which lets the JIT skip bounds checks.
+    class Tape {
+    public:
+        Tape(size_t size, size_t guard_size);
+        // holds nothing, for a JIT that only generates code
+        Tape();
+        ~Tape();
+        Tape(Tape const&) = delete;
+        Tape(Tape &&) = delete;
+        Tape& operator = (Tape const&) = delete;
+        Tape& operator = (Tape &&) = delete;
+
+        [[nodiscard]]
+        auto data() -> uint8_t* { return m_data; }
+        [[nodiscard]]
+        auto data() const -> uint8_t const* { return m_data; }
+        // rounded up to the page size
+        [[nodiscard]]
+        auto size() const -> size_t { return m_size; }
+        [[nodiscard]]
+        auto guarded() const -> bool { return m_guard_size != 0; }
+        [[nodiscard]]
+        auto guard_size() const -> size_t { return m_guard_size; }
+        // size() of a tape of `size` bytes
+        [[nodiscard]]
+        static auto rounded_size(size_t size) -> size_t;
+
+        auto operator [] (size_t idx) -> uint8_t& { return m_data[idx]; }
+        auto operator [] (size_t idx) const -> uint8_t const& { return m_data[idx]; }
+
+    private:
+        uint8_t* m_region;
+        size_t m_region_size;
+        uint8_t* m_data;
+        size_t m_size;
+        size_t m_guard_size;
+    };
+
+}
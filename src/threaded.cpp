@@ -0,0 +1,213 @@
+#include "threaded.hpp"
+#include "optimizer.hpp"
+#include "parser.hpp"
+#include "scan.hpp"
+#include <cstdlib>
+#include <cstdint>
+#include <fmt/format.h>
+#include <span>
+#include <utility>
+
+// GCC and Clang can jump straight to the next handler (labels as values),
+// anything else dispatches with a switch over the decoded operations
+#if defined(__GNUC__) || defined(__clang__)
+#define BFJIT_COMPUTED_GOTO 1
+#endif
+
+namespace bfjit {
+
+    auto threaded_decode(std::span<BFOp const> bytecode, bool checked) -> std::vector<ThreadedOp> {
+        using Opcode = ThreadedOp::Opcode;
+        std::vector<ThreadedOp> code;
+        code.reserve(bytecode.size() + 1);
+        // first decoded operation of every bytecode operation, checks included
+        std::vector<size_t> position(bytecode.size() + 1);
+        // decoded loop operation and the bytecode index it jumps after
+        std::vector<std::pair<size_t, size_t>> jumps;
+
+        auto push = [&](Opcode opcode, int32_t offset = 0, uint8_t value = 0, int64_t delta = 0) {
+            auto& op = code.emplace_back();
+            op.handler = nullptr;
+            op.opcode = opcode;
+            op.value = value;
+            op.offset = offset;
+            op.delta = delta;
+        };
+        for (size_t i = 0; i < bytecode.size(); i++) {
+            auto const& op = bytecode[i];
+            position[i] = code.size();
+
+            // same as the JITs, check the whole range a block touches when entering it
+            if (checked && (i == 0 || bytecode[i - 1].m_type == BFOp::Type::LoopBeg || bytecode[i - 1].m_type == BFOp::Type::LoopEnd || bytecode[i - 1].m_type == BFOp::Type::ModPtr || bytecode[i - 1].m_type == BFOp::Type::Scan)) {
+                auto const [min, max] = block_offset_range(bytecode.subspan(i));
+                if (min < 0 || max > 0)
+                    push(Opcode::Check, int32_t(min), 0, max);
+            }
+
+            switch (op.m_type) {
+            case BFOp::Type::Mod:
+                push(Opcode::Mod, op.m_offset, uint8_t(op.inc_arg));
+                break;
+            case BFOp::Type::ModPtr:
+                push(checked ? Opcode::ModPtrChecked : Opcode::ModPtr, 0, 0, op.inc_ptr_arg);
+                break;
+            case BFOp::Type::In:
+                push(Opcode::In, op.m_offset);
+                break;
+            case BFOp::Type::Out:
+                push(Opcode::Out, op.m_offset);
+                break;
+            case BFOp::Type::LoopBeg:
+                jumps.emplace_back(code.size(), op.loop_arg + 1);
+                push(Opcode::LoopBeg);
+                break;
+            case BFOp::Type::LoopEnd:
+                jumps.emplace_back(code.size(), op.loop_arg + 1);
+                push(Opcode::LoopEnd);
+                break;
+            case BFOp::Type::SetValue:
+                push(Opcode::SetValue, op.m_offset, uint8_t(op.set_arg));
+                break;
+            case BFOp::Type::MulAdd:
+                push(checked ? Opcode::MulAddChecked : Opcode::MulAdd, op.m_offset, uint8_t(op.mul_arg.factor), int64_t(op.m_offset) + op.mul_arg.offset);
+                break;
+            case BFOp::Type::Scan:
+                push(Opcode::Scan, 0, 0, op.scan_arg);
+                break;
+            case BFOp::Type::Halt:
+                push(Opcode::Halt);
+                break;
+            }
+        }
+        position[bytecode.size()] = code.size();
+        push(Opcode::End);
+
+        for (auto const& [from, to] : jumps)
+            code[from].jump = &code[position[to]];
+        return code;
+    }
+
+    ThreadedInterpreter::ThreadedInterpreter(std::span<BFOp const> bytecode, bfjit::CLIOpts const& cli_opts) :
+        // guard pages must be wider than anything the code can reach unchecked
+        m_buffer(cli_opts.tape_size, cli_opts.checked_tape ? 0 : max_cell_reach(bytecode) + 1),
+        m_ptr(0),
+        m_code(threaded_decode(bytecode, cli_opts.checked_tape)),
+        m_output(1, cli_opts.line_buffered),
+        m_input(0, cli_opts.eof_behavior, &m_output)
+    {
+    }
+
+    void ThreadedInterpreter::run_until_end() {
+        auto* const data = m_buffer.data();
+        auto const size = m_buffer.size();
+        auto* p = data + m_ptr;
+        ThreadedOp const* op = m_code.data();
+
+        // is the cell at `offset` from p outside of the tape?
+        auto outside = [&](int64_t offset) {
+            return uint64_t(p - data + offset) >= size;
+        };
+
+#ifdef BFJIT_COMPUTED_GOTO
+        // same order as ThreadedOp::Opcode
+        static void const* const handlers[] = {
+            &&op_Mod, &&op_ModPtr, &&op_ModPtrChecked, &&op_In, &&op_Out,
+            &&op_LoopBeg, &&op_LoopEnd, &&op_SetValue, &&op_MulAdd,
+            &&op_MulAddChecked, &&op_Scan, &&op_Halt, &&op_Check, &&op_End,
+        };
+        for (auto& decoded : m_code)
+            decoded.handler = handlers[size_t(decoded.opcode)];
+#define OP(name) op_##name
+#define DISPATCH() goto *op->handler
+#else
+        using Opcode = ThreadedOp::Opcode;
+#define OP(name) case Opcode::name
+#define DISPATCH() continue
+#endif
+#define NEXT() op++; DISPATCH()
+
+#ifdef BFJIT_COMPUTED_GOTO
+        DISPATCH();
+#else
+        for (;;) switch (op->opcode) {
+#endif
+        OP(Mod):
+            p[op->offset] += op->value;
+            NEXT();
+        OP(ModPtr):
+            p += op->delta;
+            NEXT();
+        OP(ModPtrChecked):
+            if (outside(op->delta))
+                goto outside_bounds;
+            p += op->delta;
+            NEXT();
+        OP(In):
+            p[op->offset] = m_input.next_or(p[op->offset]);
+            NEXT();
+        OP(Out):
+            m_output.put(p[op->offset]);
+            NEXT();
+        OP(LoopBeg):
+            if (*p == 0) {
+                op = op->jump;
+                DISPATCH();
+            }
+            NEXT();
+        OP(LoopEnd):
+            if (*p != 0) {
+                op = op->jump;
+                DISPATCH();
+            }
+            NEXT();
+        OP(SetValue):
+            p[op->offset] = op->value;
+            NEXT();
+        OP(MulAdd):
+            // the original loop never runs on a zero cell, so it never touches the target either
+            if (auto const value = p[op->offset]; value != 0)
+                p[op->delta] += uint8_t(value * op->value);
+            NEXT();
+        OP(MulAddChecked):
+            if (auto const value = p[op->offset]; value != 0) {
+                if (outside(op->delta))
+                    goto outside_bounds;
+                p[op->delta] += uint8_t(value * op->value);
+            }
+            NEXT();
+        OP(Scan): {
+            auto const idx = scan_zero(data, size, size_t(p - data), op->delta);
+            if (idx == SCAN_NOT_FOUND)
+                goto outside_bounds;
+            p = data + idx;
+            NEXT();
+        }
+        OP(Halt):
+            if (*p == 0) {
+                NEXT();
+            }
+            m_output.flush();
+            fmt::print("halted, reason: infinte loop reached\n");
+            goto done;
+        OP(Check):
+            if (outside(op->offset) || outside(op->delta))
+                goto outside_bounds;
+            NEXT();
+        OP(End):
+            goto done;
+#ifndef BFJIT_COMPUTED_GOTO
+        }
+#endif
+#undef NEXT
+#undef DISPATCH
+#undef OP
+
+    outside_bounds:
+        m_output.flush();
+        m_out_of_bounds = true;
+        fmt::print(stderr, "trying to access data outside of bouds\n");
+    done:
+        m_ptr = size_t(p - data);
+        m_output.flush();
+    }
+}
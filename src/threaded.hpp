@@ -0,0 +1,73 @@
+#pragma once
+
+#include "options.hpp"
+#include "io.hpp"
+#include "parser.hpp"
+#include "tape.hpp"
+#include <cstdint>
+#include <vector>
+#include <span>
+
+namespace bfjit {
+
+    // Bytecode decoded for the threaded interpreter. Jumps are resolved to
+    // pointers and `handler` is the address of the code running the operation,
+    // so dispatching is a single indirect jump.
+    struct ThreadedOp {
+        enum class Opcode : uint8_t {
+            Mod,
+            ModPtr,
+            ModPtrChecked,
+            In,
+            Out,
+            LoopBeg,
+            LoopEnd,
+            SetValue,
+            MulAdd,
+            MulAddChecked,
+            Scan,
+            Halt,
+            // bounds check for a whole block, cells offset..delta
+            Check,
+            End,
+        };
+
+        void const* handler;
+        Opcode opcode;
+        // Mod and SetValue amount, MulAdd factor
+        uint8_t value;
+        // cell the operation works on, relative to the data pointer
+        int32_t offset;
+        union {
+            // ModPtr amount, Scan stride, MulAdd target relative to the data pointer
+            int64_t delta;
+            ThreadedOp const* jump;
+        };
+    };
+
+    // Interpreter that doesn't need executable memory, for hosts that forbid it
+    // and for programs short enough that codegen doesn't pay off. Like the JIT
+    // it relies on guard pages unless the tape is checked.
+    struct ThreadedInterpreter {
+        Tape m_buffer;
+        size_t m_ptr;
+        std::vector<ThreadedOp> m_code;
+        OutputBuffer m_output;
+        InputBuffer m_input;
+        // the program accessed data outside of the tape, which stopped it
+        bool m_out_of_bounds = false;
+
+        ThreadedInterpreter(std::span<BFOp const> bytecode, bfjit::CLIOpts const& cli_opts);
+        ~ThreadedInterpreter() = default;
+        ThreadedInterpreter(ThreadedInterpreter const&) = delete;
+        ThreadedInterpreter(ThreadedInterpreter &&) = delete;
+        ThreadedInterpreter& operator = (ThreadedInterpreter const&) = delete;
+        ThreadedInterpreter& operator = (ThreadedInterpreter &&) = delete;
+
+        void run_until_end();
+    };
+
+    [[nodiscard]]
+    auto threaded_decode(std::span<BFOp const> bytecode, bool checked) -> std::vector<ThreadedOp>;
+
+}
@@ -0,0 +1,76 @@
+#include "tiered.hpp"
+#include "packed.hpp"
+#include "parser.hpp"
+#include <cstdint>
+#include <span>
+
+namespace bfjit {
+
+    Tiered::Tiered(std::span<BFOp const> bytecode, bfjit::CLIOpts const& cli_opts) :
+        m_jit(bytecode, cli_opts),
+        m_interpreter(bytecode, cli_opts, m_jit.m_buffer, m_jit.output(), m_jit.input()),
+        m_bytecode(bytecode),
+        m_op_index(m_interpreter.m_bytecode.size(), 0),
+        m_heat(bytecode.size(), 0),
+        m_compiled(bytecode.size(), nullptr)
+    {
+        auto const& code = m_interpreter.m_bytecode;
+        for (size_t pos = 0, index = 0; pos < code.size(); index++) {
+            m_op_index[pos] = index;
+            (void)unpack(code, pos);
+        }
+    }
+
+    auto Tiered::run_one_step() -> bool {
+        auto& interpreter = m_interpreter;
+        if (interpreter.finished())
+            return false;
+
+        auto const& code = interpreter.m_bytecode;
+        auto const pos = interpreter.m_ip;
+        auto const word = code[pos];
+        if (word.unfused_type() == uint8_t(BFOp::Type::LoopBeg)) {
+            if (auto const begin = m_op_index[pos]; m_compiled[begin]) {
+                auto next = pos;
+                return run_compiled(begin, unpack(code, next).loop_arg);
+            }
+        }
+
+        if (!interpreter.run_one_step()) {
+            m_out_of_bounds = interpreter.m_out_of_bounds;
+            return false;
+        }
+
+        // only a LoopEnd jumps backwards, the second word of a fused
+        // ModPtr+LoopEnd if it's one
+        if (interpreter.m_ip < pos) {
+            auto end = word.type() == PackedOp::MODPTR_LOOPEND ? pos + 1 : pos;
+            auto const begin = m_bytecode[m_op_index[end]].loop_arg;
+            // compiled loops start with the LoopBeg test, which passes here,
+            // so jumping into them is the same as taking the back edge
+            if (++m_heat[begin] == HOT_LOOP_THRESHOLD)
+                m_compiled[begin] = m_jit.compile_loop(begin);
+            if (m_compiled[begin]) {
+                (void)unpack(code, end);
+                return run_compiled(begin, end);
+            }
+        }
+        return true;
+    }
+    auto Tiered::run_compiled(size_t begin, size_t after) -> bool {
+        auto& interpreter = m_interpreter;
+        auto const idx = m_compiled[begin](uint64_t(m_jit.m_buffer.data()), interpreter.m_ptr, m_jit.m_inner_data.get());
+        // the compiled loop already said why
+        if (idx == JIT::LOOP_FAILED) {
+            m_out_of_bounds = true;
+            return false;
+        }
+        interpreter.m_ptr = idx;
+        interpreter.m_ip = after;
+        return true;
+    }
+    void Tiered::run_until_end() {
+        while (this->run_one_step());
+        m_interpreter.report_stop();
+    }
+}
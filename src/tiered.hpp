@@ -0,0 +1,51 @@
+#pragma once
+
+#include "interpreter.hpp"
+#include "jit.hpp"
+#include "options.hpp"
+#include "parser.hpp"
+#include <cstdint>
+#include <vector>
+#include <span>
+
+namespace bfjit {
+
+    // Starts interpreting right away and only compiles the loops that turn out
+    // to be hot, so big programs don't wait for codegen before running. The
+    // tape and I/O buffers belong to the JIT, so moving between tiers only
+    // has to pass the data pointer around.
+    struct Tiered {
+        // back edges a loop has to take before it's compiled
+        static constexpr uint32_t HOT_LOOP_THRESHOLD = 1000;
+
+        JIT m_jit;
+        // the cold tier, on the tape and buffers of m_jit
+        Interpreter m_interpreter;
+        std::span<BFOp const> m_bytecode;
+        // index in m_bytecode of the op at every position of the packed
+        // bytecode of m_interpreter
+        std::vector<size_t> m_op_index;
+        // back edges taken, indexed by the position of the LoopBeg
+        std::vector<uint32_t> m_heat;
+        std::vector<JIT::MLoopType> m_compiled;
+        // the program accessed data outside of the tape, which stopped it
+        bool m_out_of_bounds = false;
+
+        Tiered(std::span<BFOp const> bytecode, bfjit::CLIOpts const& cli_opts);
+        ~Tiered() = default;
+        Tiered(Tiered const&) = delete;
+        Tiered(Tiered &&) = delete;
+        Tiered& operator = (Tiered const&) = delete;
+        Tiered& operator = (Tiered &&) = delete;
+
+        void run_until_end();
+
+        [[nodiscard]]
+        auto run_one_step() -> bool;
+        // runs the compiled loop starting at `begin`, then continues at
+        // `after` in the packed bytecode
+        [[nodiscard]]
+        auto run_compiled(size_t begin, size_t after) -> bool;
+    };
+
+}
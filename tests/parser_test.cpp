@@ -0,0 +1,122 @@
+// Parses random programs fed in random pieces on several threads and
+// checks the result against a single feed() on one thread
+#include "parser.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <fmt/format.h>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+    using bfjit::BFOp;
+
+    // long runs of the same op, so they get split between pieces, comments,
+    // and nested loops, optionally a leading comment loop and a stray `]`
+    auto random_program(std::mt19937_64& rng, size_t size, bool balanced) -> std::string {
+        constexpr std::string_view RUN_OPS = "+-<>";
+        constexpr std::string_view OTHER = ".,x \n";
+        std::string text;
+        text.reserve(size + 64);
+        if (rng() % 2)
+            text += "[ leading comment, with [nested] ops +-<>., ]";
+        size_t depth = 0;
+        while (text.size() < size) {
+            switch (rng() % 8) {
+            case 0:
+                text += '[';
+                depth++;
+                break;
+            case 1:
+                if (depth != 0) {
+                    text += ']';
+                    depth--;
+                }
+                break;
+            case 2:
+                text += OTHER[rng() % OTHER.size()];
+                break;
+            default:
+                text.append(1 + rng() % 300, RUN_OPS[rng() % RUN_OPS.size()]);
+            }
+        }
+        text.append(depth, ']');
+        if (!balanced) {
+            auto const at = rng() % text.size();
+            text.insert(text.begin() + at, rng() % 2 ? ']' : '[');
+        }
+        return text;
+    }
+
+    auto same_op(BFOp const& a, BFOp const& b) -> bool {
+        if (a.m_type != b.m_type || a.m_offset != b.m_offset)
+            return false;
+        switch (a.m_type) {
+        case BFOp::Type::Mod: return a.inc_arg == b.inc_arg;
+        case BFOp::Type::ModPtr: return a.inc_ptr_arg == b.inc_ptr_arg;
+        case BFOp::Type::LoopBeg:
+        case BFOp::Type::LoopEnd: return a.loop_arg == b.loop_arg;
+        default: return true;
+        }
+    }
+
+    struct Parsed {
+        bool balanced;
+        std::vector<BFOp> bytecode;
+        std::vector<size_t> loop_positions;
+    };
+
+    auto parse_in_pieces(std::string_view text, std::vector<size_t> const& cuts, size_t threads) -> Parsed {
+        bfjit::Parser parser;
+        size_t pos = 0;
+        for (auto const cut : cuts) {
+            parser.feed(text.substr(pos, cut - pos), threads);
+            pos = cut;
+        }
+        parser.feed(text.substr(pos), threads);
+        Parsed parsed{ .balanced = parser.balanced(), .bytecode = {}, .loop_positions = {} };
+        if (parsed.balanced)
+            parsed.bytecode = parser.finish(&parsed.loop_positions);
+        return parsed;
+    }
+
+}
+
+int main() {
+    constexpr uint64_t SEED = 0x6266'6a69'7470'6172;
+    constexpr size_t ROUNDS = 24;
+    constexpr size_t THREADS[] = { 1, 2, 3, 8 };
+    std::mt19937_64 rng(SEED);
+
+    for (size_t round = 0; round < ROUNDS; round++) {
+        auto const size = bfjit::Parser::MIN_PIECE_SIZE / 2 + rng() % (10 * bfjit::Parser::MIN_PIECE_SIZE);
+        auto const text = random_program(rng, size, round % 4 != 3);
+        auto const expected = parse_in_pieces(text, {}, 1);
+
+        for (auto const threads : THREADS) {
+            // a few big pieces, so they are split between threads, and a
+            // few tiny ones right where a run or the comment may continue
+            std::vector<size_t> cuts;
+            size_t pos = 0;
+            for (size_t i = 0, n = rng() % 6; i < n && pos < text.size(); i++) {
+                pos += rng() % 2 ? 1 + rng() % 64 : rng() % (text.size() - pos);
+                if (pos < text.size())
+                    cuts.push_back(pos);
+            }
+            auto const parsed = parse_in_pieces(text, cuts, threads);
+            auto ok = parsed.balanced == expected.balanced
+                && parsed.bytecode.size() == expected.bytecode.size()
+                && parsed.loop_positions == expected.loop_positions;
+            for (size_t i = 0; ok && i < parsed.bytecode.size(); i++)
+                ok = same_op(parsed.bytecode[i], expected.bytecode[i]);
+            if (!ok) {
+                fmt::print(stderr, "round {}: {} bytes in {} pieces on {} threads don't parse like one feed() (seed {:#x})\n",
+                           round, text.size(), cuts.size() + 1, threads, SEED);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,68 @@
+// Checks scan_zero_cells() against a cell by cell scan on random tapes, for
+// every cell width and for strides below, at and above the window size
+#include "scan.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fmt/format.h>
+#include <random>
+#include <vector>
+
+namespace {
+
+    template<typename Cell>
+    auto naive_scan(uint8_t const* data, size_t size, size_t idx, int64_t stride) -> size_t {
+        for (auto i = int64_t(idx); i >= 0 && i < int64_t(size); i += stride) {
+            Cell cell;
+            std::memcpy(&cell, data + i * sizeof(Cell), sizeof(Cell));
+            if (cell == 0)
+                return size_t(i);
+            if (stride == 0)
+                break;
+        }
+        return bfjit::SCAN_NOT_FOUND;
+    }
+
+    template<typename Cell>
+    auto check(std::mt19937_64& rng, uint64_t seed) -> bool {
+        constexpr size_t ROUNDS = 20000;
+        for (size_t round = 0; round < ROUNDS; round++) {
+            auto const size = 1 + rng() % 300;
+            // mostly non zero cells, some with zero bytes that don't make
+            // the whole cell zero, so the window masks have to rule them out
+            auto const zeros = rng() % 64;
+            std::vector<uint8_t> tape(size * sizeof(Cell));
+            for (size_t i = 0; i < size; i++) {
+                auto* const cell = tape.data() + i * sizeof(Cell);
+                if (rng() % 512 < zeros)
+                    continue;
+                for (size_t b = 0; b < sizeof(Cell); b++)
+                    cell[b] = rng() % 3 == 0 ? 0 : uint8_t(1 + rng() % 255);
+                if (std::all_of(cell, cell + sizeof(Cell), [](uint8_t b) { return b == 0; }))
+                    cell[rng() % sizeof(Cell)] = 1;
+            }
+            auto const idx = rng() % (size + 2);
+            auto const stride = int64_t(rng() % 81) - 40;
+            auto const got = bfjit::scan_zero_cells<Cell>(tape.data(), size, idx, stride);
+            auto const expected = idx < size ? naive_scan<Cell>(tape.data(), size, idx, stride) : bfjit::SCAN_NOT_FOUND;
+            if (got != expected) {
+                fmt::print(stderr, "{} bit cells: scanning {} cells from {} by {} found {}, not {} (seed {:#x})\n",
+                           8 * sizeof(Cell), size, idx, stride, int64_t(got), int64_t(expected), seed);
+                return false;
+            }
+        }
+        return true;
+    }
+
+}
+
+int main() {
+    constexpr uint64_t SEED = 0x7363'616e'7a65'726f;
+    std::mt19937_64 rng(SEED);
+    auto const ok = check<uint8_t>(rng, SEED)
+        && check<uint16_t>(rng, SEED)
+        && check<uint32_t>(rng, SEED)
+        && check<uint64_t>(rng, SEED);
+    return ok ? 0 : 1;
+}